@@ -0,0 +1,79 @@
+#!/bin/bash
+# วัด latency ของห้องเงียบ ระหว่างที่ห้องร้อนยิงเต็มที่ เปรียบเทียบ fifo กับ drr (weighted fair)
+# ห้องร้อน: HOT_CLIENTS คนอยู่ห้อง "hotroom" ยิง CHAT เต็มที่
+# ห้องเงียบ: QUIET_CLIENTS คนอยู่ห้อง "quietroom" ส่งทีละข้อความทุก QUIET_INTERVAL_MS
+# ผลลัพธ์คือบรรทัด [LATENCY] ที่ Server พิมพ์ตอนปิด (ทุกข้อความ และเฉพาะห้องเงียบ: room=quietroom)
+
+# --- การตั้งค่า Test Case ---
+SCHEDULERS="fifo drr"
+THREADS=${THREADS:-2}
+HOT_CLIENTS=${HOT_CLIENTS:-50}
+HOT_MESSAGES=${HOT_MESSAGES:-400}
+QUIET_CLIENTS=${QUIET_CLIENTS:-4}
+QUIET_MESSAGES=${QUIET_MESSAGES:-100}
+QUIET_INTERVAL_MS=${QUIET_INTERVAL_MS:-20}
+ROOM_WEIGHTS=${ROOM_WEIGHTS:-}      # เช่น quietroom:4 (ใช้กับ drr)
+
+mkdir -p log result
+TIMESTAMP=$(date +"%Y%m%d_%H%M%S")
+RESULT_FILE="result/fairness_${TIMESTAMP}.txt"
+
+# ---------------------------------
+# 1. คอมไพล์โปรแกรม
+# ---------------------------------
+echo "Compiling server and load_tester..."
+if ! g++ -O2 -o ../exe/server ../server/server.cpp -lrt -pthread -std=c++17; then
+    echo "Failed to compile server.cpp. Aborting."
+    exit 1
+fi
+if ! g++ -O2 -o ../exe/load_tester load_tester.cpp -lrt -pthread -std=c++17; then
+    echo "Failed to compile load_tester.cpp. Aborting."
+    exit 1
+fi
+
+{
+    echo "====== Fairness Test Results ======"
+    echo "Timestamp: $TIMESTAMP"
+    echo "Threads: $THREADS"
+    echo "Hot room: $HOT_CLIENTS clients x $HOT_MESSAGES messages (full speed)"
+    echo "Quiet room: $QUIET_CLIENTS clients x $QUIET_MESSAGES messages (every ${QUIET_INTERVAL_MS}ms)"
+    echo "Room weights: ${ROOM_WEIGHTS:-(none)}"
+    echo "==================================="
+} > "$RESULT_FILE"
+
+# ---------------------------------
+# 2. ทดสอบแต่ละ scheduler
+# ---------------------------------
+for SCHED in $SCHEDULERS; do
+    echo "--- Testing scheduler: $SCHED ---"
+    SERVER_LOG="log/server_fairness_${SCHED}_${TIMESTAMP}.log"
+    EXTRA=""
+    if [ "$SCHED" = "drr" ] && [ -n "$ROOM_WEIGHTS" ]; then
+        EXTRA="--room-weights=$ROOM_WEIGHTS"
+    fi
+    stdbuf -oL ../exe/server $THREADS --scheduler=$SCHED --latency-room=quietroom $EXTRA > "$SERVER_LOG" 2>&1 &
+    SERVER_PID=$!
+    sleep 1
+
+    CLIENT_PIDS=""
+    for i in $(seq 1 $HOT_CLIENTS); do
+        ../exe/load_tester "hot_$i" $HOT_MESSAGES hotroom > /dev/null 2>&1 &
+        CLIENT_PIDS="$CLIENT_PIDS $!"
+    done
+    for i in $(seq 1 $QUIET_CLIENTS); do
+        ../exe/load_tester "quiet_$i" $QUIET_MESSAGES quietroom $QUIET_INTERVAL_MS > /dev/null 2>&1 &
+        CLIENT_PIDS="$CLIENT_PIDS $!"
+    done
+    for pid in $CLIENT_PIDS; do
+        wait $pid
+    done
+
+    kill -INT $SERVER_PID
+    wait $SERVER_PID 2>/dev/null
+
+    LINES=$(grep "\[LATENCY\]" "$SERVER_LOG")
+    echo "$LINES"
+    echo "$LINES" >> "$RESULT_FILE"
+done
+
+echo "Results saved to: $RESULT_FILE"
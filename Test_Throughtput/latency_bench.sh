@@ -0,0 +1,71 @@
+#!/bin/bash
+# เปรียบเทียบ tail latency ของ scheduler แบบคิวกลาง (fifo) กับ work stealing (steal)
+# งานผสม: BIG_CLIENTS คนอยู่ห้องเดียวกัน (CHAT = fan-out ยาว) + SMALL_CLIENTS คนอยู่ห้องตัวเอง (CHAT สั้นๆ)
+# ผลลัพธ์คือบรรทัด [LATENCY] ที่ Server พิมพ์ตอนปิด (เวลาตั้งแต่รับข้อความจนประมวลผลเสร็จ)
+
+# --- การตั้งค่า Test Case ---
+SCHEDULERS="fifo steal"
+THREADS=${THREADS:-4}
+BIG_CLIENTS=${BIG_CLIENTS:-200}     # จำนวน Client ในห้องใหญ่
+BIG_MESSAGES=${BIG_MESSAGES:-5}     # ข้อความต่อ Client ในห้องใหญ่
+SMALL_CLIENTS=${SMALL_CLIENTS:-50}  # จำนวน Client ที่อยู่ห้องตัวเอง
+SMALL_MESSAGES=${SMALL_MESSAGES:-100}
+
+mkdir -p log result
+TIMESTAMP=$(date +"%Y%m%d_%H%M%S")
+RESULT_FILE="result/latency_${TIMESTAMP}.txt"
+
+# ---------------------------------
+# 1. คอมไพล์โปรแกรม
+# ---------------------------------
+echo "Compiling server and load_tester..."
+if ! g++ -O2 -o ../exe/server ../server/server.cpp -lrt -pthread -std=c++17; then
+    echo "Failed to compile server.cpp. Aborting."
+    exit 1
+fi
+if ! g++ -O2 -o ../exe/load_tester load_tester.cpp -lrt -pthread -std=c++17; then
+    echo "Failed to compile load_tester.cpp. Aborting."
+    exit 1
+fi
+
+{
+    echo "====== Latency Test Results ======"
+    echo "Timestamp: $TIMESTAMP"
+    echo "Threads: $THREADS"
+    echo "Big room: $BIG_CLIENTS clients x $BIG_MESSAGES messages"
+    echo "Own rooms: $SMALL_CLIENTS clients x $SMALL_MESSAGES messages"
+    echo "=================================="
+} > "$RESULT_FILE"
+
+# ---------------------------------
+# 2. ทดสอบแต่ละ scheduler
+# ---------------------------------
+for SCHED in $SCHEDULERS; do
+    echo "--- Testing scheduler: $SCHED ---"
+    SERVER_LOG="log/server_latency_${SCHED}_${TIMESTAMP}.log"
+    stdbuf -oL ../exe/server $THREADS --scheduler=$SCHED > "$SERVER_LOG" 2>&1 &
+    SERVER_PID=$!
+    sleep 1
+
+    CLIENT_PIDS=""
+    for i in $(seq 1 $BIG_CLIENTS); do
+        ../exe/load_tester "big_$i" $BIG_MESSAGES bigroom > /dev/null 2>&1 &
+        CLIENT_PIDS="$CLIENT_PIDS $!"
+    done
+    for i in $(seq 1 $SMALL_CLIENTS); do
+        ../exe/load_tester "small_$i" $SMALL_MESSAGES > /dev/null 2>&1 &
+        CLIENT_PIDS="$CLIENT_PIDS $!"
+    done
+    for pid in $CLIENT_PIDS; do
+        wait $pid
+    done
+
+    kill -INT $SERVER_PID
+    wait $SERVER_PID 2>/dev/null
+
+    LINE=$(grep "\[LATENCY\]" "$SERVER_LOG")
+    echo "$LINE"
+    echo "$LINE" >> "$RESULT_FILE"
+done
+
+echo "Results saved to: $RESULT_FILE"
@@ -14,6 +14,8 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <stdlib.h>
+#include <time.h>
 
 // --- Queue Settings ---
 const char* CONTROL_QUEUE = "/chat_control";
@@ -21,81 +23,322 @@ const long MQ_MSGSIZE = 1024;
 
 std::string g_clientQueueName;
 
-// --- ฟังก์ชันส่งคำสั่ง (จาก client.cpp) ---
+// --- การเชื่อมต่อกับ Server (จาก client.cpp) ---
+// ถือ descriptor ของ CONTROL_QUEUE ไว้ตลอดการทดสอบ แทนการ mq_open/mq_close ทุกข้อความ
+struct ServerConnection {
+    mqd_t mq = (mqd_t)-1;
+
+    ~ServerConnection() { close(); }
+
+    int open() {
+        if (mq != (mqd_t)-1) return 0;
+        mq = mq_open(CONTROL_QUEUE, O_WRONLY);
+        if (mq == (mqd_t)-1) {
+            // ถ้า Server ยังไม่พร้อม ให้ลองใหม่
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            mq = mq_open(CONTROL_QUEUE, O_WRONLY);
+            if (mq == (mqd_t)-1) {
+                int err = errno;
+                std::cerr << "[" << g_clientQueueName << "] Error: Cannot open server queue.\n";
+                return err;
+            }
+        }
+        return 0;
+    }
+
+    void close() {
+        if (mq != (mqd_t)-1) mq_close(mq);
+        mq = (mqd_t)-1;
+    }
+
+    int sendFrame(const std::string& frame) {
+        int err = open();
+        if (err != 0) return err;
+        if (mq_send(mq, frame.c_str(), frame.size() + 1, 0) == -1) {
+            err = errno;
+            std::cerr << "[" << g_clientQueueName << "] Error: mq_send failed: " << strerror(err) << "\n";
+            // descriptor อาจเสีย (เช่น Server restart) ครั้งหน้าเปิดใหม่
+            close();
+            return err;
+        }
+        return 0;
+    }
+
+    //! Pipeline: ยิงหลายข้อความติดกันโดยไม่รอคำตอบ คืนค่าจำนวนที่ส่งสำเร็จ
+    size_t pipeline(const std::vector<std::string>& frames, int& err) {
+        err = 0;
+        size_t sent = 0;
+        for (const auto& f : frames) {
+            err = sendFrame(f);
+            if (err != 0) break;
+            sent++;
+        }
+        return sent;
+    }
+};
+
+ServerConnection g_conn;
+
+// session token จาก Server (SESSION|<token>) ใช้แทนชื่อในทุกคำสั่งหลัง REGISTER
+std::string g_token;
+
 int sendCommand(const std::string& cmd, const std::string& payload) {
-    mqd_t server_mq = mq_open(CONTROL_QUEUE, O_WRONLY);
-    if (server_mq == (mqd_t)-1) {
-        // ถ้า Server ยังไม่พร้อม ให้ลองใหม่
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        server_mq = mq_open(CONTROL_QUEUE, O_WRONLY);
-        if (server_mq == (mqd_t)-1) {
-            std::cerr << "[" << g_clientQueueName << "] Error: Cannot open server queue.\n";
-            return errno;
+    if (cmd == "REGISTER") return g_conn.sendFrame(cmd + "|" + g_clientQueueName + payload);
+    return g_conn.sendFrame(cmd + "|" + g_token + payload);
+}
+
+// --- Flow Control: Server ให้ credit มาทาง "CREDIT|n" (1 credit = 1 คำสั่ง) ---
+int g_credits = 0;
+mqd_t g_reply_mq = (mqd_t)-1;
+
+// อ่านคิวตอบกลับจนกว่าจะได้ credit (เก็บ SESSION token ด้วย, ข้อความอื่นทิ้งไป)
+// คืนค่า false ถ้ารอเกิน 5 วินาที (Server อาจล่ม)
+bool waitForCredit() {
+    char buf[MQ_MSGSIZE];
+    while (g_credits <= 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 5;
+        ssize_t bytes = mq_timedreceive(g_reply_mq, buf, MQ_MSGSIZE, nullptr, &ts);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "[" << g_clientQueueName << "] Error: No credit from server: " << strerror(errno) << "\n";
+            return false;
+        }
+        if (strncmp(buf, "CREDIT|", 7) == 0) g_credits += atoi(buf + 7);
+        else if (strncmp(buf, "SESSION|", 8) == 0) g_token = buf + 8;
+    }
+    return true;
+}
+
+// --- Multiplexed mode (--mux=<n>): n user ใน process เดียว ใช้คิวตอบกลับคิวเดียวร่วมกัน ---
+// ลงทะเบียนด้วยคิว "<queue>#<k>" ทุกข้อความจาก Server มี header "@<k>[,<k>...]|" บอกว่าถึง user ไหน
+// (ข้อความในห้องที่ถึงหลาย user ของเราพร้อมกันมาเป็นข้อความเดียว)
+struct MuxUser {
+    std::string name;
+    std::string token;
+    int credits = 0;
+    int sent = 0;
+};
+std::vector<MuxUser> g_mux;
+long long g_mux_frames = 0;       // ข้อความที่อ่านจากคิว (ไม่นับ CREDIT / SESSION)
+long long g_mux_deliveries = 0;   // จำนวนผู้รับรวมใน header ของข้อความเหล่านั้น
+
+// อ่านทุกข้อความที่ค้างอยู่ในคิวร่วม (รอข้อความแรกได้ไม่เกิน wait_ms) แล้วแจก CREDIT / SESSION ตาม header
+// คืนค่าจำนวนข้อความที่อ่านได้, -1 ถ้า error
+int pumpMux(int wait_ms) {
+    char buf[MQ_MSGSIZE];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += wait_ms / 1000;
+    ts.tv_nsec += (wait_ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    int got = 0;
+    while (true) {
+        ssize_t bytes = mq_timedreceive(g_reply_mq, buf, MQ_MSGSIZE, nullptr, &ts);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            return (errno == ETIMEDOUT) ? got : -1;
+        }
+        got++;
+        clock_gettime(CLOCK_REALTIME, &ts); // (ข้อความถัดไป: ไม่รอ)
+
+        char* bar = strchr(buf, '|');
+        if (buf[0] != '@' || bar == nullptr) continue;
+        *bar = '\0';
+        const char* body = bar + 1;
+        bool control = (strncmp(body, "CREDIT|", 7) == 0 || strncmp(body, "SESSION|", 8) == 0);
+        if (!control) g_mux_frames++;
+        for (char* tag = strtok(buf + 1, ","); tag != nullptr; tag = strtok(nullptr, ",")) {
+            size_t k = strtoul(tag, nullptr, 10);
+            if (k >= g_mux.size()) continue;
+            if (strncmp(body, "CREDIT|", 7) == 0) g_mux[k].credits += atoi(body + 7);
+            else if (strncmp(body, "SESSION|", 8) == 0) g_mux[k].token = body + 8;
+            else g_mux_deliveries++;
+        }
+    }
+}
+
+// รอจน user k มี token และ credit (ทีละคน: คิวร่วมมีแค่ 10 ช่อง ลงทะเบียนพร้อมกันหลายคนข้อความจะล้น)
+bool waitMuxReady(size_t k) {
+    for (int tries = 0; tries < 50; ++tries) {
+        if (!g_mux[k].token.empty() && g_mux[k].credits > 0) return true;
+        if (pumpMux(100) < 0) break;
+    }
+    std::cerr << "[" << g_mux[k].name << "] Error: No session / credit from server.\n";
+    return false;
+}
+
+int runMux(int users, const std::string& prefix, int numMessages, const std::string& sharedRoom, int intervalMs) {
+    std::string base = prefix + "_" + std::to_string(getpid());
+    g_clientQueueName = "/reply_" + base;
+
+    struct mq_attr attr{};
+    attr.mq_flags = 0;
+    attr.mq_maxmsg = 10;
+    attr.mq_msgsize = MQ_MSGSIZE;
+    mq_unlink(g_clientQueueName.c_str());
+    g_reply_mq = mq_open(g_clientQueueName.c_str(), O_CREAT | O_RDONLY, 0666, &attr);
+    if (g_reply_mq == (mqd_t)-1) {
+        perror("Tester: mq_open (create)");
+        return 1;
+    }
+
+    // 1. ลงทะเบียนทีละคน แล้วเข้าห้อง
+    g_mux.resize(users);
+    for (int k = 0; k < users; ++k) {
+        MuxUser& u = g_mux[k];
+        u.name = base + "_" + std::to_string(k);
+        if (g_conn.sendFrame("REGISTER|" + g_clientQueueName + "#" + std::to_string(k) + "|" + u.name) != 0) return 1;
+        if (!waitMuxReady(k)) return 1;
+
+        std::string room = sharedRoom.empty() ? "room_" + u.name : sharedRoom;
+        if (g_conn.sendFrame("CREATE|" + u.token + "|" + room) != 0) return 1;
+        u.credits--;
+        if (!sharedRoom.empty()) {
+            if (u.credits <= 0 && !waitMuxReady(k)) return 1;
+            if (g_conn.sendFrame("JOIN|" + u.token + "|" + room) != 0) return 1;
+            u.credits--;
         }
+        pumpMux(0);
     }
 
-    std::string message = cmd + "|" + g_clientQueueName + payload;
-    if (mq_send(server_mq, message.c_str(), message.size() + 1, 0) == -1) {
-        int err = errno;
-        mq_close(server_mq);
-        std::cerr << "[" << g_clientQueueName << "] Error: mq_send failed: " << strerror(err) << "\n";
-        return err;
+    // 2. ยิงข้อความ: วนทีละ user ส่งได้เท่าที่ credit มี (ไม่เกิน PIPELINE_DEPTH ต่อรอบ)
+    const int PIPELINE_DEPTH = 16;
+    std::vector<std::string> batch;
+    int remaining = users;
+    while (remaining > 0) {
+        bool progressed = false;
+        remaining = 0;
+        for (MuxUser& u : g_mux) {
+            if (u.sent >= numMessages) continue;
+            remaining++;
+            batch.clear();
+            int depth = (intervalMs > 0) ? 1 : PIPELINE_DEPTH;
+            for (int j = u.sent; j < numMessages && j < u.sent + depth && (int)batch.size() < u.credits; ++j) {
+                batch.push_back("CHAT|" + u.token + "|This is message " + std::to_string(j + 1));
+            }
+            int err = 0;
+            size_t sent = g_conn.pipeline(batch, err);
+            u.credits -= (int)sent;
+            u.sent += (int)sent;
+            if (sent > 0) progressed = true;
+            if (err != 0) break;
+        }
+        if (remaining == 0) break;
+        // ไม่มีใครส่งได้ = รอ credit (ไม่มาภายใน 5 วินาที: Server อาจล่ม)
+        int got = pumpMux(progressed ? 0 : 5000);
+        if (got < 0 || (!progressed && got == 0)) {
+            std::cerr << "[" << g_clientQueueName << "] Error: No credit from server.\n";
+            break;
+        }
+        if (intervalMs > 0) std::this_thread::sleep_for(std::chrono::milliseconds(intervalMs));
     }
 
-    mq_close(server_mq);
-    return 0; // 0 หมายถึงสำเร็จ
+    // 3. ออกจากระบบทุกคน แล้วลบคิวร่วม (Server ไม่ลบคิวที่ใช้ร่วมกันให้)
+    for (const MuxUser& u : g_mux) g_conn.sendFrame("EXIT|" + u.token);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    pumpMux(0);
+    std::cout << "[" << g_clientQueueName << "] " << users << " users, " << g_mux_frames << " frames received for "
+              << g_mux_deliveries << " deliveries\n";
+    mq_close(g_reply_mq);
+    mq_unlink(g_clientQueueName.c_str());
+    g_conn.close();
+    return 0;
 }
 
 // --- Main (แบบไม่โต้ตอบ) ---
 int main(int argc, char* argv[]) {
-    if (argc != 3) {
-        std::cerr << "Usage: ./load_tester <UsernamePrefix> <NumMessages>\n";
+    // --mux=<n>: จำลอง n user ใน process นี้ผ่านคิวตอบกลับคิวเดียว (ต้องเป็น argument แรก)
+    int muxUsers = 0;
+    if (argc > 1 && strncmp(argv[1], "--mux=", 6) == 0) {
+        muxUsers = atoi(argv[1] + 6);
+        argv++;
+        argc--;
+    }
+    if (argc < 3 || argc > 5) {
+        std::cerr << "Usage: ./load_tester [--mux=<n>] <UsernamePrefix> <NumMessages> [SharedRoom|-] [IntervalMs]\n";
         return 1;
     }
+    if (muxUsers > 0) {
+        std::string shared = (argc >= 4 && std::string(argv[3]) != "-") ? argv[3] : "";
+        return runMux(muxUsers, argv[1], std::stoi(argv[2]), shared, (argc == 5) ? std::stoi(argv[4]) : 0);
+    }
 
     std::string myName = std::string(argv[1]) + "_" + std::to_string(getpid());
     int numMessages = std::stoi(argv[2]);
-    std::string myRoom = "room_" + myName;
+    // ถ้าระบุ SharedRoom: ทุก tester เข้าห้องเดียวกัน (ทดสอบ fan-out ห้องใหญ่) "-" = ห้องของตัวเอง
+    bool sharedRoom = (argc >= 4 && std::string(argv[3]) != "-");
+    // IntervalMs > 0: ส่งทีละข้อความทุกๆ IntervalMs (จำลองห้องเงียบ) แทนการยิงเต็มที่
+    int intervalMs = (argc == 5) ? std::stoi(argv[4]) : 0;
+    std::string myRoom = sharedRoom ? std::string(argv[3]) : "room_" + myName;
     g_clientQueueName = "/reply_" + myName;
 
     // 1. สร้างคิวส่วนตัว
-    // Tester ไม่จำเป็นต้อง "อ่าน" คิว แต่ "ต้องสร้าง"
-    // เพราะ Server จะพยายาม "ส่ง" ตอบกลับมา
+    // Tester ต้อง "อ่าน" คิวนี้ด้วย เพื่อรับ CREDIT จาก Server
     struct mq_attr attr{};
     attr.mq_flags = 0;
     attr.mq_maxmsg = 10;
     attr.mq_msgsize = MQ_MSGSIZE;
     
     mq_unlink(g_clientQueueName.c_str()); // ลบของเก่า
-    mqd_t my_mq = mq_open(g_clientQueueName.c_str(), O_CREAT | O_RDONLY, 0666, &attr);
-    if (my_mq == (mqd_t)-1) {
+    g_reply_mq = mq_open(g_clientQueueName.c_str(), O_CREAT | O_RDONLY, 0666, &attr);
+    if (g_reply_mq == (mqd_t)-1) {
         perror("Tester: mq_open (create)");
         return 1;
     }
-    mq_close(my_mq);
 
-    // 2. ลงทะเบียน
+    // 2. ลงทะเบียน (credit ชุดแรกมาพร้อม Welcome)
     if (sendCommand("REGISTER", "|" + myName) != 0) return 1;
+    if (!waitForCredit()) return 1;
 
-    // 3. สร้างห้อง
-    if (sendCommand("CREATE", "|" + myRoom + "|" + myName) != 0) return 1;
+    // 3. สร้างห้อง (ห้องรวม: คนแรกสร้าง คนที่เหลือ CREATE ไม่ผ่านแล้ว JOIN แทน)
+    if (sendCommand("CREATE", "|" + myRoom) != 0) return 1;
+    g_credits--;
+    if (sharedRoom) {
+        if (g_credits <= 0 && !waitForCredit()) return 1;
+        if (sendCommand("JOIN", "|" + myRoom) != 0) return 1;
+        g_credits--;
+    }
+
+    // 4. ยิงข้อความ (pipeline ทีละไม่เกิน PIPELINE_DEPTH ข้อความ และไม่เกิน credit ที่มี)
+    const int PIPELINE_DEPTH = 16;
+    std::vector<std::string> batch;
+    batch.reserve(PIPELINE_DEPTH);
+    int i = 0;
+    while (i < numMessages) {
+        if (g_credits <= 0 && !waitForCredit()) break;
 
-    // 4. ยิงข้อความ
-    for (int i = 0; i < numMessages; ++i) {
-        std::string msg = "This is message " + std::to_string(i+1);
-        if (sendCommand("CHAT", "|" + myRoom + "|" + myName + "|" + msg) != 0) {
-            // ถ้าคิว Server เต็ม อาจจะส่งไม่สำเร็จ ให้รอแป๊บนึง
+        batch.clear();
+        int depth = (intervalMs > 0) ? 1 : PIPELINE_DEPTH;
+        for (int j = i; j < numMessages && j < i + depth && (int)batch.size() < g_credits; ++j) {
+            std::string msg = "This is message " + std::to_string(j+1);
+            batch.push_back("CHAT|" + g_token + "|" + msg);
+        }
+        int err = 0;
+        size_t sent = g_conn.pipeline(batch, err);
+        g_credits -= (int)sent;
+        i += (int)sent;
+        if (sent != batch.size()) {
+            // ส่งไม่ครบ (เช่น Server ปิดไปแล้ว) ให้รอแป๊บนึง
             std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        } else if (intervalMs > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(intervalMs));
         }
     }
 
     // 5. ออกจากระบบ
-    sendCommand("EXIT", "|" + myName);
+    sendCommand("EXIT", "");
     
     // 6. ลบคิวตัวเอง
     // (เรา sleep 50 ms เพื่อให้ Server มีเวลาประมวลผล EXIT และเลิกยุ่งกับคิวเรา)
     std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    mq_close(g_reply_mq);
     mq_unlink(g_clientQueueName.c_str());
+    g_conn.close();
 
     return 0;
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 THREAD_COUNTS="1 2 4 8"
 NUM_CLIENTS=100          # จำนวน Client ที่จะรันพร้อมกัน
 MESSAGES_PER_CLIENT=50   # จำนวนข้อความที่ Client แต่ละตัวจะส่ง
+SERVER_MODE="${SERVER_MODE:-pool}"  # pool = ./server N, shards = ./server 1 --shards=N (thread-per-core)
 
 # ---------------------------------
 # 0. สร้าง Directory สำหรับ Log และ Result
@@ -54,6 +55,7 @@ echo ""
     echo "Total Clients: $NUM_CLIENTS"
     echo "Messages/Client: $MESSAGES_PER_CLIENT"
     echo "Total Messages: $TOTAL_MESSAGES"
+    echo "Server Mode: $SERVER_MODE"
     echo "======================================"
     echo ""
 } > "$RESULT_FILE"
@@ -67,7 +69,12 @@ for N_THREADS in $THREAD_COUNTS; do
     # เริ่ม Server (ใน Background)
     echo "[Server] Starting server with $N_THREADS threads..."
     SERVER_LOG="log/server_${N_THREADS}threads_${TIMESTAMP}.log"
-    stdbuf -oL ../exe/server $N_THREADS > "$SERVER_LOG" 2>&1 &
+    if [ "$SERVER_MODE" = "shards" ]; then
+        SERVER_ARGS="1 --shards=$N_THREADS"
+    else
+        SERVER_ARGS="$N_THREADS"
+    fi
+    stdbuf -oL ../exe/server $SERVER_ARGS > "$SERVER_LOG" 2>&1 &
     SERVER_PID=$!
 
     # รอให้ Server พร้อม
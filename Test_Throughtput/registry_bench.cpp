@@ -0,0 +1,144 @@
+// บันทึกเป็น: registry_bench.cpp
+// เปรียบเทียบ std::map<string, uint32_t> (registry แบบเดิม) กับ FlatStringMap (server/flat_map.h)
+// g++ -O2 -std=c++17 -o ../exe/registry_bench registry_bench.cpp
+// ./registry_bench [N ...]      (ค่าเริ่มต้น: 1000 100000 1000000)
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+#include "../server/flat_map.h"
+
+using Clock = std::chrono::steady_clock;
+
+// กันไม่ให้ compiler ตัดงานทิ้ง
+volatile uint64_t g_sink = 0;
+
+// --- จับเวลา: คืนค่า ns ต่อ operation ---
+template <typename F>
+double timeOp(size_t ops, F f) {
+    auto start = Clock::now();
+    f();
+    auto end = Clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / (double)ops;
+}
+
+struct Result {
+    double insert_ns, lookup_ns, miss_ns, churn_ns, iterate_ns;
+};
+
+// --- std::map (แบบเดิม) ---
+Result benchStdMap(const std::vector<std::string>& keys, const std::vector<std::string>& missing,
+                   const std::vector<size_t>& order) {
+    Result r{};
+    std::map<std::string, uint32_t> m;
+    size_t n = keys.size();
+
+    r.insert_ns = timeOp(n, [&] {
+        for (size_t i = 0; i < n; ++i) m[keys[i]] = (uint32_t)i;
+    });
+    r.lookup_ns = timeOp(n, [&] {
+        uint64_t sum = 0;
+        for (size_t i : order) sum += m.find(keys[i])->second;
+        g_sink += sum;
+    });
+    r.miss_ns = timeOp(n, [&] {
+        uint64_t hits = 0;
+        for (const auto& k : missing) hits += m.count(k);
+        g_sink += hits;
+    });
+    // insert/erase churn: user ออก แล้วมี user ใหม่เข้ามาแทน (ครึ่งหนึ่งของทั้งหมด)
+    r.churn_ns = timeOp(n, [&] {
+        for (size_t i = 0; i < n; i += 2) m.erase(keys[order[i]]);
+        for (size_t i = 0; i < n; i += 2) m[keys[order[i]]] = (uint32_t)i;
+    });
+    r.iterate_ns = timeOp(n, [&] {
+        uint64_t sum = 0;
+        for (auto const& [k, v] : m) sum += v + k.size();
+        g_sink += sum;
+    });
+    return r;
+}
+
+// --- FlatStringMap (แบบใหม่) ---
+Result benchFlatMap(const std::vector<std::string>& keys, const std::vector<std::string>& missing,
+                    const std::vector<size_t>& order) {
+    Result r{};
+    FlatStringMap<uint32_t> m;
+    size_t n = keys.size();
+
+    r.insert_ns = timeOp(n, [&] {
+        for (size_t i = 0; i < n; ++i) m.insert(keys[i], (uint32_t)i);
+    });
+    r.lookup_ns = timeOp(n, [&] {
+        uint64_t sum = 0;
+        for (size_t i : order) sum += *m.find(keys[i]);
+        g_sink += sum;
+    });
+    r.miss_ns = timeOp(n, [&] {
+        uint64_t hits = 0;
+        for (const auto& k : missing) hits += (m.find(k) != nullptr);
+        g_sink += hits;
+    });
+    r.churn_ns = timeOp(n, [&] {
+        for (size_t i = 0; i < n; i += 2) m.erase(keys[order[i]]);
+        for (size_t i = 0; i < n; i += 2) m.insert(keys[order[i]], (uint32_t)i);
+    });
+    r.iterate_ns = timeOp(n, [&] {
+        uint64_t sum = 0;
+        m.for_each([&](std::string_view k, uint32_t v) { sum += v + k.size(); });
+        g_sink += sum;
+    });
+    return r;
+}
+
+void printRow(const char* name, const Result& r) {
+    std::cout << std::left << std::setw(16) << name << std::right << std::fixed << std::setprecision(1)
+              << std::setw(12) << r.insert_ns
+              << std::setw(12) << r.lookup_ns
+              << std::setw(12) << r.miss_ns
+              << std::setw(14) << r.churn_ns
+              << std::setw(12) << r.iterate_ns << "\n";
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<size_t> sizes = {1000, 100000, 1000000};
+    if (argc > 1) {
+        sizes.clear();
+        for (int i = 1; i < argc; ++i) sizes.push_back(std::strtoul(argv[i], nullptr, 10));
+    }
+
+    std::mt19937 rng(42);
+    for (size_t n : sizes) {
+        // ชื่อแบบเดียวกับที่ load_tester ใช้ (prefix + pid)
+        std::vector<std::string> keys, missing;
+        keys.reserve(n);
+        missing.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+            keys.push_back("client_" + std::to_string(i) + "_" + std::to_string(1000 + i * 7));
+            missing.push_back("ghost_" + std::to_string(i));
+        }
+        std::vector<size_t> order(n);
+        for (size_t i = 0; i < n; ++i) order[i] = i;
+        std::shuffle(order.begin(), order.end(), rng);
+
+        std::cout << "\n=== " << n << " users (ns/op) ===\n";
+        std::cout << std::left << std::setw(16) << "map" << std::right
+                  << std::setw(12) << "insert"
+                  << std::setw(12) << "lookup"
+                  << std::setw(12) << "miss"
+                  << std::setw(14) << "erase+insert"
+                  << std::setw(12) << "iterate" << "\n";
+        printRow("std::map", benchStdMap(keys, missing, order));
+        printRow("FlatStringMap", benchFlatMap(keys, missing, order));
+    }
+    return 0;
+}
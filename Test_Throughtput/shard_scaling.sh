@@ -0,0 +1,81 @@
+#!/bin/bash
+# วัดว่า throughput ของโหมด thread-per-core (--shards=N) เพิ่มตามจำนวน shard แค่ไหน
+# งาน: CLIENTS คนอยู่ห้องของตัวเอง (user กับห้องส่วนใหญ่อยู่คนละ shard: CHAT ทุกข้อความวิ่งข้าม ring ระหว่าง shard)
+# ผลลัพธ์: msgs/s ของแต่ละจำนวน shard, speedup เทียบกับ 1 shard และบรรทัด [LATENCY] ของ Server
+# ‼️ ได้ผลที่มีความหมายเฉพาะเครื่องที่มี CPU ว่างอย่างน้อยเท่าจำนวน shard + client (ดู nproc ในผลลัพธ์)
+
+# --- การตั้งค่า Test Case ---
+SHARD_COUNTS=${SHARD_COUNTS:-"1 2 4 8"}
+CLIENTS=${CLIENTS:-100}      # จำนวน Client ที่รันพร้อมกัน
+MESSAGES=${MESSAGES:-200}    # ข้อความต่อ Client
+CPUS=${CPUS:-}               # ส่งต่อเป็น --cpus= (ว่าง = shard i -> CPU i)
+
+mkdir -p log result
+TIMESTAMP=$(date +"%Y%m%d_%H%M%S")
+RESULT_FILE="result/shard_scaling_${TIMESTAMP}.txt"
+TOTAL_MESSAGES=$(($CLIENTS * $MESSAGES))
+
+# ---------------------------------
+# 1. คอมไพล์โปรแกรม
+# ---------------------------------
+echo "Compiling server and load_tester..."
+if ! g++ -O2 -o ../exe/server ../server/server.cpp -lrt -pthread -std=c++17; then
+    echo "Failed to compile server.cpp. Aborting."
+    exit 1
+fi
+if ! g++ -O2 -o ../exe/load_tester load_tester.cpp -lrt -pthread -std=c++17; then
+    echo "Failed to compile load_tester.cpp. Aborting."
+    exit 1
+fi
+
+{
+    echo "====== Shard Scaling Results ======"
+    echo "Timestamp: $TIMESTAMP"
+    echo "CPUs (nproc): $(nproc)"
+    echo "Clients: $CLIENTS x $MESSAGES messages ($TOTAL_MESSAGES total)"
+    echo "==================================="
+} > "$RESULT_FILE"
+
+# ---------------------------------
+# 2. ทดสอบแต่ละจำนวน shard
+# ---------------------------------
+BASE=""
+for N in $SHARD_COUNTS; do
+    echo "--- Testing with $N shards ---"
+    SERVER_LOG="log/server_shards${N}_${TIMESTAMP}.log"
+    SERVER_ARGS="1 --shards=$N"
+    [ -n "$CPUS" ] && SERVER_ARGS="$SERVER_ARGS --cpus=$CPUS"
+    ../exe/server $SERVER_ARGS > "$SERVER_LOG" 2>&1 &
+    SERVER_PID=$!
+    sleep 1
+
+    start_time=$(date +%s.%N)
+    CLIENT_PIDS=""
+    for i in $(seq 1 $CLIENTS); do
+        ../exe/load_tester "scale_$i" $MESSAGES > /dev/null 2>&1 &
+        CLIENT_PIDS="$CLIENT_PIDS $!"
+    done
+    for pid in $CLIENT_PIDS; do
+        wait $pid
+    done
+    end_time=$(date +%s.%N)
+
+    kill -INT $SERVER_PID
+    wait $SERVER_PID 2>/dev/null
+
+    total_time=$(awk "BEGIN { printf \"%.3f\", $end_time - $start_time }")
+    throughput=$(awk "BEGIN { printf \"%.2f\", $TOTAL_MESSAGES / $total_time }")
+    [ -z "$BASE" ] && BASE=$throughput
+    speedup=$(awk "BEGIN { printf \"%.2f\", $throughput / $BASE }")
+    LINE=$(grep "\[LATENCY\]" "$SERVER_LOG")
+
+    echo "shards=$N time=${total_time}s throughput=${throughput} msgs/s speedup=${speedup}x"
+    echo "$LINE"
+    {
+        echo "shards=$N time=${total_time}s throughput=${throughput} msgs/s speedup=${speedup}x"
+        echo "$LINE"
+    } >> "$RESULT_FILE"
+    sleep 1
+done
+
+echo "Results saved to: $RESULT_FILE"
@@ -9,6 +9,11 @@
 #include <mutex>        // สำหรับ std::mutex, std::lock_guard
 #include <atomic>       // สำหรับ std::atomic
 #include <chrono>       // สำหรับ std::chrono::seconds, std::chrono::milliseconds
+#include <vector>       // สำหรับ std::vector (pipeline หลายคำสั่ง)
+#include <deque>        // สำหรับ std::deque (คำสั่งที่รอ credit)
+#include <map>          // สำหรับ std::map (directory cache)
+#include <set>          // สำหรับ std::set (directory cache)
+#include <algorithm>    // สำหรับ std::max
 
 // --- POSIX C Libraries ---
 #include <mqueue.h>     // สำหรับ mq_open, mq_receive, mq_send, ...
@@ -19,51 +24,313 @@
 #include <signal.h>     // สำหรับ signal, SIGINT, SIGTERM
 #include <time.h>       // สำหรับ clock_gettime, timespec
 #include <string.h>     // สำหรับ strerror()
+#include <stdlib.h>     // สำหรับ atoi()
 
 // --- Queue Settings ---
 const char* CONTROL_QUEUE = "/chat_control";
 const long MQ_MSGSIZE = 1024;
 
+// ------------------------
+// การเชื่อมต่อกับ Server
+// ------------------------
+// ถือ descriptor ของ CONTROL_QUEUE ไว้ตลอด session (ไม่ต้อง mq_open/mq_close ทุกคำสั่ง)
+// จะเปิดใหม่ก็ต่อเมื่อ: ยังไม่เคยเปิด, mq_send บอกว่า descriptor / คิวใช้ไม่ได้ (EBADF / ENOENT)
+// หรือ heartbeat ส่งไม่ออกนานเกินไป (Server อาจ restart: descriptor เดิมชี้คิวเก่าที่ไม่มีใครอ่าน ดู reconnect())
+// ไม่มีการ mq_open ตรวจเป็นระยะ
+struct ServerConnection {
+    mqd_t mq = (mqd_t)-1;
+    int flags;
+    std::atomic<long long> last_send_ms{0}; // เวลาส่งสำเร็จล่าสุด (ใช้ตัดสินว่าต้อง PING หรือยัง)
+    std::mutex mutex;       // ป้องกันหลาย Thread (input / heartbeat) ใช้ descriptor พร้อมกัน
+
+    explicit ServerConnection(int open_flags) : flags(open_flags) {}
+    ~ServerConnection() { close(); }
+
+    // คืนค่า 0 ถ้าสำเร็จ, คืนค่า errno ถ้าล้มเหลว (ENOENT = Server ไม่อยู่)
+    // (ต้องถือ mutex อยู่แล้ว)
+    int reopenLocked() {
+        if (mq != (mqd_t)-1) mq_close(mq);
+        mq = mq_open(CONTROL_QUEUE, flags);
+        return (mq == (mqd_t)-1) ? errno : 0;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (mq != (mqd_t)-1) mq_close(mq);
+        mq = (mqd_t)-1;
+    }
+
+    // ส่ง frame ที่ประกอบไว้แล้ว 1 ข้อความ (ต้องถือ mutex อยู่แล้ว)
+    int sendFrameLocked(const std::string& frame) {
+        if (mq == (mqd_t)-1) {
+            int err = reopenLocked();
+            if (err != 0) return err;
+        }
+        if (mq_send(mq, frame.c_str(), frame.size() + 1, 0) == -1) {
+            int err = errno;
+            if (err != EBADF && err != ENOENT) return err;
+            // descriptor / คิวเสีย ลองเปิดใหม่ 1 ครั้ง
+            err = reopenLocked();
+            if (err != 0) return err;
+            if (mq_send(mq, frame.c_str(), frame.size() + 1, 0) == -1) return errno;
+        }
+        last_send_ms = nowMs();
+        return 0;
+    }
+
+    // ผ่านไปกี่ ms แล้วตั้งแต่ส่งคำสั่งสำเร็จครั้งล่าสุด
+    long long quietMs() const { return nowMs() - last_send_ms; }
+
+    static long long nowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    int send(const std::string& frame) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return sendFrameLocked(frame);
+    }
+
+    //! Pipeline: ส่งหลายคำสั่งติดกันโดยไม่ต้องรอคำตอบ และไม่ปล่อย lock ระหว่างทาง
+    // คืนค่าจำนวนที่ส่งสำเร็จ; ถ้าหยุดกลางคัน (เช่น EAGAIN ตอนคิวเต็ม) errno จะอยู่ใน err
+    // ผู้เรียกส่งส่วนที่เหลือ (frames[sent..]) ใหม่ได้เอง
+    size_t pipeline(const std::vector<std::string>& frames, int& err) {
+        std::lock_guard<std::mutex> lock(mutex);
+        err = 0;
+        size_t sent = 0;
+        for (const auto& f : frames) {
+            err = sendFrameLocked(f);
+            if (err != 0) break;
+            sent++;
+        }
+        return sent;
+    }
+
+    // เปิดคิวของ Server ใหม่ตามชื่อ (heartbeat เรียกเมื่อ PING ส่งไม่ออกนานเกินไปเท่านั้น)
+    // - ENOENT: คิวของ Server หายไป (Server ล่ม)
+    // - Server restart: ได้ descriptor ของคิวใหม่แทนคิวเก่าที่ไม่มีใครอ่านแล้ว
+    int reconnect() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return reopenLocked();
+    }
+};
+
 // --- Global State ---
 // ใช้ atomic เพื่อให้แน่ใจว่าการอ่าน/เขียนค่าจากหลาย Thread ปลอดภัย
 std::atomic<bool> g_running(true);        // ธงส่วนกลางสำหรับสั่งให้ทุก Thread หยุดทำงาน
 std::atomic<bool> g_registered(false);  // ธงว่า Server ยืนยันการลงทะเบียนหรือยัง
+std::atomic<bool> g_interrupted(false); // ได้ SIGINT / SIGTERM (ตั้งจาก signal handler เท่านั้น)
 
 std::string g_myName;
 std::string g_clientQueueName;
+std::string g_token;       // session token จาก Server (SESSION|<token>) ใช้แทนชื่อในทุกคำสั่งหลัง REGISTER
 std::string g_currentRoom = "";
 
 std::mutex g_room_mutex;   // Mutex สำหรับป้องกันการเข้าถึง g_currentRoom พร้อมกัน
 std::mutex g_cout_mutex;   // Mutex สำหรับป้องกัน std::cout ตีกันระหว่าง Thread
 
+// O_NONBLOCK: ถ้าคิวของ Server เต็ม, mq_send จะไม่ค้าง (fail ทันที)
+ServerConnection g_conn(O_WRONLY | O_NONBLOCK);
+
+// --- Flow Control ---
+// Server ให้ credit มาเป็นชุด (CREDIT|n): 1 credit = ส่งคำสั่งได้ 1 คำสั่ง
+// คำสั่งที่ยังไม่มี credit (หรือคิว Server เต็ม) จะรออยู่ใน g_pending แทนการทิ้ง input
+int g_credits = 0;
+std::deque<std::string> g_pending;
+std::mutex g_flow_mutex;   // Mutex สำหรับ g_credits และ g_pending
+
+// --- Heartbeat ---
+// ทุกคำสั่งที่ส่งไปนับเป็น heartbeat อยู่แล้ว จะ PING ก็ต่อเมื่อเงียบนานเกิน interval
+// ที่ Server ประกาศมา (ใน CREDIT|n|hb) หรือ --hb-quiet=<sec> ถ้าตั้งไว้สั้นกว่า
+std::atomic<int> g_hb_interval(5);
+int g_hb_quiet = 0;        // 0 = ใช้ค่าที่ Server ประกาศ
+
+// --- การแสดงผล (receiver thread) ---
+int g_fps = 20;            // วาดข้อความใหม่ได้ไม่เกินกี่ครั้งต่อวินาที (--fps=<n>)
+size_t g_max_lines = 200;  // บรรทัดสูงสุดต่อ frame ที่เกินจะถูกข้าม (--max-lines=<n>)
+
+// --- Directory Cache (--cache) ---
+// ส่ง SYNC หลังลงทะเบียน: ได้ snapshot ของ directory เป็นหน้าๆ ("SYNC|<next>|<seq>|<op>\n...")
+// แล้ว server push delta มาเรื่อยๆ ("DIR|<a>|<b>|<op>\n..." = op seq a+1 .. b) จากนั้นตอบ /list /who /members เองได้
+// op เป็นแบบกำหนดค่า ใช้ซ้ำได้: frame ใช้ได้ถ้า a <= version <= b, a > version = delta ตกหล่น -> SYNC ใหม่
+struct DirectoryCache {
+    bool ready = false;                          // มี snapshot ที่ใช้ตอบได้
+    uint64_t version = 0;                        // seq ของ op ล่าสุดที่ใช้แล้ว
+    std::map<std::string, std::string> users;    // ชื่อ -> ห้อง ("" = Lobby)
+    std::set<std::string> rooms;
+
+    // ระหว่าง SYNC (สร้าง snapshot ใหม่แยกไว้ แล้วสลับเข้าตอนได้หน้าสุดท้าย)
+    bool syncing = false;
+    uint64_t sync_seq = 0;                       // seq ของ snapshot ที่กำลังไล่หน้า (0 = ยังไม่ได้หน้าแรก)
+    std::map<std::string, std::string> stage_users;
+    std::set<std::string> stage_rooms;
+    std::vector<std::string> held;               // DIR ที่มาระหว่าง SYNC (ใช้ต่อหลังได้ snapshot)
+};
+bool g_use_cache = false;
+DirectoryCache g_dir;
+std::mutex g_dir_mutex;    // Mutex สำหรับ g_dir
+
 // --- Prototypes ---
 void receiverThread();
 int sendCommand(const std::string& cmd, const std::string& payload);
+int drainPending();
 void showPrompt();
+std::string promptText();
 void handle_sigint(int);
+void startSync();
+void handleSync(const std::string& message);
+void handleDelta(const std::string& message);
+bool answerFromCache(const std::string& cmd);
 
 // ------------------------
 // Signal Handler (จัดการ Ctrl+C)
 // ------------------------
+// ‼️ ทำได้แค่ตั้งธง (async-signal-safe) ห้าม cout / sendCommand ตรงนี้:
+// ถ้าสัญญาณมาตอนที่ thread อื่นถือ g_conn.mutex หรือ g_flow_mutex อยู่ จะ deadlock ตัวเอง
+// main thread เห็นธงแล้วส่ง EXIT เอง (SIGINT มาถึง main thread เสมอ ดู spawnThread() และทำให้ getline หลุด)
 void handle_sigint(int) {
-    std::cout << "\n[Client] Caught SIGINT, disconnecting..." << std::endl;
-    if (g_registered) {
-        // ส่งคำสั่ง EXIT บอก Server ก่อน (ถ้าทำได้)
-        sendCommand("EXIT", "|" + g_myName);
-    }
+    g_interrupted = true;
     // สั่งให้ Thread อื่นๆ หยุดทำงาน
     g_running = false;
 }
 
+// สร้าง thread ที่บล็อค SIGINT / SIGTERM ไว้ (สัญญาณจึงไปที่ main thread ที่รอ getline อยู่เท่านั้น)
+template <typename F>
+std::thread spawnThread(F f) {
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    std::thread t(f);
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    return t;
+}
+
 // ------------------------
 // Thread รับข้อความจาก Server (สำคัญมาก)
 // ------------------------
+// ตื่นหนึ่งครั้ง = ดึงทุกข้อความที่ค้างในคิวออกมาให้หมด (คิวของเรามีแค่ 10 ช่อง ถ้าเต็ม Server จะทิ้งข้อความ)
+// ข้อความที่ต้องแสดงเก็บไว้ใน frame แล้วพิมพ์ทีเดียว (write + flush + prompt ครั้งเดียว) ไม่เกิน --fps ครั้งต่อวินาที
+// ถ้าใน frame เดียวมีเกิน --max-lines บรรทัด จะเก็บแค่บรรทัดล่าสุด แล้วแจ้ง "N messages skipped" แทนส่วนที่ตัดทิ้ง
+
+// จัดการข้อความหนึ่งข้อความ: ข้อความควบคุมทำงานทันที ข้อความที่ต้องแสดงผลต่อท้าย lines
+void handleMessage(const std::string& response, std::deque<std::string>& lines) {
+    size_t sep = response.find('|');
+    std::string type = (sep == std::string::npos) ? "" : response.substr(0, sep);
+    std::string message = (sep == std::string::npos) ? response : response.substr(sep + 1);
+
+    // SESSION: token ของเรา (มาก่อน Welcome) ไม่ต้องแสดงผล
+    if (type == "SESSION") {
+        g_token = message;
+        return;
+    }
+
+    // CREDIT เป็นข้อความควบคุม ไม่ต้องแสดงผล: เพิ่ม credit แล้วส่งคำสั่งที่รออยู่
+    // (รูปแบบ "CREDIT|n|hb": hb = heartbeat interval ที่ Server ต้องการ)
+    if (type == "CREDIT") {
+        size_t hb_sep = message.find('|');
+        if (hb_sep != std::string::npos) {
+            int hb = atoi(message.c_str() + hb_sep + 1);
+            if (hb > 0) g_hb_interval = hb;
+        }
+        {
+            std::lock_guard<std::mutex> lock(g_flow_mutex);
+            g_credits += atoi(message.c_str());
+        }
+        drainPending();
+        return;
+    }
+
+    // directory cache: snapshot / delta ไม่ต้องแสดงผล
+    if (type == "SYNC") {
+        handleSync(message);
+        return;
+    }
+    if (type == "DIR") {
+        handleDelta(message);
+        return;
+    }
+
+    // LIST / WHO / MEMBERS มาเป็นหน้า: "<KIND>|<next>|<payload>" (next ว่าง = หน้าสุดท้าย)
+    // ขอหน้าถัดไปทันที แล้วแสดงหน้านี้ไปก่อน (ไม่ต้องรอจนครบทุกหน้า)
+    bool directory = (type == "LIST" || type == "WHO" || type == "MEMBERS");
+    if (directory) {
+        size_t next_sep = message.find('|');
+        std::string next = (next_sep == std::string::npos) ? "" : message.substr(0, next_sep);
+        message = (next_sep == std::string::npos) ? "" : message.substr(next_sep + 1);
+        if (!next.empty()) sendCommand(type, "|" + next);
+        if (message.empty()) return; // (หน้าว่างปิดท้าย)
+    }
+
+    std::string line;
+    if (type == "SYSTEM") {
+        line = "[SYSTEM] " + message;
+
+        if (message.find("Welcome") != std::string::npos) {
+            g_registered = true;
+        }
+        // ถ้า Server สั่งปิด (เช่น โดนเตะ หรือ Server ปิด)
+        else if (message.find("disconnected") != std::string::npos ||
+                 message.find("Goodbye") != std::string::npos) {
+            g_running = false;
+        }
+    }
+    else if (type == "LIST") {
+        line = "[ROOMS] " + message;
+    }
+    else if (type == "WHO" || type == "MEMBERS") {
+        line = "[SYSTEM] " + message;
+    }
+    else if (type == "CHAT") {
+        std::lock_guard<std::mutex> room_lock(g_room_mutex);
+        line = "[" + g_currentRoom + "] " + message;
+    }
+    else if (type == "DM") {
+        line = "[DM] " + message;
+    }
+    else if (type == "BUSY") {
+        // "BUSY|<cmd>|<n>": Server งานล้นเลยทิ้งคำสั่งนี้ (n = จำนวนที่โดนทิ้งทั้งหมดของเรา)
+        size_t n_sep = message.find('|');
+        line = "[BUSY] Server is overloaded, " + message.substr(0, n_sep) + " was dropped";
+        if (n_sep != std::string::npos) line += " (" + message.substr(n_sep + 1) + " dropped so far)";
+    }
+    else if (type == "JOIN_SUCCESS") {
+        {
+            std::lock_guard<std::mutex> room_lock(g_room_mutex);
+            g_currentRoom = message;
+        }
+
+        if (message.empty()) {
+            line = "[SYSTEM] Returned to Lobby.";
+        } else {
+            line = "[SYSTEM] Successfully joined room '" + message + "'.";
+        }
+    }
+    else {
+        line = "[RAW] " + response;
+    }
+    lines.push_back(std::move(line));
+}
+
+// พิมพ์ทั้ง frame ด้วยการเขียนครั้งเดียว แล้ววาด prompt ใหม่ครั้งเดียว
+void renderFrame(std::deque<std::string>& lines, size_t& skipped) {
+    std::string out = "\n";
+    if (skipped > 0) out += "[CLIENT] " + std::to_string(skipped) + " messages skipped\n";
+    for (const std::string& line : lines) {
+        out += line;
+        out += '\n';
+    }
+    lines.clear();
+    skipped = 0;
+
+    out += promptText();
+    std::lock_guard<std::mutex> lock(g_cout_mutex); // ล็อค cout เพื่อป้องกันการพิมพ์ชนกับ main thread
+    std::cout << out;
+    std::cout.flush();
+}
+
 void receiverThread() {
-    struct mq_attr attr{};
-    attr.mq_flags = 0;
-    attr.mq_maxmsg = 10;
-    attr.mq_msgsize = MQ_MSGSIZE;
-    
     mqd_t my_mq = mq_open(g_clientQueueName.c_str(), O_RDONLY);
     if (my_mq == (mqd_t)-1) {
         std::lock_guard<std::mutex> lock(g_cout_mutex);
@@ -74,82 +341,58 @@ void receiverThread() {
     
     char buf[MQ_MSGSIZE];
     struct timespec ts;
+    std::deque<std::string> lines;   // บรรทัดที่รอแสดงใน frame นี้
+    size_t skipped = 0;              // บรรทัดที่ถูกตัดทิ้งใน frame นี้
+    long long last_render_ms = 0;
+    const long long frame_ms = 1000 / g_fps;
 
     while (g_running) {
         //! --- นี่คือส่วนที่สำคัญที่สุดในการป้องกัน Client ค้าง ---
-        // 1. ตั้ง Timeout 1 วินาที
+        // 1. ตั้ง Timeout: รอได้สูงสุด 1 วินาที (หรือถึงเวลาวาด frame ถัดไปถ้ามีบรรทัดค้างอยู่)
+        long long wait_ms = 1000;
+        if (!lines.empty()) wait_ms = std::max(0LL, last_render_ms + frame_ms - ServerConnection::nowMs());
         clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_sec += 1; // รอรับข้อความได้สูงสุด 1 วินาที
+        ts.tv_sec += wait_ms / 1000;
+        ts.tv_nsec += (wait_ms % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
 
         // 2. ใช้ mq_timedreceive (แทน mq_receive)
         //    นี่คือ Non-Blocking call แบบมี timeout
         ssize_t bytes = mq_timedreceive(my_mq, buf, MQ_MSGSIZE, nullptr, &ts);
         
         if (bytes > 0) {
-            // == ได้รับข้อความ ==
-            std::string response(buf);
-            
-            size_t sep = response.find('|');
-            std::string type = (sep == std::string::npos) ? "" : response.substr(0, sep);
-            std::string message = (sep == std::string::npos) ? response : response.substr(sep + 1);
-
-            // ล็อค cout เพื่อป้องกันการพิมพ์ชนกับ main thread
-            std::lock_guard<std::mutex> lock(g_cout_mutex);
-            std::cout << "\n";
-            
-            if (type == "SYSTEM") {
-                std::cout << "[SYSTEM] " << message;
-                
-                if (message.find("Welcome") != std::string::npos) {
-                    g_registered = true;
+            // == ได้รับข้อความ: ดึงที่เหลือในคิวออกมาด้วย (timeout ที่ผ่านไปแล้ว = ไม่รอ ถ้าคิวว่างคืน ETIMEDOUT ทันที) ==
+            // ดึงไม่เกิน DRAIN_MAX ข้อความ และหยุดเมื่อถึงเวลาวาด frame (ข้อความไหลเข้าไม่หยุดก็ยังได้วาด)
+            // ตัด lines ทุกข้อความ: ไม่ว่าจะตามไม่ทันแค่ไหน lines ไม่เกิน --max-lines
+            const int DRAIN_MAX = 1000;
+            auto trim = [&]() {
+                while (lines.size() > g_max_lines) { // (ตามไม่ทัน: เก็บเฉพาะบรรทัดล่าสุด)
+                    lines.pop_front();
+                    skipped++;
                 }
-                // ถ้า Server สั่งปิด (เช่น โดนเตะ หรือ Server ปิด)
-                else if (message.find("disconnected") != std::string::npos || 
-                         message.find("Goodbye") != std::string::npos) {
-                    g_running = false;
-                }
-            } 
-            else if (type == "LIST") {
-                std::cout << "[ROOMS] " << message;
-            } 
-            else if (type == "CHAT") {
-                std::string current;
-                {
-                    std::lock_guard<std::mutex> room_lock(g_room_mutex);
-                    current = g_currentRoom;
-                }
-                std::cout << "[" << current << "] " << message;
-            } 
-            else if (type == "DM") {
-                std::cout << "[DM] " << message;
-            } 
-            else if (type == "JOIN_SUCCESS") {
-                {
-                    std::lock_guard<std::mutex> room_lock(g_room_mutex);
-                    g_currentRoom = message;
-                }
-                
-                if (message.empty()) {
-                    std::cout << "[SYSTEM] Returned to Lobby.";
-                } else {
-                    std::cout << "[SYSTEM] Successfully joined room '" << message << "'.";
-                }
-            } 
-            else {
-                std::cout << "[RAW] " << response;
+            };
+            handleMessage(std::string(buf), lines);
+            trim();
+            struct timespec now_ts;
+            clock_gettime(CLOCK_REALTIME, &now_ts);
+            for (int drained = 1; g_running && drained < DRAIN_MAX; ++drained) {
+                if (!lines.empty() && ServerConnection::nowMs() - last_render_ms >= frame_ms) break;
+                if (mq_timedreceive(my_mq, buf, MQ_MSGSIZE, nullptr, &now_ts) <= 0) break;
+                handleMessage(std::string(buf), lines);
+                trim();
             }
-            
-            std::cout << std::endl;
-            showPrompt(); // แสดง prompt ใหม่หลังรับข้อความ
         }
-        
         else if (bytes == -1) {
             // == ไม่ได้รับข้อความ หรือ Error ==
             if (errno == ETIMEDOUT) {
-                //! สำคัญ: ถ้า Timeout (ครบ 1 วินาที)
+                //! สำคัญ: ถ้า Timeout
                 // นี่เป็นเรื่องปกติ ไม่ใช่ Error
                 // เราแค่ต้องวน Loop กลับไปเช็ค g_running ใหม่
-                continue;
+                // (และลองส่งคำสั่งที่ค้างเพราะคิว Server เต็มอีกครั้ง)
+                drainPending();
             } 
             else if (g_running) {
                 // ถ้าเป็น Error อื่น (เช่น คิวพัง)
@@ -158,7 +401,15 @@ void receiverThread() {
                 g_running = false; // สั่งปิด
             }
         }
+
+        // 3. ถึงเวลาวาด frame (ไม่เกิน --fps ครั้งต่อวินาที)
+        long long now_ms = ServerConnection::nowMs();
+        if (!lines.empty() && now_ms - last_render_ms >= frame_ms) {
+            renderFrame(lines, skipped);
+            last_render_ms = now_ms;
+        }
     }
+    if (!lines.empty()) renderFrame(lines, skipped); // (เช่น Goodbye / disconnected ก่อนปิด)
     
     mq_close(my_mq);
 }
@@ -168,36 +419,220 @@ void receiverThread() {
 // ------------------------
 //! สำคัญ: คืนค่า 0 ถ้าสำเร็จ, คืนค่า 'errno' ถ้าล้มเหลว
 // เราใช้ค่า errno นี้เพื่อตรวจจับว่า Server ล่มหรือไม่
+// รูปแบบ: "REGISTER|<reply_q>|<name>" หรือ "<CMD>|<token><payload>"
 int sendCommand(const std::string& cmd, const std::string& payload) {
-    // O_NONBLOCK: ถ้าคิวของ Server เต็ม, mq_send จะไม่ค้าง (fail ทันที)
-    mqd_t server_mq = mq_open(CONTROL_QUEUE, O_WRONLY | O_NONBLOCK);
-    if (server_mq == (mqd_t)-1) {
-        // ไม่ต้อง print error ที่นี่ ให้ Thread ที่เรียกไปจัดการเอง
-        return errno; // คืนค่า error code
+    // ใช้ descriptor ที่เปิดค้างไว้ใน g_conn (ไม่ต้องเปิด/ปิดคิวทุกครั้ง)
+    std::string frame = (cmd == "REGISTER") ? cmd + "|" + g_clientQueueName + payload
+                                            : cmd + "|" + g_token + payload;
+
+    // คำสั่งควบคุม session ไม่ใช้ credit (ไม่งั้น heartbeat/exit อาจค้าง)
+    if (cmd == "REGISTER" || cmd == "PING" || cmd == "EXIT") {
+        return g_conn.send(frame);
     }
 
-    std::string message = cmd + "|" + g_clientQueueName + payload;
-    if (mq_send(server_mq, message.c_str(), message.size() + 1, 0) == -1) {
-        int err = errno;
-        mq_close(server_mq);
-        return err; // คืนค่า error code
+    {
+        std::lock_guard<std::mutex> lock(g_flow_mutex);
+        g_pending.push_back(std::move(frame));
     }
+    return drainPending();
+}
 
-    mq_close(server_mq);
-    return 0; // 0 หมายถึงสำเร็จ
+// ------------------------
+// ส่งคำสั่งที่รอ credit ออกไปเท่าที่ credit มี
+// ------------------------
+int drainPending() {
+    std::lock_guard<std::mutex> lock(g_flow_mutex);
+    while (g_credits > 0 && !g_pending.empty()) {
+        int err = g_conn.send(g_pending.front());
+        if (err == EAGAIN) {
+            // คิวของ Server เต็ม: เก็บไว้ก่อน receiver thread จะลองใหม่ทุก 1 วินาที
+            return 0;
+        }
+        g_pending.pop_front();
+        if (err != 0) return err;
+        g_credits--;
+    }
+    return 0;
+}
+
+// ------------------------
+// Directory Cache
+// ------------------------
+// ใช้ op หนึ่งบรรทัด: "u\t<name>\t<room>" / "-u\t<name>" / "r\t<room>" / "-r\t<room>"
+void applyDirOp(std::map<std::string, std::string>& users, std::set<std::string>& rooms, const std::string& op) {
+    size_t t1 = op.find('\t');
+    if (t1 == std::string::npos) return;
+    std::string kind = op.substr(0, t1);
+    std::string rest = op.substr(t1 + 1);
+    if (kind == "u") {
+        size_t t2 = rest.find('\t');
+        if (t2 == std::string::npos) return;
+        users[rest.substr(0, t2)] = rest.substr(t2 + 1);
+    } else if (kind == "-u") {
+        users.erase(rest);
+    } else if (kind == "r") {
+        rooms.insert(rest);
+    } else if (kind == "-r") {
+        rooms.erase(rest);
+    }
+}
+
+void applyDirOps(std::map<std::string, std::string>& users, std::set<std::string>& rooms, const std::string& ops) {
+    size_t start = 0;
+    while (start < ops.size()) {
+        size_t end = ops.find('\n', start);
+        if (end == std::string::npos) end = ops.size();
+        if (end > start) applyDirOp(users, rooms, ops.substr(start, end - start));
+        start = end + 1;
+    }
+}
+
+// แยก "<a>|<b>|<rest>" ของ DIR
+bool splitSeq(const std::string& message, uint64_t& a, uint64_t& b, std::string& rest) {
+    size_t s1 = message.find('|');
+    if (s1 == std::string::npos) return false;
+    size_t s2 = message.find('|', s1 + 1);
+    if (s2 == std::string::npos) return false;
+    a = strtoull(message.c_str(), nullptr, 10);
+    b = strtoull(message.c_str() + s1 + 1, nullptr, 10);
+    rest = message.substr(s2 + 1);
+    return true;
+}
+
+// เริ่มขอ snapshot ใหม่ (ต้องถือ g_dir_mutex อยู่แล้ว)
+void startSyncLocked() {
+    g_dir.ready = false;
+    g_dir.syncing = true;
+    g_dir.sync_seq = 0;
+    g_dir.stage_users.clear();
+    g_dir.stage_rooms.clear();
+    g_dir.held.clear();
+}
+
+void startSync() {
+    {
+        std::lock_guard<std::mutex> lock(g_dir_mutex);
+        startSyncLocked();
+    }
+    sendCommand("SYNC", "");
+}
+
+// ใช้ delta หนึ่ง frame กับ cache ที่พร้อมแล้ว คืนค่า false = ตกหล่น (ต้อง SYNC ใหม่)
+// (ต้องถือ g_dir_mutex อยู่แล้ว)
+bool applyDeltaLocked(const std::string& message) {
+    uint64_t a, b;
+    std::string ops;
+    if (!splitSeq(message, a, b, ops)) return true;
+    if (b < g_dir.version) return true;      // เก่ากว่า snapshot ทั้ง frame
+    if (a > g_dir.version) return false;     // op a+1 .. ที่ต้องมีก่อนหน้านี้หายไป
+    applyDirOps(g_dir.users, g_dir.rooms, ops);
+    g_dir.version = b;
+    return true;
+}
+
+// "SYNC|<next>|<seq>|<op>\n..." (message = ส่วนหลัง "SYNC|")
+void handleSync(const std::string& message) {
+    size_t next_sep = message.find('|');
+    if (next_sep == std::string::npos) return;
+    std::string next = message.substr(0, next_sep);
+    std::string body = message.substr(next_sep + 1);
+    size_t seq_sep = body.find('|');
+    uint64_t seq = strtoull(body.c_str(), nullptr, 10);
+    std::string ops = (seq_sep == std::string::npos) ? "" : body.substr(seq_sep + 1);
+
+    bool restart = false;
+    {
+        std::lock_guard<std::mutex> lock(g_dir_mutex);
+        if (!g_dir.syncing) return;
+        if (g_dir.sync_seq == 0) g_dir.sync_seq = seq;
+        if (seq == 0 || seq != g_dir.sync_seq) {
+            // directory เปลี่ยนระหว่างไล่หน้า (หน้าไม่ได้มาจาก snapshot เดียวกัน) เริ่มใหม่
+            startSyncLocked();
+            restart = true;
+        } else {
+            applyDirOps(g_dir.stage_users, g_dir.stage_rooms, ops);
+            if (next.empty()) {
+                // หน้าสุดท้าย: สลับ snapshot เข้า แล้วใช้ delta ที่มาระหว่างนี้ต่อ
+                g_dir.users.swap(g_dir.stage_users);
+                g_dir.rooms.swap(g_dir.stage_rooms);
+                g_dir.version = seq;
+                g_dir.ready = true;
+                g_dir.syncing = false;
+                for (const std::string& held : g_dir.held) {
+                    if (!applyDeltaLocked(held)) {
+                        startSyncLocked();
+                        restart = true;
+                        break;
+                    }
+                }
+                g_dir.held.clear();
+            }
+        }
+    }
+    if (restart) sendCommand("SYNC", "");
+    else if (!next.empty()) sendCommand("SYNC", "|" + next);
+}
+
+// "DIR|<a>|<b>|<op>\n..." (message = ส่วนหลัง "DIR|")
+void handleDelta(const std::string& message) {
+    {
+        std::lock_guard<std::mutex> lock(g_dir_mutex);
+        if (g_dir.syncing) {
+            g_dir.held.push_back(message);
+            return;
+        }
+        if (!g_dir.ready || applyDeltaLocked(message)) return;
+        startSyncLocked();
+    }
+    sendCommand("SYNC", "");
+}
+
+// ตอบ /list /who /members จาก cache (รูปแบบเดียวกับที่ server ตอบ) คืนค่า false = cache ยังไม่พร้อม
+bool answerFromCache(const std::string& cmd) {
+    if (!g_use_cache) return false;
+    std::string current;
+    {
+        std::lock_guard<std::mutex> lock(g_room_mutex);
+        current = g_currentRoom;
+    }
+    std::string out;
+    {
+        std::lock_guard<std::mutex> lock(g_dir_mutex);
+        if (!g_dir.ready) return false;
+        if (cmd == "LIST") {
+            std::map<std::string, int> counts;
+            for (const auto& r : g_dir.rooms) counts[r] = 0;
+            for (const auto& u : g_dir.users) {
+                if (!u.second.empty()) counts[u.second]++;
+            }
+            out = "[ROOMS] Available Rooms: ";
+            for (const auto& c : counts) out += c.first + "(" + std::to_string(c.second) + ") ";
+        } else if (cmd == "WHO") {
+            out = "[SYSTEM] Users in " + current + ": ";
+            for (const auto& u : g_dir.users) {
+                if (u.second == current) out += u.first + " ";
+            }
+        } else {
+            out = "[SYSTEM] Online users: ";
+            for (const auto& u : g_dir.users) out += u.first + " ";
+        }
+    }
+    std::lock_guard<std::mutex> lock(g_cout_mutex);
+    std::cout << out << "\n";
+    return true;
 }
 
 // ------------------------
 // แสดง Prompt
 // ------------------------
-void showPrompt() {
+std::string promptText() {
     // ล็อค g_room_mutex เพื่ออ่าน g_currentRoom อย่างปลอดภัย
     std::lock_guard<std::mutex> lock(g_room_mutex);
-    if (g_currentRoom.empty()) {
-        std::cout << "[Lobby] > ";
-    } else {
-        std::cout << "[" << g_currentRoom << "] > ";
-    }
+    return g_currentRoom.empty() ? "[Lobby] > " : "[" + g_currentRoom + "] > ";
+}
+
+void showPrompt() {
+    std::cout << promptText();
     std::cout.flush(); // บังคับให้แสดงผลทันที
 }
 
@@ -205,8 +640,21 @@ void showPrompt() {
 // MAIN
 // ------------------------
 int main(int argc, char* argv[]) {
-    signal(SIGINT, handle_sigint);
-    signal(SIGTERM, handle_sigint);
+    // ไม่ใส่ SA_RESTART: read() ของ getline ที่รออยู่จะหลุดด้วย EINTR ทำให้ main loop ออกมาส่ง EXIT ได้
+    struct sigaction sa{};
+    sa.sa_handler = handle_sigint;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    // ./client [--hb-quiet=<sec>] [--cache] [--fps=<n>] [--max-lines=<n>]
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--hb-quiet=", 0) == 0) g_hb_quiet = atoi(arg.c_str() + 11);
+        else if (arg == "--cache") g_use_cache = true;
+        else if (arg.rfind("--fps=", 0) == 0) g_fps = std::max(1, atoi(arg.c_str() + 6));
+        else if (arg.rfind("--max-lines=", 0) == 0) g_max_lines = (size_t)std::max(1, atoi(arg.c_str() + 12));
+    }
 
     std::cout << "Enter your name: ";
     std::getline(std::cin, g_myName);
@@ -235,7 +683,7 @@ int main(int argc, char* argv[]) {
     
     //* เริ่ม receiver thread ก่อน
     // (เพื่อให้พร้อมรับข้อความ "Welcome" ทันทีที่ลงทะเบียน)
-    std::thread receiver(receiverThread);
+    std::thread receiver = spawnThread(receiverThread);
     std::cout << "[Client] Receiver thread started.\n";
     
     std::this_thread::sleep_for(std::chrono::milliseconds(100));
@@ -269,14 +717,33 @@ int main(int argc, char* argv[]) {
     }
 
     std::cout << "[Client] Registration successful!\n";
+    if (g_use_cache) startSync(); // (ขอ snapshot ของ directory แล้วรับ delta ต่อ)
     
     //* เริ่ม Heartbeat Thread (หลังจาก Register สำเร็จ)
-    std::thread heartbeat([](){
+    std::thread heartbeat = spawnThread([](){
+        long long next_reconnect_ms = 0;
         while (g_running && g_registered) {
-            std::this_thread::sleep_for(std::chrono::seconds(5));
+            std::this_thread::sleep_for(std::chrono::seconds(1));
             if (!g_running) break;
-            
-            int err = sendCommand("PING", "|" + g_myName);
+
+            // PING เฉพาะตอนเงียบนานพอ (ถ้าเพิ่งส่งคำสั่งอื่นไป Server นับเป็น heartbeat แล้ว)
+            int interval = g_hb_interval;
+            if (g_hb_quiet > 0 && g_hb_quiet < interval) interval = g_hb_quiet;
+            int err = 0;
+            if (g_conn.quietMs() >= interval * 1000LL) {
+                err = sendCommand("PING", "");
+            }
+
+            // heartbeat ส่งไม่ออก (คิวของ Server เต็ม) นานเกิน 2 interval: Server อาจล่มหรือ restart ไปแล้ว
+            // (descriptor เดิมยังชี้คิวเก่าที่ไม่มีใครอ่าน) -> เปิดคิวใหม่ตามชื่อ ไม่เกิน 1 ครั้งต่อ interval
+            if (err == EAGAIN) {
+                err = 0;
+                long long now = ServerConnection::nowMs();
+                if (g_conn.quietMs() >= 2 * interval * 1000LL && now >= next_reconnect_ms) {
+                    next_reconnect_ms = now + interval * 1000LL;
+                    err = g_conn.reconnect();
+                }
+            }
             
             // --- ‼️ นี่คือส่วนที่สำคัญที่สุดในการตรวจจับ Server ล่ม ‼️ ---
             if (err == ENOENT) {
@@ -301,6 +768,7 @@ int main(int argc, char* argv[]) {
     std::cout << " /who           - Show users in current room\n";
     std::cout << " /dm <name> <msg> - Send Direct Message\n";
     std::cout << " /members       - Show all online users\n";
+    std::cout << " /stats         - Show server allocation / syscall counters\n";
     std::cout << " /exit          - Disconnect and Quit\n";
     std::cout << " (Type message to chat in room)\n";
     std::cout << "----------------\n\n";
@@ -327,12 +795,13 @@ int main(int argc, char* argv[]) {
             ss >> cmd;
             
             if (cmd == "/exit") {
-                sendCommand("EXIT", "|" + g_myName);
+                sendCommand("EXIT", "");
                 g_running = false;
                 break;
             }
             else if (cmd == "/list") {
-                int err = sendCommand("LIST", "|" + g_myName);
+                if (answerFromCache("LIST")) continue;
+                int err = sendCommand("LIST", "");
                 if (err == ENOENT) g_running = false; // ตรวจสอบ Server ล่ม
             }
             else if (cmd == "/who") {
@@ -344,8 +813,8 @@ int main(int argc, char* argv[]) {
                 if (current.empty()) {
                     std::lock_guard<std::mutex> lock(g_cout_mutex);
                     std::cout << "[ERROR] You must be in a room to use /who.\n";
-                } else {
-                    int err = sendCommand("WHO", "|" + g_myName);
+                } else if (!answerFromCache("WHO")) {
+                    int err = sendCommand("WHO", "");
                     if (err == ENOENT) g_running = false;
                 }
             }
@@ -359,7 +828,7 @@ int main(int argc, char* argv[]) {
                     std::lock_guard<std::mutex> lock(g_cout_mutex);
                     std::cout << "[ERROR] You are already in the Lobby.\n";
                 } else {
-                    int err = sendCommand("LEAVE", "|" + g_myName);
+                    int err = sendCommand("LEAVE", "");
                     if (err == ENOENT) g_running = false;
                 }
             }
@@ -371,7 +840,7 @@ int main(int argc, char* argv[]) {
                     std::cout << "[ERROR] Usage: " << cmd << " <room_name>\n";
                 } else {
                     std::string payload_cmd = (cmd == "/create") ? "CREATE" : "JOIN";
-                    int err = sendCommand(payload_cmd, "|" + room + "|" + g_myName);
+                    int err = sendCommand(payload_cmd, "|" + room);
                     if (err == ENOENT) g_running = false;
                 }
             }
@@ -382,12 +851,17 @@ int main(int argc, char* argv[]) {
                     std::lock_guard<std::mutex> lock(g_cout_mutex);
                     std::cout << "[ERROR] Usage: /dm <name> <message>\n";
                 } else {
-                    int err = sendCommand("DM", "|" + target + "|" + g_myName + "|" + msg_part);
+                    int err = sendCommand("DM", "|" + target + "|" + msg_part);
                     if (err == ENOENT) g_running = false;
                 }
             }
             else if (cmd == "/members") {
-                int err = sendCommand("MEMBERS", "|" + g_myName);
+                if (answerFromCache("MEMBERS")) continue;
+                int err = sendCommand("MEMBERS", "");
+                if (err == ENOENT) g_running = false;
+            }
+            else if (cmd == "/stats") {
+                int err = sendCommand("STATS", "");
                 if (err == ENOENT) g_running = false;
             }
             else {
@@ -407,7 +881,7 @@ int main(int argc, char* argv[]) {
                 std::lock_guard<std::mutex> lock(g_cout_mutex);
                 std::cout << "[ERROR] You must be in a room to chat. Use /create or /join.\n";
             } else {
-                int err = sendCommand("CHAT", "|" + current + "|" + g_myName + "|" + input);
+                int err = sendCommand("CHAT", "|" + input);
                 if (err == ENOENT) g_running = false; // ตรวจสอบ Server ล่ม
             }
         }
@@ -415,6 +889,11 @@ int main(int argc, char* argv[]) {
     
     // --- Shutdown ---
     g_running = false; // เผื่อว่า Loop จบด้วยเหตุผลอื่น
+    if (g_interrupted) {
+        std::cout << "\n[Client] Caught SIGINT, disconnecting..." << std::endl;
+        // ส่งคำสั่ง EXIT บอก Server ก่อน (ถ้าทำได้)
+        if (g_registered) sendCommand("EXIT", "");
+    }
     
     // รอให้ Thread อื่นๆ ปิดตัวลงอย่างสมบูรณ์
     if (receiver.joinable()) receiver.join();
@@ -422,6 +901,7 @@ int main(int argc, char* argv[]) {
     
     // ลบไฟล์คิวของตัวเอง
     mq_unlink(g_clientQueueName.c_str());
+    g_conn.close();
 
     std::cout << "\n[CLIENT] Disconnected" << std::endl;
     return 0;
@@ -0,0 +1,168 @@
+// flat_map.h
+// Hash table แบบ open addressing สำหรับ key ที่เป็น string (ใช้แทน std::map<string, V> ใน registry)
+//
+// - เก็บแบบ SoA: tags / keys / values แยกเป็น array ต่อเนื่อง
+//   การ probe อ่านแค่ tags (4 byte ต่อช่อง) ซึ่งเรียงติดกันใน cache line เดียวกัน
+// - tag = hash 32 bit ที่คำนวณไว้แล้ว (0 = ช่องว่าง) เทียบ string จริงเฉพาะตอน tag ตรงกัน
+// - linear probing + ลบแบบ backward shift (ไม่มี tombstone ทำให้ probe ไม่ยาวขึ้นเรื่อยๆ)
+// - ค้นหาด้วย std::string_view ได้โดยตรง (ไม่ต้องสร้าง std::string ชั่วคราว)
+//
+// ‼️ ไม่ thread-safe ในตัวเอง ผู้ใช้ต้องล็อคเอง (เหมือน std::map)
+// ใช้ใน server/server.cpp และ Test_Throughtput/registry_bench.cpp
+
+#ifndef CHAT_FLAT_MAP_H
+#define CHAT_FLAT_MAP_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <functional>   // std::hash<std::string_view>
+#include <utility>
+
+template <typename V>
+class FlatStringMap {
+public:
+    FlatStringMap() { rehash(16); }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    // คืน pointer ไปที่ value (nullptr ถ้าไม่เจอ)
+    V* find(std::string_view key) {
+        size_t i = locate(key, tag_of(key));
+        return (i == NPOS) ? nullptr : &vals[i];
+    }
+
+    const V* find(std::string_view key) const {
+        size_t i = locate(key, tag_of(key));
+        return (i == NPOS) ? nullptr : &vals[i];
+    }
+
+    // เพิ่ม key ใหม่ คืนค่า false ถ้ามี key นี้อยู่แล้ว (ไม่เขียนทับ)
+    bool insert(std::string_view key, V value) {
+        uint32_t tag = tag_of(key);
+        if (locate(key, tag) != NPOS) return false;
+        if ((count + 1) * 4 > tags.size() * 3) rehash(tags.size() * 2); // load factor <= 0.75
+        place(tag, std::string(key), std::move(value));
+        count++;
+        return true;
+    }
+
+    // คืนค่า false ถ้าไม่มี key นี้
+    bool erase(std::string_view key) {
+        size_t i = locate(key, tag_of(key));
+        if (i == NPOS) return false;
+
+        // backward shift: เลื่อนตัวที่ probe เลยมาถอยกลับมาแทนช่องที่ว่าง
+        size_t hole = i;
+        size_t j = i;
+        while (true) {
+            j = (j + 1) & mask;
+            if (tags[j] == 0) break;
+            size_t ideal = home(tags[j]);
+            // ย้าย j มาที่ hole ได้ถ้า home ของ j ไม่ได้อยู่ระหว่าง (hole, j]
+            bool movable = (hole <= j) ? (ideal <= hole || ideal > j) : (ideal <= hole && ideal > j);
+            if (movable) {
+                tags[hole] = tags[j];
+                keys[hole] = std::move(keys[j]);
+                vals[hole] = std::move(vals[j]);
+                hole = j;
+            }
+        }
+        tags[hole] = 0;
+        keys[hole].clear();
+        vals[hole] = V();
+        count--;
+        return true;
+    }
+
+    void clear() {
+        count = 0;
+        reset(16); // (ไม่ย้ายของเก่ากลับเข้ามา)
+    }
+
+    void reserve(size_t n) {
+        size_t cap = tags.size();
+        while (n * 4 > cap * 3) cap *= 2;
+        if (cap != tags.size()) rehash(cap);
+    }
+
+    // วนทุก entry: f(std::string_view key, V& value) (ลำดับไม่แน่นอน)
+    template <typename F>
+    void for_each(F f) {
+        for (size_t i = 0; i < tags.size(); ++i) {
+            if (tags[i] != 0) f(std::string_view(keys[i]), vals[i]);
+        }
+    }
+
+    template <typename F>
+    void for_each(F f) const {
+        for (size_t i = 0; i < tags.size(); ++i) {
+            if (tags[i] != 0) f(std::string_view(keys[i]), vals[i]);
+        }
+    }
+
+private:
+    static constexpr size_t NPOS = (size_t)-1;
+
+    std::vector<uint32_t> tags;   // 0 = ว่าง
+    std::vector<std::string> keys;
+    std::vector<V> vals;
+    size_t count = 0;
+    size_t mask = 0;
+    int shift = 0;                // 32 - log2(capacity)
+
+    static uint32_t tag_of(std::string_view key) {
+        size_t h = std::hash<std::string_view>{}(key);
+        uint32_t tag = (uint32_t)(h ^ (h >> 32));
+        return tag ? tag : 1;
+    }
+
+    // Fibonacci hashing: กระจาย bit สูงของ tag ไปเป็น index
+    size_t home(uint32_t tag) const {
+        return (size_t)((uint32_t)(tag * 2654435769u) >> shift) & mask;
+    }
+
+    size_t locate(std::string_view key, uint32_t tag) const {
+        for (size_t i = home(tag);; i = (i + 1) & mask) {
+            if (tags[i] == 0) return NPOS;
+            if (tags[i] == tag && keys[i] == key) return i;
+        }
+    }
+
+    void place(uint32_t tag, std::string&& key, V&& value) {
+        size_t i = home(tag);
+        while (tags[i] != 0) i = (i + 1) & mask;
+        tags[i] = tag;
+        keys[i] = std::move(key);
+        vals[i] = std::move(value);
+    }
+
+    // เปลี่ยนเป็น array ว่างขนาด cap (ของเดิมถูกทิ้ง)
+    void reset(size_t cap) {
+        tags.assign(cap, 0);
+        keys.assign(cap, std::string());
+        vals.assign(cap, V());
+        mask = cap - 1;
+        shift = 32;
+        for (size_t c = cap; c > 1; c >>= 1) shift--;
+    }
+
+    void rehash(size_t cap) {
+        std::vector<uint32_t> old_tags;
+        std::vector<std::string> old_keys;
+        std::vector<V> old_vals;
+        old_tags.swap(tags);
+        old_keys.swap(keys);
+        old_vals.swap(vals);
+        reset(cap);
+
+        for (size_t i = 0; i < old_tags.size(); ++i) {
+            if (old_tags[i] != 0) place(old_tags[i], std::move(old_keys[i]), std::move(old_vals[i]));
+        }
+    }
+};
+
+#endif // CHAT_FLAT_MAP_H
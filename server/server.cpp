@@ -4,15 +4,26 @@
 // --- C++ Standard Libraries ---
 #include <iostream>     // สำหรับ std::cout, std::cerr, std::cin, std::endl
 #include <string>     // สำหรับ std::string, std::getline, std::to_string
-#include <sstream> // สำหรับ std::stringstream
 #include <vector>     // สำหรับ std::vector
 #include <map>      // สำหรับ std::map
-#include <queue>      // สำหรับ std::queue (Thread Pool)
 #include <thread>     // สำหรับ std::thread
 #include <mutex>      // สำหรับ std::mutex, std::lock_guard, std::unique_lock
 #include <condition_variable> // สำหรับ std::condition_variable (Thread Pool)
 #include <atomic>     // สำหรับ std::atomic_bool (g_server_running)
 #include <chrono>     // สำหรับ std::chrono::seconds, std::chrono::milliseconds
+#include <algorithm>  // สำหรับ std::min, std::max
+#include <cstdint>    // สำหรับ uint32_t (UserId / RoomId)
+#include <string_view> // สำหรับ std::string_view (แยก field โดยไม่ copy)
+#include <charconv>   // สำหรับ std::from_chars (อ่าน session token)
+#include <random>     // สำหรับ std::random_device, std::mt19937 (generation ของ token)
+#include <memory>     // สำหรับ std::unique_ptr
+#include <memory_resource> // สำหรับ std::pmr (arena ต่อข้อความ)
+#include <initializer_list>
+#include <deque>      // สำหรับ std::deque (work-stealing scheduler)
+#include <unordered_map> // สำหรับ std::unordered_map (flow ของ DRR scheduler)
+#include <new>        // สำหรับ std::bad_alloc (operator new ของ instrumentation)
+#include <cstdlib>    // สำหรับ malloc / free
+#include <cctype>     // สำหรับ isalnum (ตรวจ tag / ชื่อ)
 
 // --- POSIX C Libraries ---
 #include <mqueue.h>// สำหรับ mq_open, mq_receive, mq_send, ...
@@ -23,6 +34,12 @@
 #include <signal.h>// สำหรับ signal, SIGINT, SIGTERM
 #include <time.h>     // สำหรับ time, strftime
 #include <string.h>// สำหรับ strerror()
+#include <stdio.h>    // สำหรับ snprintf()
+#include <pthread.h>  // สำหรับ pthread_setaffinity_np (shard mode)
+#include <sched.h>    // สำหรับ cpu_set_t
+
+// --- Project Headers ---
+#include "flat_map.h" // สำหรับ FlatStringMap (index ชื่อ -> ID)
 
 // ใช้ std:: prefix เพื่อความชัดเจน
 using std::string;
@@ -31,12 +48,7 @@ using std::cerr;
 using std::endl;
 using std::map;
 using std::vector;
-using std::queue;
-using std::stringstream;
 using std::to_string;
-using std::mutex;
-using std::lock_guard;
-using std::unique_lock;
 using std::thread;
 
 // --- Queue Settings ---
@@ -44,425 +56,4071 @@ const char* CONTROL_QUEUE = "/chat_control";
 const long MQ_MSGSIZE = 1024;
 mqd_t mq;
 
-// --- โครงสร้างข้อมูลสำหรับติดตามสถานะ ---
+thread_local const char* t_thread_name = "thread"; // ชื่อ thread (ตั้งผ่าน stat_thread_name() ใช้ใน trace)
+
+// --- Instrumentation (เปิดด้วย -DCHAT_INSTRUMENT) ---
+// นับ heap allocation (แทนที่ operator new/delete ทั้งโปรแกรม) และการเรียก mq_* ของ server
+// แยกตามคำสั่งที่กำลังประมวลผล (CHAT, LIST, ...) และตาม thread
+// ดูผลได้จากสรุปตอนปิด server หรือคำสั่ง STATS (client: /stats)
+// ถ้าไม่ได้เปิด stat_add() / StatScope เป็นฟังก์ชันว่าง และ sys_mq_*() คือ mq_*() ตรงๆ
+enum StatCmd {
+    SC_NONE, SC_REGISTER, SC_CREATE, SC_JOIN, SC_LIST, SC_CHAT, SC_WHO, SC_LEAVE,
+    SC_DM, SC_EXIT, SC_PING, SC_MEMBERS, SC_STATS, SC_SYNC, SC_OTHER, SC_COUNT
+};
+const char* STAT_CMD_NAMES[SC_COUNT] = {
+    "(none)", "REGISTER", "CREATE", "JOIN", "LIST", "CHAT", "WHO", "LEAVE",
+    "DM", "EXIT", "PING", "MEMBERS", "STATS", "SYNC", "OTHER"
+};
+
+enum StatKind {
+    SK_CALLS, SK_NEW, SK_DELETE, SK_BYTES, SK_MQ_OPEN, SK_MQ_SEND, SK_MQ_RECV, SK_MQ_CLOSE, SK_MQ_OTHER, SK_COUNT
+};
+const char* STAT_KIND_NAMES[SK_COUNT] = {
+    "calls", "new", "delete", "bytes", "mq_open", "mq_send", "mq_recv", "mq_close", "mq_other"
+};
+
+StatCmd stat_cmd_of(std::string_view cmd) {
+    for (int c = SC_REGISTER; c < SC_OTHER; ++c) {
+        if (cmd == STAT_CMD_NAMES[c]) return (StatCmd)c;
+    }
+    return SC_OTHER;
+}
+
+#ifdef CHAT_INSTRUMENT
+// ตัวนับของแต่ละ thread อยู่ใน array คงที่ (ห้าม new ตรงนี้ เพราะถูกเรียกจาก operator new)
+// thread เจ้าของเขียนเพียงคนเดียว (load + store แบบ relaxed ไม่ต้อง lock bus) ส่วน report แค่อ่าน
+const int STAT_MAX_THREADS = 64;
+struct ThreadStats {
+    std::atomic<const char*> name{nullptr};
+    std::atomic<uint64_t> counts[SC_COUNT][SK_COUNT];
+};
+ThreadStats g_thread_stats[STAT_MAX_THREADS + 1]; // ช่องสุดท้าย = thread ที่เกินจำนวน (ใช้ร่วมกัน)
+std::atomic<int> g_thread_stats_used(0);
+thread_local ThreadStats* t_stats = nullptr;
+thread_local StatCmd t_stat_cmd = SC_NONE;
+
+ThreadStats& thread_stats() {
+    if (t_stats == nullptr) {
+        int i = g_thread_stats_used.fetch_add(1);
+        t_stats = &g_thread_stats[std::min(i, STAT_MAX_THREADS)];
+    }
+    return *t_stats;
+}
+
+void stat_add(StatKind kind, uint64_t n = 1) {
+    std::atomic<uint64_t>& c = thread_stats().counts[t_stat_cmd][kind];
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void stat_thread_name(const char* name) {
+    thread_stats().name = name;
+    t_thread_name = name;
+}
+
+// นับทุกอย่างที่เกิดขึ้นใน scope ว่าเป็นของคำสั่ง cmd
+// (count_call = false: งานต่อของคำสั่งที่นับไปแล้ว เช่น fan-out ที่ shard ของห้องทำแทน)
+struct StatScope {
+    StatCmd prev;
+    explicit StatScope(StatCmd cmd, bool count_call = true) : prev(t_stat_cmd) {
+        t_stat_cmd = cmd;
+        if (count_call) stat_add(SK_CALLS);
+    }
+    ~StatScope() { t_stat_cmd = prev; }
+};
+
+void* operator new(size_t n) {
+    stat_add(SK_NEW);
+    stat_add(SK_BYTES, n);
+    if (void* p = malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t n) { return operator new(n); }
+void operator delete(void* p) noexcept {
+    if (p == nullptr) return;
+    stat_add(SK_DELETE);
+    free(p);
+}
+void operator delete[](void* p) noexcept { operator delete(p); }
+void operator delete(void* p, size_t) noexcept { operator delete(p); }
+void operator delete[](void* p, size_t) noexcept { operator delete(p); }
+
+// รวมตัวนับ: per_cmd[cmd][kind] (ทุก thread) และ per_thread[i][kind] (ทุกคำสั่ง)
+struct StatTotals {
+    uint64_t per_cmd[SC_COUNT][SK_COUNT] = {};
+    uint64_t per_thread[STAT_MAX_THREADS + 1][SK_COUNT] = {};
+    int threads = 0;
+};
+
+void stats_collect(StatTotals& out) {
+    out.threads = std::min(g_thread_stats_used.load(), STAT_MAX_THREADS + 1);
+    for (int t = 0; t < out.threads; ++t) {
+        for (int c = 0; c < SC_COUNT; ++c) {
+            for (int k = 0; k < SK_COUNT; ++k) {
+                uint64_t v = g_thread_stats[t].counts[c][k].load(std::memory_order_relaxed);
+                out.per_cmd[c][k] += v;
+                out.per_thread[t][k] += v;
+            }
+        }
+    }
+}
+
+// --- สรุปตอนปิด server ---
+void stats_report() {
+    StatTotals totals;
+    stats_collect(totals);
+
+    auto row = [](const char* label, const uint64_t* v) {
+        printf("  %-14s", label);
+        for (int k = 0; k < SK_COUNT; ++k) printf(" %10llu", (unsigned long long)v[k]);
+        printf("\n");
+    };
+    auto header = [](const char* title) {
+        printf("[STATS] %s\n  %-14s", title, "");
+        for (int k = 0; k < SK_COUNT; ++k) printf(" %10s", STAT_KIND_NAMES[k]);
+        printf("\n");
+    };
+
+    header("by command");
+    for (int c = 0; c < SC_COUNT; ++c) {
+        if (totals.per_cmd[c][SK_CALLS] || totals.per_cmd[c][SK_NEW] || totals.per_cmd[c][SK_MQ_RECV]) {
+            row(STAT_CMD_NAMES[c], totals.per_cmd[c]);
+        }
+    }
+    header("by thread");
+    for (int t = 0; t < totals.threads; ++t) {
+        char label[32];
+        const char* name = g_thread_stats[t].name.load();
+        snprintf(label, sizeof(label), "%s#%d", name ? name : "thread", t);
+        row(label, totals.per_thread[t]);
+    }
+    fflush(stdout);
+}
+#else
+inline void stat_add(StatKind, uint64_t = 1) {}
+inline void stat_thread_name(const char* name) { t_thread_name = name; }
+struct StatScope {
+    explicit StatScope(StatCmd, bool = true) {}
+};
+inline void stats_report() {}
+#endif
+
+// --- Lock Profiler (เปิดด้วย -DCHAT_LOCK_PROFILE) ---
+// แทน mutex / lock_guard / unique_lock / condition variable ทั้งไฟล์ด้วยตัวที่จับเวลา:
+//   - ต่อ lock (ตั้งชื่อด้วย lock_name() ตัวที่ไม่ได้ตั้งชื่อใช้ "server.cpp:<บรรทัดที่ประกาศ>"
+//     mutex ที่ประกาศบรรทัดเดียวกัน เช่น deque ของ worker ทุกตัว รวมเป็นตัวเดียว)
+//   - ต่อจุดที่ล็อค (บรรทัดของ lock_guard / unique_lock)
+// เก็บจำนวนครั้ง, จำนวนครั้งที่ต้องรอ, histogram (log2 ns) ของเวลารอและเวลาถือ, เวลารอใน condition variable
+// รายงานเมื่อ kill -USR1 <pid> และตอนปิด server (เรียงตามเวลารอรวม = lock ที่ขวางการ scale)
+// ถ้าไม่ได้เปิด ทุกอย่างคือ std:: ตรงๆ ไม่มี overhead
+#ifdef CHAT_LOCK_PROFILE
+inline uint64_t lock_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+struct LockHist {
+    static const int BUCKETS = 40;
+    std::atomic<uint64_t> b[BUCKETS] = {};
+
+    void add(uint64_t ns) {
+        int i = 0;
+        while (i + 1 < BUCKETS && (ns >> i) != 0) i++;
+        b[i].fetch_add(1, std::memory_order_relaxed);
+    }
+    uint64_t percentile(double p) const { // (ขอบบนของ bucket, ns)
+        uint64_t n = 0;
+        for (const auto& x : b) n += x.load(std::memory_order_relaxed);
+        uint64_t want = (uint64_t)(p * (double)n), seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += b[i].load(std::memory_order_relaxed);
+            if (seen > want) return (i == 0) ? 0 : (1ULL << i);
+        }
+        return 0;
+    }
+};
+
+struct LockStats {
+    std::atomic<uint64_t> key{0};          // (line << 32) | hash ของไฟล์  (0 = ช่องว่าง)
+    const char* file = nullptr;
+    int line = 0;
+    std::atomic<const char*> name{nullptr};
+    std::atomic<LockStats*> lock_class{nullptr}; // (ของ call site) lock ที่ถูกล็อคตรงนี้
+    std::atomic<uint64_t> acquires{0}, contended{0}, wait_ns{0}, hold_ns{0};
+    std::atomic<uint64_t> cond_waits{0}, cond_ns{0};
+    LockHist wait, hold;
+};
+
+// ตาราง hash คงที่ (open addressing ด้วย CAS ไม่ต้อง lock) แยกของ lock และของ call site
+const int LOCK_TABLE = 1024;
+LockStats g_lock_classes[LOCK_TABLE];
+LockStats g_lock_sites[LOCK_TABLE];
+LockStats g_lock_overflow;                   // ตารางเต็ม
+volatile sig_atomic_t g_lock_report_requested = 0;
+
+LockStats* lock_stats_for(LockStats* table, const char* file, int line) {
+    uint64_t key = ((uint64_t)line << 32) | (uint32_t)(std::hash<std::string_view>{}(file) | 1);
+    size_t i = (size_t)(key * 0x9E3779B97F4A7C15ULL >> 54) % LOCK_TABLE;
+    for (int probe = 0; probe < LOCK_TABLE; ++probe, i = (i + 1) % LOCK_TABLE) {
+        uint64_t cur = table[i].key.load(std::memory_order_acquire);
+        if (cur == key) return &table[i];
+        if (cur == 0) {
+            table[i].file = file;  // (เขียนก่อน publish key)
+            table[i].line = line;
+            if (table[i].key.compare_exchange_strong(cur, key, std::memory_order_acq_rel)) return &table[i];
+            if (cur == key) return &table[i];
+        }
+    }
+    return &g_lock_overflow;
+}
+
+class ProfiledMutex {
+public:
+    explicit ProfiledMutex(const char* file = __builtin_FILE(), int line = __builtin_LINE())
+        : stats(lock_stats_for(g_lock_classes, file, line)) {}
+    ProfiledMutex(const ProfiledMutex&) = delete;
+    ProfiledMutex& operator=(const ProfiledMutex&) = delete;
+
+    void lock_at(LockStats* site) {
+        uint64_t wait = 0;
+        if (!m.try_lock()) {
+            uint64_t start = lock_now_ns();
+            m.lock();
+            wait = lock_now_ns() - start;
+            stats->contended.fetch_add(1, std::memory_order_relaxed);
+            site->contended.fetch_add(1, std::memory_order_relaxed);
+        }
+        stats->acquires.fetch_add(1, std::memory_order_relaxed);
+        stats->wait_ns.fetch_add(wait, std::memory_order_relaxed);
+        stats->wait.add(wait);
+        site->acquires.fetch_add(1, std::memory_order_relaxed);
+        site->wait_ns.fetch_add(wait, std::memory_order_relaxed);
+        site->wait.add(wait);
+        owner_site = site;
+        held_since = lock_now_ns();
+    }
+    void unlock() {
+        uint64_t held = lock_now_ns() - held_since;
+        LockStats* site = owner_site;
+        m.unlock();
+        stats->hold_ns.fetch_add(held, std::memory_order_relaxed);
+        stats->hold.add(held);
+        site->hold_ns.fetch_add(held, std::memory_order_relaxed);
+        site->hold.add(held);
+    }
+    // (ใช้โดยโค้ดที่ไม่ผ่าน lock_guard ของเรา: นับเป็น call site ของบรรทัดที่เรียก)
+    void lock(const char* file = __builtin_FILE(), int line = __builtin_LINE()) {
+        lock_at(lock_stats_for(g_lock_sites, file, line));
+    }
+
+    LockStats* stats;
+private:
+    std::mutex m;
+    LockStats* owner_site = nullptr;   // (เจ้าของ lock เขียน / อ่านเท่านั้น)
+    uint64_t held_since = 0;
+};
+
+template <typename M>
+class ProfiledLockGuard {
+public:
+    explicit ProfiledLockGuard(M& mu, const char* file = __builtin_FILE(), int line = __builtin_LINE())
+        : m(mu) {
+        LockStats* site = lock_stats_for(g_lock_sites, file, line);
+        site->lock_class.store(m.stats, std::memory_order_relaxed);
+        m.lock_at(site);
+    }
+    ~ProfiledLockGuard() { m.unlock(); }
+    ProfiledLockGuard(const ProfiledLockGuard&) = delete;
+    ProfiledLockGuard& operator=(const ProfiledLockGuard&) = delete;
+private:
+    M& m;
+};
+
+template <typename M>
+class ProfiledUniqueLock {
+public:
+    explicit ProfiledUniqueLock(M& mu, const char* file = __builtin_FILE(), int line = __builtin_LINE())
+        : m(&mu), site(lock_stats_for(g_lock_sites, file, line)) {
+        site->lock_class.store(m->stats, std::memory_order_relaxed);
+        lock();
+    }
+    ~ProfiledUniqueLock() { if (owns) m->unlock(); }
+    ProfiledUniqueLock(const ProfiledUniqueLock&) = delete;
+    ProfiledUniqueLock& operator=(const ProfiledUniqueLock&) = delete;
+
+    void lock() { m->lock_at(site); owns = true; }
+    void unlock() { owns = false; m->unlock(); }
+    bool owns_lock() const { return owns; }
+    M* mutex() const { return m; }
+private:
+    M* m;
+    LockStats* site;
+    bool owns = false;
+};
+
+// condition variable: เวลาที่หลับรอสัญญาณนับแยก (cond wait) ไม่ปนกับเวลารอ lock
+class ProfiledCondVar {
+public:
+    template <typename L, typename Pred>
+    void wait(L& lock, Pred pred) {
+        uint64_t start = lock_now_ns();
+        cv.wait(lock, pred);
+        LockStats* stats = lock.mutex()->stats;
+        stats->cond_waits.fetch_add(1, std::memory_order_relaxed);
+        stats->cond_ns.fetch_add(lock_now_ns() - start, std::memory_order_relaxed);
+    }
+    template <typename L, typename Duration, typename Pred>
+    bool wait_for(L& lock, const Duration& timeout, Pred pred) {
+        uint64_t start = lock_now_ns();
+        bool ok = cv.wait_for(lock, timeout, pred);
+        LockStats* stats = lock.mutex()->stats;
+        stats->cond_waits.fetch_add(1, std::memory_order_relaxed);
+        stats->cond_ns.fetch_add(lock_now_ns() - start, std::memory_order_relaxed);
+        return ok;
+    }
+    void notify_one() { cv.notify_one(); }
+    void notify_all() { cv.notify_all(); }
+private:
+    std::condition_variable_any cv;
+};
+
+using mutex = ProfiledMutex;
+template <typename M>
+using lock_guard = ProfiledLockGuard<M>;
+template <typename M>
+using unique_lock = ProfiledUniqueLock<M>;
+using condvar = ProfiledCondVar;
+
+void lock_name(ProfiledMutex& m, const char* name) { m.stats->name = name; }
+
+string lock_label(const LockStats& s) {
+    const char* name = s.name.load();
+    if (name) return name;
+    const char* file = s.file ? strrchr(s.file, '/') : nullptr;
+    return string(file ? file + 1 : (s.file ? s.file : "?")) + ":" + to_string(s.line);
+}
+
+void lock_report() {
+    auto us = [](uint64_t ns) { return (double)ns / 1000.0; };
+    auto collect = [](LockStats* table) {
+        vector<LockStats*> rows;
+        for (int i = 0; i < LOCK_TABLE; ++i) {
+            if (table[i].key.load() != 0 && table[i].acquires.load() > 0) rows.push_back(&table[i]);
+        }
+        std::sort(rows.begin(), rows.end(), [](LockStats* a, LockStats* b) { return a->wait_ns > b->wait_ns; });
+        return rows;
+    };
+
+    printf("\n=== Lock profile (sorted by total wait) ===\n");
+    printf("%-22s %10s %9s %12s %10s %10s %12s %10s %10s %12s\n", "lock", "acquires", "contended",
+           "wait total", "wait p99", "wait p99.9", "hold total", "hold p50", "hold p99", "cond wait");
+    for (LockStats* s : collect(g_lock_classes)) {
+        uint64_t n = s->acquires.load();
+        printf("%-22s %10llu %8.1f%% %10.0fus %8.1fus %8.1fus %10.0fus %8.1fus %8.1fus %10.0fus\n",
+               lock_label(*s).c_str(), (unsigned long long)n, 100.0 * (double)s->contended.load() / (double)n,
+               us(s->wait_ns.load()), us(s->wait.percentile(0.99)), us(s->wait.percentile(0.999)),
+               us(s->hold_ns.load()), us(s->hold.percentile(0.50)), us(s->hold.percentile(0.99)),
+               us(s->cond_ns.load()));
+    }
+    printf("--- Call sites (top 15 by total wait) ---\n");
+    printf("%-16s %-22s %10s %9s %12s %10s %12s %10s\n", "site", "lock", "acquires", "contended",
+           "wait total", "wait p99", "hold total", "hold p99");
+    vector<LockStats*> sites = collect(g_lock_sites);
+    for (size_t i = 0; i < sites.size() && i < 15; ++i) {
+        LockStats* s = sites[i];
+        LockStats* cls = s->lock_class.load();
+        uint64_t n = s->acquires.load();
+        printf("%-16s %-22s %10llu %8.1f%% %10.0fus %8.1fus %10.0fus %8.1fus\n", lock_label(*s).c_str(),
+               cls ? lock_label(*cls).c_str() : "?", (unsigned long long)n,
+               100.0 * (double)s->contended.load() / (double)n, us(s->wait_ns.load()),
+               us(s->wait.percentile(0.99)), us(s->hold_ns.load()), us(s->hold.percentile(0.99)));
+    }
+    fflush(stdout);
+}
+
+void handle_sigusr1(int) { g_lock_report_requested = 1; }
+#else
+using std::mutex;
+using std::lock_guard;
+using std::unique_lock;
+using condvar = std::condition_variable;
+inline void lock_name(mutex&, const char*) {}
+inline void lock_report() {}
+#endif
+
+// --- mq_* ที่ถูกนับ (ใช้ในเส้นทางที่ทำงานบ่อย: send_reply, main loop, heartbeat, eviction) ---
+inline mqd_t sys_mq_open(const char* name, int flags) {
+    stat_add(SK_MQ_OPEN);
+    return mq_open(name, flags);
+}
+inline int sys_mq_send(mqd_t q, const char* data, size_t len, unsigned prio) {
+    stat_add(SK_MQ_SEND);
+    return mq_send(q, data, len, prio);
+}
+inline ssize_t sys_mq_receive(mqd_t q, char* buf, size_t len, unsigned* prio) {
+    stat_add(SK_MQ_RECV);
+    return mq_receive(q, buf, len, prio);
+}
+inline int sys_mq_close(mqd_t q) {
+    stat_add(SK_MQ_CLOSE);
+    return mq_close(q);
+}
+inline int sys_mq_getattr(mqd_t q, struct mq_attr* attr) {
+    stat_add(SK_MQ_OTHER);
+    return mq_getattr(q, attr);
+}
+inline int sys_mq_unlink(const char* name) {
+    stat_add(SK_MQ_OTHER);
+    return mq_unlink(name);
+}
+
+// --- Symbol Table: แปลงชื่อ (user / room) เป็น ID ตัวเลขแบบ dense ---
+// ชื่อจะถูก intern ครั้งเดียวตอน REGISTER / CREATE หลังจากนั้น registry ทุกตัวใช้ ID เป็น index ของ vector
+// (ไม่ต้องเทียบ string ทุกครั้ง) ส่วนชื่อเก็บไว้แค่สำหรับแสดงผล
+// ID ที่ถูกปล่อย (user ออก / ห้องถูกลบ) จะถูกนำกลับมาใช้ใหม่ เพื่อให้ ID ยังหนาแน่นอยู่เสมอ
+// ‼️ ไม่ thread-safe ในตัวเอง: user_names ใช้ภายใต้ clients_mutex, room_names ใช้ภายใต้ rooms_mutex
+using UserId = uint32_t;
+using RoomId = uint32_t;
+const uint32_t NO_ID = UINT32_MAX;
+
+struct SymbolTable {
+    FlatStringMap<uint32_t> ids; // ชื่อ -> ID (open addressing, ค้นด้วย string_view ได้)
+    vector<string> names;        // ID -> ชื่อ ("" = ว่าง)
+    vector<uint32_t> free_ids;   // ID ที่ว่างรอนำกลับมาใช้
+
+    uint32_t find(std::string_view name) const {
+        const uint32_t* id = ids.find(name);
+        return id ? *id : NO_ID;
+    }
+
+    uint32_t intern(std::string_view name) {
+        uint32_t id = find(name);
+        if (id != NO_ID) return id;
+        if (!free_ids.empty()) {
+            id = free_ids.back();
+            free_ids.pop_back();
+            names[id] = string(name);
+        } else {
+            id = (uint32_t)names.size();
+            names.emplace_back(name);
+        }
+        ids.insert(name, id);
+        return id;
+    }
+
+    void release(uint32_t id) {
+        if (id >= names.size() || names[id].empty()) return;
+        ids.erase(names[id]);
+        names[id].clear();
+        free_ids.push_back(id);
+    }
+
+    const string& name(uint32_t id) const { return names[id]; }
+    size_t capacity() const { return names.size(); }
+};
+
+// --- Token Bucket (ใช้จำกัดอัตรา CHAT / DM ต่อ session และต่อห้อง ดู rate_check()) ---
+// เติม rate token ต่อวินาที เก็บได้สูงสุด burst ส่ง 1 ข้อความใช้ 1 token
+// tokens ติดลบได้ (โหมด delay): = หนี้ที่ต้องรอให้เติมคืนก่อน ผู้ส่งจะได้ credit คืน
+struct RateLimit {
+    double rate = 0;     // token ต่อวินาที (0 = ปิด)
+    double burst = 0;
+};
+
+struct TokenBucket {
+    double tokens = 0;
+    uint64_t last_ns = 0;   // 0 = ยังไม่เคยใช้ (เริ่มแบบเต็ม)
+
+    void refill(const RateLimit& lim, uint64_t now) {
+        tokens = (last_ns == 0) ? lim.burst
+                                : std::min(lim.burst, tokens + (double)(now - last_ns) * lim.rate / 1e9);
+        last_ns = now;
+    }
+    // เวลาที่ต้องรอจนหนี้หมด (ns)
+    uint64_t debt_ns(const RateLimit& lim) const {
+        return (tokens >= 0) ? 0 : (uint64_t)(-tokens / lim.rate * 1e9);
+    }
+};
+
+// --- โครงสร้างข้อมูลสำหรับติดตามสถานะ (index ด้วย ID) ---
 struct ClientInfo {
-    string username;
+    bool active = false;
     string reply_queue;
-    string current_room;
+    RoomId current_room = NO_ID;   // NO_ID = อยู่ใน Lobby
+    uint32_t member_pos = 0;       // ตำแหน่งใน rooms[current_room].members (ลบออกได้ O(1))
+    int credits_owed = 0;          // credit ที่ต้องคืนให้ client (ยังไม่ได้ส่ง CREDIT|n)
+    uint32_t generation = 0;       // เพิ่มทุกครั้งที่ slot นี้ถูกปล่อย (ใช้ตรวจ session token)
+    uint32_t shed = 0;             // จำนวนคำสั่งที่ถูกทิ้งตอน server ไม่ว่าง (ดู should_shed())
+    TokenBucket bucket;            // อัตรา CHAT / DM ของ session นี้
+    uint64_t credit_hold_until = 0; // (โหมด delay) ห้ามคืน credit ก่อนเวลานี้ (mono_ns)
+    bool subscribed = false;       // ส่ง SYNC แล้ว: ได้รับ delta ของ directory (DIR|...) ทุกรอบ push
+};
+
+// --- Directory Cache: ข้อความตอบกลับของ LIST / WHO / MEMBERS ที่ render ไว้แล้ว ---
+// ทุกครั้งที่ห้อง / สมาชิก / ผู้ใช้เปลี่ยน จะเพิ่ม version (ภายใต้ lock ของ registry นั้นอยู่แล้ว)
+// ตอนอ่าน: ถ้า version ของ cache ตรงกับปัจจุบัน ส่ง cache ได้เลยโดยไม่ต้องล็อค registry
+// ไม่ตรง = render ใหม่ภายใต้ lock ครั้งเดียว แล้ว publish ให้คำสั่งถัดๆ ไปใช้ร่วมกัน
+// ข้อความถูกแบ่งเป็นหน้า (ดู PageBuilder) ไม่ว่า registry จะใหญ่แค่ไหน แต่ละคำสั่งส่งแค่หน้าเดียว
+struct Rendered {
+    uint64_t version = 0;
+    string subject;        // (สำหรับ log: ชื่อห้องของ WHO)
+    vector<string> pages;  // frame ที่พร้อมส่ง: "<KIND>|<next>|<payload>"
+
+    // สำหรับ render หน้าที่เริ่มกลางหน้า (cursor ชี้ไปหลัง key ที่ไม่ตรงกับต้นหน้าใดๆ ของ render นี้)
+    string kind;
+    string header;                                  // ใส่หน้า payload ของทุกหน้า (SYNC: "<seq>|")
+    string title;                                   // นำหน้าเฉพาะหน้าแรก (เช่น "Online users: ")
+    size_t limit = 0;                               // ความยาว payload สูงสุดต่อหน้า
+    vector<std::pair<uint64_t, string>> items;      // (key, ข้อความ) เรียงตาม key
+    vector<size_t> page_start;                      // index ใน items ที่แต่ละหน้าเริ่ม
 };
+using RenderedPtr = std::shared_ptr<const Rendered>;
 
 struct Room {
-    string name;
+    bool active = false;
+    vector<UserId> members;        // สมาชิกในห้อง (broadcast วนแค่ตรงนี้ ไม่ต้อง scan client ทั้งหมด)
+    uint64_t version = 0;          // เพิ่มทุกครั้งที่สมาชิกเปลี่ยน
+    TokenBucket bucket;            // อัตรา CHAT รวมของห้อง
+    int weight = 1;                // weight ของห้องใน DRR scheduler (--room-weights)
+};
+
+// --- Membership Snapshot (RCU / copy-on-write) ---
+// สำเนาสมาชิกของห้องที่ "ไม่เปลี่ยนอีกแล้ว" writer (JOIN / LEAVE ภายใต้ lock 1 -> 2) สร้างสำเนาใหม่
+// แล้วสลับ pointer ทีเดียว ส่วน reader (broadcast / WHO) แค่ atomic_load ไม่ต้องล็อค registry เลย
+// snapshot เก่าจะถูกคืนหน่วยความจำเองเมื่อ reader คนสุดท้ายปล่อย shared_ptr
+// สมาชิกที่ใช้คิวตอบกลับร่วมกัน (session แบบ multiplex "<queue>#<tag>" ที่ queue เดียวกัน)
+// fan-out ส่งครั้งเดียวต่อคิว: "@<tag>,<tag>,...|<ข้อความ>"
+struct MuxGroup {
+    string queue;                  // ชื่อคิวจริง (ไม่มี "#tag")
+    vector<UserId> ids;
+    vector<string> tags;           // (index เดียวกับ ids)
+};
+
+struct MemberSnapshot {
+    uint64_t version = 0;          // = Room::version ตอนสร้าง
+    string room_name;
+    vector<UserId> ids;
+    vector<string> queues;         // reply queue ของสมาชิก (index เดียวกับ ids)
+    vector<string> names;
+    vector<char> grouped;          // 1 = สมาชิกนี้ส่งผ่าน mux (ไม่ต้องส่งทีละคน)
+    vector<MuxGroup> mux;
+    mutable RenderedPtr who;       // WHO ที่ render ไว้ (สร้างครั้งแรกที่มีคนขอ, atomic_load / atomic_store)
+};
+using SnapshotPtr = std::shared_ptr<const MemberSnapshot>;
+
+// ช่องเก็บ snapshot ต่อห้อง: จองเป็น chunk ที่ไม่ถูกย้ายที่ (reader อ่านได้ปลอดภัยแม้ rooms จะ resize)
+// chunk ไม่ถูกคืนจนจบโปรแกรม (อย่างมาก MAX_ROOMS ช่อง)
+struct SnapshotTable {
+    static const size_t CHUNK = 256;
+    static const size_t MAX_CHUNKS = 4096;
+    static const size_t MAX_ROOMS = CHUNK * MAX_CHUNKS;
+    std::atomic<SnapshotPtr*> chunks[MAX_CHUNKS] = {};
+
+    SnapshotPtr load(RoomId room) const {
+        if (room >= MAX_ROOMS) return nullptr;
+        SnapshotPtr* chunk = chunks[room / CHUNK].load(std::memory_order_acquire);
+        return chunk ? std::atomic_load(&chunk[room % CHUNK]) : nullptr;
+    }
+
+    // ‼️ writer ต้องถือ rooms_mutex
+    void store(RoomId room, SnapshotPtr snap) {
+        if (room >= MAX_ROOMS) return;
+        SnapshotPtr* chunk = chunks[room / CHUNK].load(std::memory_order_relaxed);
+        if (chunk == nullptr) {
+            chunk = new SnapshotPtr[CHUNK];
+            chunks[room / CHUNK].store(chunk, std::memory_order_release);
+        }
+        std::atomic_store(&chunk[room % CHUNK], std::move(snap));
+    }
+};
+
+// ค่าต่อ ID ที่อ่านได้โดยไม่ล็อค (chunk ไม่ถูกย้ายที่เหมือน SnapshotTable) ช่องที่ยังไม่เคยเขียน = empty
+template <typename T>
+struct AtomicSlots {
+    static const size_t CHUNK = 256;
+    static const size_t MAX_CHUNKS = 4096;
+    static const size_t MAX_IDS = CHUNK * MAX_CHUNKS;
+    T empty;
+    std::atomic<std::atomic<T>*> chunks[MAX_CHUNKS] = {};
+
+    explicit AtomicSlots(T e) : empty(e) {}
+
+    T load(uint32_t id) const {
+        if (id >= MAX_IDS) return empty;
+        std::atomic<T>* chunk = chunks[id / CHUNK].load(std::memory_order_acquire);
+        return chunk ? chunk[id % CHUNK].load(std::memory_order_relaxed) : empty;
+    }
+
+    // ‼️ writer ต้องถือ mutex ของ registry ที่เป็นเจ้าของ ID (clients_mutex / rooms_mutex)
+    void store(uint32_t id, T value) {
+        if (id >= MAX_IDS) return;
+        std::atomic<T>* chunk = chunks[id / CHUNK].load(std::memory_order_relaxed);
+        if (chunk == nullptr) {
+            chunk = new std::atomic<T>[CHUNK];
+            for (size_t i = 0; i < CHUNK; ++i) chunk[i].store(empty, std::memory_order_relaxed);
+            chunks[id / CHUNK].store(chunk, std::memory_order_release);
+        }
+        chunk[id % CHUNK].store(value, std::memory_order_relaxed);
+    }
 };
 
 // --- Global State & Mutexes ---
-map<string, ClientInfo> clients;
+SymbolTable user_names;
+vector<ClientInfo> clients;    // index = UserId
 mutex clients_mutex;    // ‼️ Mutex ระดับ 1 (ต้องล็อคก่อน)
-map<string, Room> rooms;
+SymbolTable room_names;
+vector<Room> rooms;            // index = RoomId
 mutex rooms_mutex;      // ‼️ Mutex ระดับ 2 (ต้องล็อคทีหลัง)
 
-map<string, time_t> room_last_active;
-mutex room_mutex;
-map<string, time_t> last_heartbeat;
-mutex hb_mutex;
-map<string, time_t> last_active;
-mutex active_mutex;
+// LIST / MEMBERS อ่าน cache ผ่าน std::atomic_load / std::atomic_store เท่านั้น (ไม่ล็อค registry)
+std::atomic<uint64_t> g_rooms_version(1);  // ห้องถูกสร้าง / ลบ หรือจำนวนสมาชิกเปลี่ยน (เพิ่มภายใต้ rooms_mutex)
+std::atomic<uint64_t> g_users_version(1);  // user เข้า / ออก (เพิ่มภายใต้ clients_mutex)
+RenderedPtr g_list_cache;
+RenderedPtr g_members_cache;
 
-// --- Worker Thread Pool ---
-queue<string> task_queue;        // คิวงาน (ข้อความที่ได้รับ)
-mutex queue_mutex;           // Mutex สำหรับป้องกัน task_queue
-std::condition_variable queue_cond;    // ตัวส่งสัญญาณให้ Worker ตื่น
-std::atomic<bool> g_server_running(true); // Flag สากลสำหรับสั่งหยุด
+// --- Directory Deltas (SYNC / DIR) ---
+// client ที่ส่ง SYNC ได้ snapshot ของ directory ทั้งหมด (แบ่งหน้าเหมือน LIST) แล้วได้ delta ที่ server push ให้ทุก
+// --dir-push-ms จากนั้นตอบ /list /who /members จาก cache ของตัวเองได้ โดยไม่ต้องถาม server ทุกครั้ง
+// ทุกการเปลี่ยนแปลงเป็น op แบบกำหนดค่า (ทำซ้ำแล้วผลเท่าเดิม) เรียงด้วย seq ต่อเนื่อง (คั่น field ด้วย '\t'):
+//   "u <name> <room>" = user ออนไลน์ อยู่ในห้องนี้ (ว่าง = Lobby)   "-u <name>" = user ออกไปแล้ว
+//   "r <room>" = มีห้องนี้                                         "-r <room>" = ห้องถูกลบ
+// op ถูกเพิ่มขณะถือ clients_mutex หรือ rooms_mutex เสมอ -> snapshot ที่ render ภายใต้ล็อค 1 + 2 ตรงกับ seq นั้นพอดี
+mutex dir_mutex;                          // (ล็อคใบ: ถือซ้อนใต้ล็อค 1 / 2 ได้)
+std::atomic<uint64_t> g_dir_seq(0);       // seq ของ op ล่าสุด (เพิ่มภายใต้ dir_mutex)
+uint64_t g_dir_pushed = 0;                // seq ล่าสุดที่ push ไปแล้ว (g_dir_pushed + g_dir_ops.size() == g_dir_seq)
+vector<string> g_dir_ops;                 // op ที่ยังไม่ได้ push
+std::atomic<int> g_dir_subscribers(0);
+std::atomic<uint64_t> g_dir_syncs(0), g_dir_frames(0);
+int g_dir_push_ms = 250;
+RenderedPtr g_dir_cache;
 
-// --- Helper Function: ส่งข้อความตอบกลับ ---
-void send_reply(const string& reply_q, const string& text) {
-    if (reply_q.empty()) return;
-    // O_NONBLOCK: ถ้าคิว client เต็ม (อาจจะค้าง) ให้ fail ทันที
-    mqd_t client_q = mq_open(reply_q.c_str(), O_WRONLY | O_NONBLOCK);
-    if (client_q != (mqd_t)-1) {
-        mq_send(client_q, text.c_str(), text.size() + 1, 0);
-        mq_close(client_q);
+// ชื่อ user / ห้องเข้าไปอยู่ใน op ตรงๆ (ไม่ escape): REGISTER / CREATE ปฏิเสธชื่อที่มี '|' หรืออักขระควบคุม
+// ('\t' '\n' ฯลฯ) ซึ่งจะทำให้ client แยก SYNC / DIR ผิด
+bool valid_name(std::string_view name) {
+    if (name.empty()) return false;
+    for (char c : name) {
+        if ((unsigned char)c < 0x20 || c == 0x7f || c == '|') return false;
     }
+    return true;
 }
 
-// --- Helper Function: ดึงเวลาปัจจุบัน ---
-string currentTime() {
-    time_t now = time(nullptr);
-    char buf[9];
-    strftime(buf, sizeof(buf), "%H:%M:%S", localtime(&now));
-    return string(buf);
+void dir_op(std::initializer_list<std::string_view> parts) {
+    lock_guard<mutex> lock(dir_mutex);
+    if (g_dir_subscribers.load() == 0 && g_dir_ops.empty()) { // (ไม่มีใคร subscribe: แค่เลื่อน seq)
+        g_dir_pushed = ++g_dir_seq;
+        return;
+    }
+    string op;
+    for (std::string_view p : parts) op.append(p);
+    g_dir_ops.push_back(std::move(op));
+    g_dir_seq++;
 }
 
-// --- ‼️ FIX 1: แก้ไข broadcast_to_room (ป้องกัน Deadlock) ---
-void broadcast_to_room(const string& room_name, const string& sender_name, const string& message) {
-    if (room_name.empty()) return; // ถ้า room ว่าง (เช่น lobby) ไม่ต้องทำ
+SnapshotTable g_room_members;      // index = RoomId (nullptr = ห้องไม่มีอยู่)
 
-    vector<string> recipient_queues;
-    {
-        // --- ปฏิบัติตามกฎ: ล็อค 1 (clients) ก่อน 2 (rooms) ---
-        lock_guard<mutex> lock1(clients_mutex);
-        lock_guard<mutex> lock2(rooms_mutex);
+// สำเนาสำหรับ DRR scheduler (drr_classify อ่านจาก receive thread โดยไม่ล็อค registry)
+// route ของ user = (generation << 32) | ห้องปัจจุบัน เขียนคู่กับ clients[uid] เสมอ (token เก่า -> generation ไม่ตรง)
+AtomicSlots<uint64_t> g_user_route(NO_ID);   // index = UserId (เขียนภายใต้ clients_mutex)
+AtomicSlots<int> g_room_weight(1);           // index = RoomId (เขียนภายใต้ rooms_mutex)
+
+void publish_route_locked(UserId uid) {
+    g_user_route.store(uid, ((uint64_t)clients[uid].generation << 32) | clients[uid].current_room);
+}
+
+vector<time_t> room_last_active;   // index = RoomId
+mutex room_mutex;       // ระดับ 3 (ล็อคหลัง rooms_mutex ได้)
+
+// --- เวลาของแต่ละ session (heartbeat + activity อยู่ใน vector เดียว, index = UserId) ---
+// ทุกคำสั่งที่เข้ามานับเป็น heartbeat (ไม่ต้องรอ PING)
+// ส่วน last_active นับเฉพาะคำสั่งที่ไม่ใช่ PING (ใช้เตะคนที่ไม่ทำอะไรเลย)
+struct SessionTimes {
+    time_t last_seen = 0;     // คำสั่งล่าสุด (รวม PING), 0 = ไม่มี session
+    time_t last_active = 0;   // กิจกรรมล่าสุด (ไม่รวม PING)
+    int hb_advertised = 0;    // heartbeat interval ที่แจ้ง client ล่าสุด
+};
+vector<SessionTimes> session_times;
+mutex hb_mutex;         // ระดับ 3 (ล็อคหลัง clients_mutex ได้)
+
+std::mt19937 g_token_rng(std::random_device{}()); // generation เริ่มต้นของ session slot (ใช้ภายใต้ clients_mutex)
 
-        // ถ้าห้องถูกลบไปแล้ว ก็ไม่ต้องทำ
-        if (rooms.count(room_name) == 0) return;
+// --- Worker Thread Pool ---
+std::atomic<bool> g_server_running(true); // Flag สากลสำหรับสั่งหยุด
+// --- Message Pool: ช่องรับข้อความขนาด MQ_MSGSIZE ที่จองไว้ล่วงหน้า ---
+// mq_receive เขียนลงช่องโดยตรง แล้วส่งแค่ (เลขช่อง, ความยาว) ผ่าน task_queue ให้ Worker
+// Worker คืนช่องหลังประมวลผลเสร็จ -> ไม่มีการ copy / new ระหว่าง kernel กับ process_message()
+// ถ้าช่องหมด main loop จะรอ (ข้อความไปค้างใน /chat_control แทน ซึ่งเป็น backpressure ที่ถูกต้อง)
+struct MsgRef {
+    uint32_t slot;
+    uint32_t len;
+    uint64_t recv_ns;   // เวลาที่ main loop รับข้อความ (วัด latency)
+    uint32_t trace = 0; // trace ID (0 = ไม่ได้ถูกสุ่มมา trace)
+    bool shed = false;  // main loop ตัดสินให้ทิ้ง: worker / shard เจ้าของ user ตอบ BUSY แทน (ดู should_shed())
+};
+
+// เวลาแบบ monotonic (ns) สำหรับวัด latency
+uint64_t mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+struct MessagePool {
+    vector<char> storage;          // slots * MQ_MSGSIZE ติดกันเป็นก้อนเดียว
+    vector<uint32_t> free_slots;   // stack ของช่องที่ว่าง
+    mutex pool_mutex;
+    condvar pool_cond;
+
+    void init(size_t slots) {
+        storage.assign(slots * MQ_MSGSIZE, 0);
+        free_slots.resize(slots);
+        for (size_t i = 0; i < slots; ++i) free_slots[i] = (uint32_t)(slots - 1 - i);
+    }
+
+    char* data(uint32_t slot) { return storage.data() + (size_t)slot * MQ_MSGSIZE; }
+
+    // คืนค่า false ถ้า Server กำลังปิด
+    bool acquire(uint32_t& slot) {
+        unique_lock<mutex> lock(pool_mutex);
+        pool_cond.wait(lock, [&]{ return !free_slots.empty() || !g_server_running; });
+        if (free_slots.empty()) return false;
+        slot = free_slots.back();
+        free_slots.pop_back();
+        return true;
+    }
+
+    void release(uint32_t slot) {
+        {
+            lock_guard<mutex> lock(pool_mutex);
+            free_slots.push_back(slot);
+        }
+        pool_cond.notify_one();
+    }
+};
+MessagePool msg_pool;
 
-        // 1. รวบรวม "คิว" ที่จะส่ง (ทำงานเร็วๆ)
-        for (auto const& [name, info] : clients) {
-            if (info.current_room == room_name && name != sender_name) {
-                recipient_queues.push_back(info.reply_queue);
+// --- คิวงานแบบ ring buffer ขนาดคงที่ (เท่าจำนวนช่องใน pool จึงไม่มีวันเต็ม) ---
+struct TaskRing {
+    vector<MsgRef> buf;
+    size_t head = 0;
+    size_t count = 0;
+
+    void init(size_t capacity) { buf.assign(capacity, MsgRef{0, 0, 0}); }
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+
+    void push(MsgRef ref) {
+        buf[(head + count) % buf.size()] = ref;
+        count++;
+    }
+
+    MsgRef pop() {
+        MsgRef ref = buf[head];
+        head = (head + 1) % buf.size();
+        count--;
+        return ref;
+    }
+};
+
+TaskRing task_queue;         // คิวงาน (อ้างอิงช่องใน msg_pool)
+mutex queue_mutex;           // Mutex สำหรับป้องกัน task_queue
+condvar queue_cond;    // ตัวส่งสัญญาณให้ Worker ตื่น
+std::atomic<size_t> g_backlog(0);      // จำนวนงานค้างใน task_queue (อ่านได้โดยไม่ต้องล็อค)
+
+// --- Weighted Fair Scheduler (--scheduler=drr) ---
+// แทน task_queue แบบ FIFO ด้วยคิวย่อยต่อ "flow": CHAT = flow ของห้อง, คำสั่งอื่น (DM / LIST / ...) = flow ของ session
+// worker หยิบงานแบบ Deficit Round-Robin: แต่ละรอบ flow ได้หยิบ weight ข้อความ แล้วต่อท้ายรอบ
+// -> ห้องที่ยิงรัวๆ ไม่ทำให้ห้องเงียบต้องรอหลังคิวยาว (ห้องเงียบได้คิวทุกรอบ)
+// weight ของห้องตั้งได้ด้วย --room-weights=<ห้อง>:<w>,... (ค่าเริ่มต้น 1)
+// ‼️ ลำดับต่อ user: ถ้า user ยังมีงานค้างอยู่ใน flow ไหน คำสั่งถัดไปของเขาจะเข้า flow เดิม
+//    (เช่น EXIT ตามหลัง CHAT ในคิวของห้อง) ไม่งั้น EXIT จะแซง CHAT ได้
+// ใช้ queue_mutex / queue_cond / worker_thread ร่วมกับ fifo (adaptive pool ใช้ได้เหมือนเดิม)
+// ‼️ push/pop อยู่ใต้ queue_mutex บน receive thread: ห้าม allocate
+//    ทุกตารางจองไว้ตอน init(pool_slots) (งานค้าง / flow / user ที่มีงานค้าง มีได้ไม่เกินจำนวนช่องของ pool)
+struct DrrQueue {
+    static constexpr uint32_t NIL = UINT32_MAX;
+
+    // hash แบบ open addressing ขนาดคงที่ (key -> V) ลบด้วย backward shift ไม่มี tombstone
+    template <typename V>
+    struct FixedIndex {
+        static constexpr uint64_t EMPTY = ~0ULL;
+        vector<uint64_t> keys;
+        vector<V> vals;
+        size_t mask = 0;
+
+        void init(size_t n) {
+            size_t cap = 16;
+            while (cap < n * 2) cap <<= 1; // load factor <= 0.5
+            keys.assign(cap, EMPTY);
+            vals.assign(cap, V{});
+            mask = cap - 1;
+        }
+        size_t home(uint64_t k) const { return (size_t)(k * 0x9E3779B97F4A7C15ULL >> 32) & mask; }
+
+        V* find(uint64_t k) {
+            for (size_t i = home(k);; i = (i + 1) & mask) {
+                if (keys[i] == k) return &vals[i];
+                if (keys[i] == EMPTY) return nullptr;
+            }
+        }
+        void insert(uint64_t k, V v) {
+            size_t i = home(k);
+            while (keys[i] != EMPTY) i = (i + 1) & mask;
+            keys[i] = k;
+            vals[i] = v;
+        }
+        void erase(uint64_t k) {
+            size_t i = home(k);
+            while (keys[i] != k) {
+                if (keys[i] == EMPTY) return;
+                i = (i + 1) & mask;
             }
+            for (size_t j = (i + 1) & mask; keys[j] != EMPTY; j = (j + 1) & mask) {
+                // ย้าย keys[j] มาเติมช่องว่างได้ถ้าช่องบ้านของมันไม่อยู่ระหว่าง (i, j]
+                if (((j - home(keys[j])) & mask) >= ((j - i) & mask)) {
+                    keys[i] = keys[j];
+                    vals[i] = vals[j];
+                    i = j;
+                }
+            }
+            keys[i] = EMPTY;
         }
-    } // ‼️ ปลดล็อค rooms_mutex และ clients_mutex ทันที
+    };
 
-    string timeStr = "[" + currentTime() + "] ";
-    string full_message = "CHAT|" + timeStr + sender_name + ": " + message;
+    struct Entry {          // index = ช่องใน msg_pool (งานหนึ่งชิ้นใช้หนึ่งช่อง)
+        MsgRef ref;
+        UserId uid;
+        uint32_t next;      // งานถัดไปใน flow เดียวกัน (intrusive list)
+    };
+    struct Flow {
+        uint64_t key;
+        uint32_t head, tail; // งานแรก / งานสุดท้ายของ flow (index ใน entries)
+        int weight;
+        int deficit;
+    };
+    struct UserFlow {
+        uint32_t flow;       // flow ที่งานค้างของ user อยู่
+        uint32_t pending;
+    };
 
-    // 2. ส่งข้อความ (ทำงานช้าๆ) "นอก" Lock
-    for (const auto& q : recipient_queues) {
-        send_reply(q, full_message);
+    vector<Entry> entries;
+    vector<Flow> flows;                 // index = flow slot
+    vector<uint32_t> free_flows;        // stack ของ flow slot ที่ว่าง
+    FixedIndex<uint32_t> flow_index;    // key -> flow slot (เฉพาะ flow ที่มีงาน)
+    FixedIndex<UserFlow> users;         // user ที่ยังมีงานค้าง -> flow ที่งานอยู่
+    vector<uint32_t> active;            // ring ของ flow slot ที่มีงาน = ลำดับรอบ
+    size_t active_head = 0;
+    size_t active_count = 0;
+    size_t count = 0;
+
+    void init(size_t slots) {
+        entries.assign(slots, Entry{MsgRef{0, 0, 0}, NO_ID, NIL});
+        flows.assign(slots, Flow{0, NIL, NIL, 1, 0});
+        free_flows.resize(slots);
+        for (size_t i = 0; i < slots; ++i) free_flows[i] = (uint32_t)(slots - 1 - i);
+        flow_index.init(slots);
+        users.init(slots);
+        active.assign(slots, NIL);
+        active_head = active_count = count = 0;
     }
-}
-// --- ‼️ END FIX 1 ---
 
-// --- Helper Function: นับสมาชิกในห้อง (Thread-safe) ---
-int count_members_in_room(const string& room_name) {
-    int count = 0;
-    lock_guard<mutex> lock(clients_mutex); // ล็อค clients (ระดับ 1)
-    for (auto const& [name, info] : clients) {
-        if (info.current_room == room_name) {
-            count++;
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+
+    void push(const MsgRef& ref, UserId uid, uint64_t key, int weight) {
+        uint32_t fi = NIL;
+        if (uid != NO_ID) {
+            if (UserFlow* u = users.find(uid)) {
+                fi = u->flow; // ตามงานที่ค้างอยู่ของ user คนนี้
+                u->pending++;
+            }
+        }
+        if (fi == NIL) {
+            if (uint32_t* f = flow_index.find(key)) {
+                fi = *f;
+            } else {
+                fi = free_flows.back();
+                free_flows.pop_back();
+                flows[fi] = Flow{key, NIL, NIL, std::max(1, weight), 0};
+                flow_index.insert(key, fi);
+                active[(active_head + active_count++) % active.size()] = fi;
+            }
+            if (uid != NO_ID) users.insert(uid, UserFlow{fi, 1});
         }
+        entries[ref.slot] = Entry{ref, uid, NIL};
+        Flow& f = flows[fi];
+        if (f.tail == NIL) f.head = ref.slot;
+        else entries[f.tail].next = ref.slot;
+        f.tail = ref.slot;
+        count++;
     }
-    return count;
-} // (ฟังก์ชันนี้ OK)
 
-// --- Signal Handler (สำหรับ Thread Pool) ---
-void handle_sigint(int) {
-    cout << "\n[Server] Caught SIGINT, shutting down..." << endl;
+    MsgRef pop() {
+        uint32_t fi = active[active_head];
+        Flow& f = flows[fi];
+        if (f.deficit <= 0) f.deficit += f.weight; // รอบใหม่ของ flow นี้
 
-    g_server_running = false;
-    queue_cond.notify_all();
+        const Entry& e = entries[f.head];
+        f.head = e.next;
+        if (f.head == NIL) f.tail = NIL;
+        f.deficit--;
+        count--;
+        if (e.uid != NO_ID) {
+            UserFlow* u = users.find(e.uid);
+            if (u && --u->pending == 0) users.erase(e.uid);
+        }
 
-    mqd_t self_mq = mq_open(CONTROL_QUEUE, O_WRONLY);
-    if (self_mq != (mqd_t)-1) {
-        const char* stop_msg = "STOP|";
-        mq_send(self_mq, stop_msg, strlen(stop_msg) + 1, 0);
-        mq_close(self_mq);
+        if (f.head == NIL) {
+            flow_index.erase(f.key);
+            free_flows.push_back(fi); // (ไม่เกินขนาดที่จองไว้)
+            active_head = (active_head + 1) % active.size();
+            active_count--;
+        } else if (f.deficit <= 0) {
+            active_head = (active_head + 1) % active.size(); // ใช้ quantum รอบนี้หมดแล้ว ไปต่อท้าย
+            active[(active_head + active_count - 1) % active.size()] = fi;
+        }
+        return e.ref;
     }
-}
+};
+
+bool g_drr_mode = false;
+DrrQueue g_drr;                          // (ป้องกันด้วย queue_mutex เหมือน task_queue)
+map<string, int, std::less<>> g_room_weight_config; // --room-weights (อ่านอย่างเดียวหลังเริ่ม server)
 
-// --- อัปเดตเวลากิจกรรมล่าสุด (Thread-safe) ---
-void update_activity(const string& username) {
-    lock_guard<mutex> lock(active_mutex);
-    last_active[username] = time(nullptr);
+// คิวที่ worker_thread ใช้ (fifo หรือ drr) ต้องถือ queue_mutex
+bool tasks_empty() { return g_drr_mode ? g_drr.empty() : task_queue.empty(); }
+size_t tasks_size() { return g_drr_mode ? g_drr.size() : task_queue.size(); }
+MsgRef tasks_pop() { return g_drr_mode ? g_drr.pop() : task_queue.pop(); }
+
+// --- Work-Stealing Scheduler (--scheduler=steal) ---
+// Worker แต่ละตัวมี deque ของตัวเอง main loop แจกข้อความเข้า deque ตาม user (route_key)
+// ทั้งเจ้าของและ worker ที่ว่างหยิบจากหัว deque เสมอ -> คำสั่งของ user เดียวกันยังออกตามลำดับ
+// (เหมือนคิวกลาง) เช่น EXIT จะไม่แซง CHAT ที่ส่งมาก่อน
+// broadcast ไปห้องใหญ่ถูกหั่นเป็นชิ้นละ g_fanout_chunk คน: ชิ้นแรกส่งเอง ที่เหลือใส่หัว deque ตัวเอง
+// -> worker ที่ว่างขโมยไปช่วยส่งได้ และงานเล็ก (PING / DM) ไม่ต้องรอหลัง fan-out ยาวๆ
+// (deque ล็อคแยกกันทีละตัว ไม่มี lock กลางเหมือน task_queue)
+struct FanoutJob {
+    SnapshotPtr snap;     // สมาชิก ณ ตอน broadcast
+    string message;
+    UserId sender;        // ไม่ส่งกลับหาผู้ส่ง
+};
+
+struct Task {
+    MsgRef msg{};                             // ข้อความจาก control queue
+    std::shared_ptr<const FanoutJob> fanout;  // != nullptr = ชิ้นของ fan-out (ใช้ begin / end)
+    uint32_t begin = 0;
+    uint32_t end = 0;
+};
+
+struct WorkerDeque {
+    mutex m;
+    std::deque<Task> tasks;
+};
+
+bool g_steal_mode = false;
+size_t g_fanout_chunk = 64;
+vector<std::unique_ptr<WorkerDeque>> g_deques;
+thread_local int t_worker = -1;          // index ของ worker นี้ใน g_deques (-1 = ไม่ใช่ worker)
+std::atomic<size_t> g_steal_pending(0);  // งานที่ยังไม่มีใครหยิบ (ทุก deque รวมกัน)
+std::atomic<int> g_steal_sleepers(0);
+mutex steal_mutex;                       // ใช้แค่ตอนหลับ / ปลุก
+condvar steal_cond;
+
+void steal_push(int worker, Task task, bool front) {
+    {
+        lock_guard<mutex> lock(g_deques[worker]->m);
+        if (front) g_deques[worker]->tasks.push_front(std::move(task));
+        else g_deques[worker]->tasks.push_back(std::move(task));
+    }
+    g_steal_pending++;
+    if (g_steal_sleepers.load() > 0) { // (seq_cst คู่กับ steal_park())
+        lock_guard<mutex> lock(steal_mutex);
+        steal_cond.notify_one();
+    }
 }
 
-//! --- ฟังก์ชันประมวลผลข้อความ (หัวใจหลัก) ---
-void process_message(const string& msg) {
-    vector<string> parts;
-    stringstream ss(msg);
-    string token;
-    while (getline(ss, token, '|')) parts.push_back(token);
-    if (parts.empty() || parts.size() < 2) return;
+// --- Latency Histogram: เวลาตั้งแต่ main loop รับข้อความจนประมวลผลเสร็จ ---
+// bucket b = [2^(b-1), 2^b) µs, percentile รายงานเป็นขอบบนของ bucket (ไม่เกิน max)
+struct LatencyHistogram {
+    static const int BUCKETS = 40;
+    std::atomic<uint64_t> counts[BUCKETS] = {};
+    std::atomic<uint64_t> max_us{0};
 
-    string cmd = parts[0];
-    string reply_q = parts[1];
-    string username = (parts.size() >= 3) ? parts[2] : "";
+    void record(uint64_t us) {
+        int b = 0;
+        while (b + 1 < BUCKETS && (us >> b) != 0) b++;
+        counts[b].fetch_add(1, std::memory_order_relaxed);
+        uint64_t prev = max_us.load(std::memory_order_relaxed);
+        while (us > prev && !max_us.compare_exchange_weak(prev, us, std::memory_order_relaxed)) {}
+    }
 
-    // --- 1. REGISTER ---
-    if (cmd == "REGISTER" && parts.size() >= 3) {
-        username = parts[2];
-        update_activity(username);
+    uint64_t total() const {
+        uint64_t n = 0;
+        for (const auto& c : counts) n += c.load(std::memory_order_relaxed);
+        return n;
+    }
 
-        lock_guard<mutex> lock(clients_mutex); //! ล็อค (1)
-        if (clients.count(username)) {
-            send_reply(reply_q, "SYSTEM|Error: Username already taken.");
-            return;
+    uint64_t percentile(double p) const {
+        uint64_t c[BUCKETS];
+        snapshot(c);
+        return std::min(percentile_of(c, p), max_us.load());
+    }
+
+    void snapshot(uint64_t (&out)[BUCKETS]) const {
+        for (int b = 0; b < BUCKETS; ++b) out[b] = counts[b].load(std::memory_order_relaxed);
+    }
+
+    // รวม histogram ของ shard เข้าชุดกลาง (ตอนปิด server)
+    void merge(const LatencyHistogram& other) {
+        for (int b = 0; b < BUCKETS; ++b) counts[b].fetch_add(other.counts[b].load(), std::memory_order_relaxed);
+        uint64_t m = other.max_us.load();
+        if (m > max_us.load()) max_us = m;
+    }
+
+    // percentile จากจำนวนต่อ bucket (เช่น ผลต่างของ snapshot 2 ครั้ง = เฉพาะช่วงเวลานั้น)
+    static uint64_t percentile_of(const uint64_t (&c)[BUCKETS], double p) {
+        uint64_t n = 0;
+        for (uint64_t x : c) n += x;
+        uint64_t want = (uint64_t)(p * (double)n);
+        uint64_t seen = 0;
+        for (int b = 0; b < BUCKETS; ++b) {
+            seen += c[b];
+            if (seen > want) return (b == 0) ? 0 : (1ULL << b);
         }
-        clients[username] = {username, reply_q, ""};
-        send_reply(reply_q, "SYSTEM|Welcome " + username + "! You are in the Lobby.");
-        cout << "[LOG] USER_REG: " << username << " registered (Q: " << reply_q << ")\n";
+        return 0;
     }
+};
+LatencyHistogram g_latency;
+// --latency-room=<ชื่อ>: เก็บ latency ของ CHAT ในห้องนี้แยกอีกชุด (เช่น วัดห้องเงียบตอนห้องอื่นยิงหนัก)
+string g_latency_room_name;
+LatencyHistogram g_latency_room;
+thread_local bool t_latency_room = false;   // งานที่กำลังทำเป็น CHAT ของห้องนั้น
 
-    // --- 2. CREATE ---
-    else if (cmd == "CREATE" && parts.size() >= 4) {
-        string room_name = parts[2];
-        username = parts[3];
-        update_activity(username);
+// --- Pipeline Tracing (--trace-sample=N) ---
+// สุ่ม 1 ใน N ข้อความ ให้ trace ID แล้วประทับเวลา (monotonic) ทุกขั้น:
+//   receive -> enqueue -> dequeue -> lock acquired -> first / last delivery -> done
+// event ลง ring buffer ขนาดคงที่แบบ lock-free (fetch_add ตำแหน่ง แล้วเขียนช่องนั้น เต็มแล้ววนทับของเก่า)
+// export เป็น Chrome / Perfetto trace-event JSON เมื่อสั่ง (kill -USR2 <pid>) และตอนปิด server
+// (ไฟล์: --trace-file ค่าเริ่มต้น trace.json เปิดด้วย chrome://tracing หรือ ui.perfetto.dev)
+enum TraceStage {
+    TS_RECV, TS_ENQUEUE, TS_DEQUEUE, TS_LOCKED, TS_FIRST_SEND, TS_LAST_SEND, TS_DONE, TS_COUNT
+};
+const char* TRACE_STAGE_NAMES[TS_COUNT] = {
+    "receive", "enqueue", "dequeue", "lock acquired", "first delivery", "last delivery", "done"
+};
+// ชื่อช่วงเวลาที่ "จบ" ด้วยขั้นนั้น (เช่น enqueue -> dequeue = รอใน task_queue)
+const char* TRACE_SPAN_NAMES[TS_COUNT] = {
+    "", "dispatch", "queue wait", "lock wait", "process", "fan-out", "finish"
+};
 
-        { //! ล็อค 2 ชั้น (ตามกฎ 1 -> 2)
-            lock_guard<mutex> lock1(clients_mutex); // ล็อค 1
-            lock_guard<mutex> lock2(rooms_mutex);   // ล็อค 2
+// ทุก field เป็น atomic: exporter อ่านพร้อมกับ writer ได้ (seq ไม่ตรง = ช่องกำลังถูกเขียน ข้าม)
+struct TraceEvent {
+    std::atomic<uint64_t> seq{0};   // ลำดับของ event + 1 (เขียนเป็นอย่างสุดท้าย)
+    std::atomic<uint64_t> meta{0};  // trace(32) | stage(8) | cmd(8) | tid(16)
+    std::atomic<uint64_t> ns{0};
+};
 
-            if (clients.count(username) == 0) {
-                send_reply(reply_q, "SYSTEM|Error: User not registered.");
-                return;
-            }
-            if (rooms.count(room_name)) {
-                send_reply(reply_q, "SYSTEM|Error: Room already exists: " + room_name);
-                return;
-            }
-            if (!clients[username].current_room.empty()) {
-                send_reply(reply_q, "SYSTEM|Error: You must be in the Lobby to create a room.");
-                return;
+const int TRACE_MAX_THREADS = 256;
+uint32_t g_trace_sample = 0;                  // 0 = ปิด
+string g_trace_file = "trace.json";
+std::unique_ptr<TraceEvent[]> g_trace_buf;
+size_t g_trace_cap = 0;
+std::atomic<uint64_t> g_trace_next(0);        // ตำแหน่งถัดไปใน ring
+std::atomic<uint32_t> g_trace_ids(0);
+uint64_t g_trace_counter = 0;                 // (main loop เท่านั้น) ใช้สุ่มทุก N ข้อความ
+std::atomic<const char*> g_trace_thread_names[TRACE_MAX_THREADS];
+std::atomic<int> g_trace_threads(0);
+volatile sig_atomic_t g_trace_dump_requested = 0;
+
+thread_local int t_trace_tid = -1;
+thread_local uint32_t t_trace = 0;            // trace ของงานที่ worker นี้กำลังทำ
+thread_local bool t_trace_sent = false;
+thread_local uint64_t t_trace_last_send = 0;
+
+void trace_mark(uint32_t trace, TraceStage stage, uint64_t ns = 0, StatCmd cmd = SC_NONE) {
+    if (trace == 0 || !g_trace_buf) return;
+    if (t_trace_tid < 0) {
+        t_trace_tid = g_trace_threads.fetch_add(1);
+        if (t_trace_tid < TRACE_MAX_THREADS) g_trace_thread_names[t_trace_tid] = t_thread_name;
+    }
+    uint64_t idx = g_trace_next.fetch_add(1, std::memory_order_relaxed);
+    TraceEvent& e = g_trace_buf[idx % g_trace_cap];
+    e.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    e.meta.store(((uint64_t)trace << 32) | ((uint64_t)stage << 24) | ((uint64_t)cmd << 16) |
+                 (uint64_t)(std::min(t_trace_tid, 0xffff)), std::memory_order_relaxed);
+    e.ns.store(ns ? ns : mono_ns(), std::memory_order_relaxed);
+    e.seq.store(idx + 1, std::memory_order_release);
+}
+
+// เรียกหลังส่งข้อความให้ client ทุกครั้ง (ครั้งแรก = first delivery, ครั้งสุดท้ายบันทึกตอน done)
+inline void trace_sent() {
+    if (t_trace == 0) return;
+    if (!t_trace_sent) {
+        t_trace_sent = true;
+        trace_mark(t_trace, TS_FIRST_SEND);
+    }
+    t_trace_last_send = mono_ns();
+}
+
+// เริ่ม / จบงานหนึ่งชิ้นของ worker
+inline void trace_begin(const MsgRef& task) {
+    t_trace = task.trace;
+    trace_mark(t_trace, TS_DEQUEUE);
+}
+inline void trace_end(std::string_view msg) {
+    if (t_trace == 0) return;
+    if (t_trace_last_send != 0) trace_mark(t_trace, TS_LAST_SEND, t_trace_last_send);
+    trace_mark(t_trace, TS_DONE, 0, stat_cmd_of(msg.substr(0, msg.find('|'))));
+    t_trace = 0;
+    t_trace_sent = false;
+    t_trace_last_send = 0;
+}
+
+// --- เขียน trace-event JSON (เรียกจาก monitor หรือตอนปิด server) ---
+void trace_export() {
+    if (!g_trace_buf) return;
+    struct Ev {
+        uint32_t trace, stage, cmd, tid;
+        uint64_t ns;
+    };
+    vector<Ev> evs;
+    uint64_t end = g_trace_next.load();
+    uint64_t begin = (end > g_trace_cap) ? end - g_trace_cap : 0;
+    evs.reserve((size_t)(end - begin));
+    for (uint64_t i = begin; i < end; ++i) {
+        TraceEvent& e = g_trace_buf[i % g_trace_cap];
+        if (e.seq.load(std::memory_order_acquire) != i + 1) continue;
+        uint64_t meta = e.meta.load(std::memory_order_relaxed);
+        uint64_t ns = e.ns.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (e.seq.load(std::memory_order_relaxed) != i + 1) continue; // ถูกเขียนทับระหว่างอ่าน
+        evs.push_back(Ev{(uint32_t)(meta >> 32), (uint32_t)(meta >> 24) & 0xff,
+                         (uint32_t)(meta >> 16) & 0xff, (uint32_t)meta & 0xffff, ns});
+    }
+    std::sort(evs.begin(), evs.end(), [](const Ev& a, const Ev& b) {
+        return a.trace != b.trace ? a.trace < b.trace : (a.ns != b.ns ? a.ns < b.ns : a.stage < b.stage);
+    });
+
+    FILE* f = fopen(g_trace_file.c_str(), "w");
+    if (!f) {
+        perror("[TRACE] fopen");
+        return;
+    }
+    uint64_t base = evs.empty() ? 0 : evs[0].ns;
+    for (const Ev& e : evs) base = std::min(base, e.ns);
+    auto us = [&](uint64_t ns) { return (double)(ns - base) / 1000.0; };
+
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    auto sep = [&]() { fputs(first ? "" : ",\n", f); first = false; };
+    int threads = std::min(g_trace_threads.load(), TRACE_MAX_THREADS);
+    for (int t = 0; t < threads; ++t) {
+        const char* name = g_trace_thread_names[t].load();
+        sep();
+        fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s#%d\"}}",
+                t, name ? name : "thread", t);
+    }
+
+    size_t messages = 0;
+    for (size_t i = 0; i < evs.size();) {
+        size_t j = i;
+        while (j < evs.size() && evs[j].trace == evs[i].trace) ++j;
+        // ข้อความหนึ่ง = async track ของตัวเอง (id = trace ID) ช่วงย่อยแต่ละขั้นซ้อนอยู่ข้างใน
+        const char* cmd = "message";
+        for (size_t k = i; k < j; ++k) {
+            if (evs[k].stage == TS_DONE && evs[k].cmd < SC_COUNT) cmd = STAT_CMD_NAMES[evs[k].cmd];
+        }
+        uint32_t id = evs[i].trace;
+        sep();
+        fprintf(f, "{\"name\":\"%s #%u\",\"cat\":\"msg\",\"ph\":\"b\",\"id\":%u,\"pid\":1,\"tid\":%u,\"ts\":%.3f}",
+                cmd, id, id, evs[i].tid, us(evs[i].ns));
+        for (size_t k = i; k < j; ++k) {
+            const Ev& e = evs[k];
+            sep();
+            fprintf(f, "{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,"
+                       "\"ts\":%.3f,\"args\":{\"trace\":%u}}",
+                    TRACE_STAGE_NAMES[std::min<uint32_t>(e.stage, TS_COUNT - 1)], e.tid, us(e.ns), id);
+            if (k > i && e.stage < TS_COUNT && e.stage != TS_RECV) {
+                sep();
+                fprintf(f, "{\"name\":\"%s\",\"cat\":\"msg\",\"ph\":\"b\",\"id\":%u,\"pid\":1,\"tid\":%u,\"ts\":%.3f}",
+                        TRACE_SPAN_NAMES[e.stage], id, e.tid, us(evs[k - 1].ns));
+                sep();
+                fprintf(f, "{\"name\":\"%s\",\"cat\":\"msg\",\"ph\":\"e\",\"id\":%u,\"pid\":1,\"tid\":%u,\"ts\":%.3f}",
+                        TRACE_SPAN_NAMES[e.stage], id, e.tid, us(e.ns));
+            }
+        }
+        sep();
+        fprintf(f, "{\"name\":\"%s #%u\",\"cat\":\"msg\",\"ph\":\"e\",\"id\":%u,\"pid\":1,\"tid\":%u,\"ts\":%.3f}",
+                cmd, id, id, evs[j - 1].tid, us(evs[j - 1].ns));
+        messages++;
+        i = j;
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    cout << "[TRACE] Wrote " << evs.size() << " events (" << messages << " messages) to " << g_trace_file << endl;
+}
+
+void handle_sigusr2(int) { g_trace_dump_requested = 1; }
+
+// --- Credit-based Flow Control ---
+// Client ส่งคำสั่ง (ยกเว้น REGISTER/PING/EXIT) ได้ไม่เกินจำนวน credit ที่ถืออยู่
+// Server คืน credit เป็นชุดด้วยข้อความ "CREDIT|n" หลังประมวลผลเสร็จ
+// และ "กั๊ก" ไว้ก่อนถ้างานค้างใน task_queue เยอะ -> client ที่ยิงรัวจะถูกชะลอเอง
+// ไม่ไปแย่งช่องใน /chat_control (มีแค่ 10 ช่อง) จนคนอื่นส่งไม่ได้
+const int CREDIT_WINDOW = 8;                  // credit เริ่มต้นต่อ session
+const int CREDIT_BATCH = CREDIT_WINDOW / 2;   // คืนทีละชุด (ลดจำนวนข้อความ CREDIT)
+const size_t CREDIT_BACKLOG_LIMIT = 64;       // งานค้างเกินนี้ = หยุดคืน credit ชั่วคราว
+std::atomic<bool> g_credit_pending(false);    // มี session ที่ถูกกั๊ก credit อยู่หรือไม่
+std::atomic<long long> g_last_credit_flush(0);
+
+// --- Runtime Options: ./server <NumThreads> [--key=value ...] ---
+map<string, string> g_options;
+
+int opt_int(const string& key, int def) {
+    auto it = g_options.find(key);
+    if (it == g_options.end()) return def;
+    try {
+        return std::stoi(it->second);
+    } catch (const std::exception&) {
+        cerr << "[ERROR] Invalid value for --" << key << ". Using " << def << "." << endl;
+        return def;
+    }
+}
+
+// --- Adaptive Heartbeat ---
+// Server แจ้ง interval ให้ client ผ่าน "CREDIT|n|<hb>" (client จะ PING ก็ต่อเมื่อเงียบนานเท่านี้)
+// ถ้า /chat_control หรือ task_queue แน่น interval จะยืดออก (x2) จนถึง hb-max เพื่อลด PING
+// และหดกลับทีละครึ่งเมื่อโหลดลดลง
+const int HB_TIMEOUT_FACTOR = 3;          // timeout = 3 เท่าของ interval (เดิม PING 5s, timeout 15s)
+int g_hb_base = 5;                        // --hb-interval
+int g_hb_max = 60;                        // --hb-max
+std::atomic<int> g_hb_interval(5);        // interval ปัจจุบันที่ประกาศให้ client
+std::atomic<int> g_hb_timeout_basis(5);   // interval ที่ใช้คิด timeout (หดช้ากว่า เผื่อ client ที่ยังใช้ค่าเก่า)
+
+// --- Per-message Arena ---
+// ทุก string / vector ชั่วคราวระหว่างประมวลผลคำสั่ง (ข้อความตอบกลับ, รายชื่อคิวที่จะ broadcast ฯลฯ)
+// จองจาก arena ของ thread (monotonic: แค่เลื่อน pointer) แล้วล้างทิ้งทั้งก้อนเมื่อจบข้อความ
+// -> ไม่มีการเรียก new/delete ของระบบในการประมวลผลปกติ
+// ‼️ ห้ามใช้ operator+ กับ AString (ผลลัพธ์จะกลับไปใช้ heap ปกติ) ให้ใช้ concat() แทน
+using AString = std::pmr::string;
+template <typename T>
+using AVector = std::pmr::vector<T>;
+
+const size_t ARENA_BYTES = 64 * 1024;   // เกินนี้จะขอเพิ่มจาก heap (เช่น LIST ที่ยาวมาก)
+thread_local std::pmr::memory_resource* t_arena = std::pmr::get_default_resource();
+
+// arena ที่ใช้อยู่ของ thread นี้ (นอก ArenaScope = heap ปกติ)
+std::pmr::memory_resource* arena() { return t_arena; }
+
+// ใช้ arena ภายใน scope นี้ แล้วล้างทิ้งทั้งหมดเมื่อออกจาก scope (ซ้อนกันได้ ล้างเฉพาะชั้นนอกสุด)
+struct ArenaScope {
+    std::pmr::memory_resource* prev;
+
+    ArenaScope() : prev(t_arena) { t_arena = &thread_arena(); }
+    ~ArenaScope() {
+        if (prev != &thread_arena()) thread_arena().release();
+        t_arena = prev;
+    }
+
+    static std::pmr::monotonic_buffer_resource& thread_arena() {
+        thread_local std::unique_ptr<char[]> buffer(new char[ARENA_BYTES]);
+        thread_local std::pmr::monotonic_buffer_resource res(buffer.get(), ARENA_BYTES,
+                                                             std::pmr::new_delete_resource());
+        return res;
+    }
+};
+
+// ต่อ string หลายชิ้นเป็น AString ก้อนเดียว (จองครั้งเดียวจาก arena)
+AString concat(std::initializer_list<std::string_view> parts) {
+    size_t n = 0;
+    for (std::string_view p : parts) n += p.size();
+    AString out(arena());
+    out.reserve(n);
+    for (std::string_view p : parts) out.append(p);
+    return out;
+}
+
+// ตัวเลข -> ข้อความ โดยไม่จองหน่วยความจำ (ใช้คู่กับ concat())
+struct NumText {
+    char buf[24];
+    size_t len;
+    operator std::string_view() const { return std::string_view(buf, len); }
+};
+
+NumText num(unsigned long long value) {
+    NumText t;
+    t.len = (size_t)(std::to_chars(t.buf, t.buf + sizeof(t.buf), value).ptr - t.buf);
+    return t;
+}
+
+// --- Multiplexed Sessions ---
+// หลาย session (เช่น bot / load_tester ที่จำลองหลาย user) ใช้คิวตอบกลับร่วมกันได้ โดยลงทะเบียนด้วย
+// "REGISTER|<queue>#<tag>|<name>": ทุกข้อความถึง session นั้นมี header "@<tag>|" นำหน้า
+// และ fan-out ถึงหลาย session ในคิวเดียวกันถูกรวมเป็นข้อความเดียว "@<tag>,<tag>,...|..." (ดู MuxGroup)
+// ‼️ คิวร่วมเป็นของ process ที่สร้าง: server ไม่ mq_unlink ตอน session ใด session หนึ่งออก
+std::atomic<uint64_t> g_mux_saved(0);   // จำนวน mq_send ที่ไม่ต้องส่ง เพราะรวมผู้รับไว้ในข้อความเดียว
+
+inline bool is_mux_queue(std::string_view q) { return q.find('#') != std::string_view::npos; }
+
+// tag ต้องเป็น [A-Za-z0-9_.-] ไม่เกิน MAX_MUX_TAG ตัว: '#' ',' '|' หรือขึ้นบรรทัดใหม่จะทำให้ header "@a,b|" แยกผิด
+const size_t MAX_MUX_TAG = 32;
+bool valid_mux_queue(std::string_view q) {
+    size_t hash = q.find('#');
+    if (hash == std::string_view::npos) return true;
+    std::string_view tag = q.substr(hash + 1);
+    if (hash == 0 || tag.empty() || tag.size() > MAX_MUX_TAG) return false;
+    for (char c : tag) {
+        if (!isalnum((unsigned char)c) && c != '_' && c != '.' && c != '-') return false;
+    }
+    return true;
+}
+
+// --- Helper Function: ส่งข้อความตอบกลับ ---
+// คืนค่า true ถ้าส่งสำเร็จ (prio สูงกว่า = client ได้รับก่อน)
+bool send_reply(const char* reply_q, std::string_view text, unsigned prio = 0) {
+    if (reply_q == nullptr || reply_q[0] == '\0') return false;
+
+    // session แบบ multiplex: แยก "<queue>#<tag>" แล้วใส่ "@<tag>|" นำหน้าข้อความ
+    char name[256];
+    size_t head = 0;
+    char frame[MQ_MSGSIZE];
+    if (const char* hash = strchr(reply_q, '#')) {
+        size_t qlen = (size_t)(hash - reply_q);
+        size_t tlen = strlen(hash + 1);
+        if (qlen >= sizeof(name) || tlen + 2 >= (size_t)MQ_MSGSIZE) return false;
+        memcpy(name, reply_q, qlen);
+        name[qlen] = '\0';
+        reply_q = name;
+        frame[0] = '@';
+        memcpy(frame + 1, hash + 1, tlen);
+        frame[tlen + 1] = '|';
+        head = tlen + 2;
+    }
+    if (head + text.size() >= (size_t)MQ_MSGSIZE) return false; // ใหญ่เกินคิวของ client
+
+    // ประกอบ frame บน stack (ต่อท้ายด้วย '\0' เพราะ client อ่านเป็น C string)
+    memcpy(frame + head, text.data(), text.size());
+    frame[head + text.size()] = '\0';
+
+    bool ok = false;
+    // O_NONBLOCK: ถ้าคิว client เต็ม (อาจจะค้าง) ให้ fail ทันที
+    mqd_t client_q = sys_mq_open(reply_q, O_WRONLY | O_NONBLOCK);
+    if (client_q != (mqd_t)-1) {
+        ok = (sys_mq_send(client_q, frame, head + text.size() + 1, prio) == 0);
+        sys_mq_close(client_q);
+    }
+    trace_sent();
+    return ok;
+}
+
+// (รับได้ทั้ง string และ AString)
+template <typename Str>
+bool send_reply(const Str& reply_q, std::string_view text, unsigned prio = 0) {
+    return send_reply(reply_q.c_str(), text, prio);
+}
+
+// --- ส่ง credit ให้ client (priority 1 เพื่อแซงข้อความ CHAT ในคิวของ client) ---
+// (แนบ heartbeat interval ปัจจุบันไปด้วย: "CREDIT|n|hb")
+template <typename Str>
+bool send_credit(const Str& reply_q, int n) {
+    char text[48];
+    int len = snprintf(text, sizeof(text), "CREDIT|%d|%d", n, g_hb_interval.load());
+    return send_reply(reply_q, std::string_view(text, (size_t)len), 1);
+}
+
+// --- คืน credit 1 หน่วยหลังประมวลผลคำสั่งของ user เสร็จ ---
+// (generation = session ที่ส่งคำสั่ง: slot ถูกนำกลับมาใช้แล้ว = ไม่ต้องคืน)
+inline bool same_session(UserId uid, uint32_t generation) {
+    return uid < clients.size() && clients[uid].active && clients[uid].generation == generation;
+}
+
+void return_credit(UserId uid, uint32_t generation) {
+    AString q(arena());
+    int grant = 0;
+    {
+        lock_guard<mutex> lock(clients_mutex);
+        if (!same_session(uid, generation)) return;
+        ClientInfo& info = clients[uid];
+        info.credits_owed++;
+        if (info.credits_owed < CREDIT_BATCH) return;
+        if (g_backlog >= CREDIT_BACKLOG_LIMIT || info.credit_hold_until > mono_ns()) {
+            // งานค้างเยอะ / ยังติดหนี้ rate limit: ยังไม่คืน รอ flush_credits()
+            g_credit_pending = true;
+            return;
+        }
+        grant = info.credits_owed;
+        info.credits_owed = 0;
+        q = info.reply_queue;
+    }
+
+    if (!send_credit(q, grant)) {
+        // คิวของ client เต็ม: เก็บไว้คืนรอบหน้า (ห้ามทิ้ง ไม่งั้น client จะค้างรอ credit ตลอดไป)
+        lock_guard<mutex> lock(clients_mutex);
+        if (same_session(uid, generation)) clients[uid].credits_owed += grant;
+        g_credit_pending = true;
+    }
+}
+
+// --- คืน credit ที่ถูกกั๊กไว้ทั้งหมด (เรียกเมื่องานค้างลดลงต่ำกว่า CREDIT_BACKLOG_LIMIT) ---
+void flush_credits() {
+    // จำกัดไม่ให้ scan บ่อยเกิน 10 ครั้ง/วินาที
+    long long now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    long long last = g_last_credit_flush;
+    if (now_ms - last < 100 || !g_last_credit_flush.compare_exchange_strong(last, now_ms)) return;
+
+    g_credit_pending = false;
+    struct Grant {
+        UserId uid;
+        uint32_t generation;
+        int n;
+    };
+    AVector<Grant> grants(arena());
+    AVector<AString> queues(arena());
+    uint64_t now_ns = mono_ns();
+    {
+        lock_guard<mutex> lock(clients_mutex);
+        for (UserId id = 0; id < clients.size(); ++id) {
+            ClientInfo& info = clients[id];
+            if (info.active && info.credits_owed >= CREDIT_BATCH) {
+                if (info.credit_hold_until > now_ns) {
+                    g_credit_pending = true; // (ยังติดหนี้ rate limit ไว้รอบหน้า)
+                    continue;
+                }
+                grants.push_back({id, info.generation, info.credits_owed});
+                queues.emplace_back(info.reply_queue);
+                info.credits_owed = 0;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < grants.size(); ++i) {
+        const Grant& g = grants[i];
+        if (!send_credit(queues[i], g.n)) {
+            lock_guard<mutex> lock(clients_mutex);
+            if (same_session(g.uid, g.generation)) clients[g.uid].credits_owed += g.n;
+            g_credit_pending = true;
+        }
+    }
+}
+
+// --- Rate Limiting (--user-rate / --room-rate, --rate-mode=reject|delay) ---
+// ตรวจใน CHAT / DM ก่อน fan-out (ภายใต้ lock ที่คำสั่งถืออยู่แล้ว ไม่มี lock เพิ่ม)
+// reject: เกิน = ทิ้งข้อความแล้วตอบ SYSTEM error
+// delay: ส่งข้อความไปก่อน แต่ bucket ติดหนี้ และ credit ของผู้ส่งถูกกั๊กจนหนี้หมด
+//        -> client ส่งต่อไม่ได้จนกว่าจะถึงเวลา (ชะลอผู้ส่งโดยไม่ทิ้งข้อความและไม่ขวาง worker)
+//        (credit ที่กั๊กถูกคืนโดย flush_credits() ซึ่งรันทุก 100ms-1s ความละเอียดของการหน่วงจึงอยู่ระดับนั้น)
+RateLimit g_user_limit;
+RateLimit g_room_limit;
+bool g_rate_delay = false;
+enum RateScope { RS_USER, RS_ROOM, RS_COUNT };
+const char* RATE_SCOPE_NAMES[RS_COUNT] = {"user", "room"};
+std::atomic<uint64_t> g_rate_rejected[RS_COUNT];
+std::atomic<uint64_t> g_rate_delayed[RS_COUNT];
+
+const RateLimit& rate_limit(RateScope scope) { return scope == RS_USER ? g_user_limit : g_room_limit; }
+
+// เติม bucket แล้วตรวจ: false = เต็ม (โหมด reject) ยังไม่ใช้ token
+bool rate_ok(TokenBucket& bucket, RateScope scope, uint64_t now) {
+    const RateLimit& lim = rate_limit(scope);
+    if (lim.rate <= 0) return true;
+    bucket.refill(lim, now);
+    if (g_rate_delay || bucket.tokens >= 1) return true;
+    g_rate_rejected[scope]++;
+    return false;
+}
+
+// ใช้ token หนึ่งหน่วย wait = หนี้ที่ยาวที่สุด (ns) ที่ผู้ส่งต้องรอก่อนได้ credit คืน
+void rate_use(TokenBucket& bucket, RateScope scope, uint64_t& wait) {
+    const RateLimit& lim = rate_limit(scope);
+    if (lim.rate <= 0) return;
+    bucket.tokens -= 1;
+    if (bucket.tokens < 0) {
+        g_rate_delayed[scope]++;
+        wait = std::max(wait, bucket.debt_ns(lim));
+    }
+}
+
+// คืนค่า nullptr = ผ่าน, ไม่งั้นคืนชื่อ bucket ที่เต็ม (โหมด reject)
+// ต้องถือ clients_mutex (และ rooms_mutex ถ้า room != nullptr)
+const char* rate_check(ClientInfo& client, Room* room) {
+    if (g_user_limit.rate <= 0 && (room == nullptr || g_room_limit.rate <= 0)) return nullptr;
+
+    uint64_t now = mono_ns();
+    if (!rate_ok(client.bucket, RS_USER, now)) return RATE_SCOPE_NAMES[RS_USER];
+    if (room && !rate_ok(room->bucket, RS_ROOM, now)) return RATE_SCOPE_NAMES[RS_ROOM];
+
+    // ผ่าน (หรือโหมด delay): ใช้ token แล้วกั๊ก credit ตามหนี้ที่ยาวที่สุด
+    uint64_t wait = 0;
+    rate_use(client.bucket, RS_USER, wait);
+    if (room) rate_use(room->bucket, RS_ROOM, wait);
+    if (wait > 0) client.credit_hold_until = std::max(client.credit_hold_until, now + wait);
+    return nullptr;
+}
+
+// --- Helper Function: ดึงเวลาปัจจุบัน ("HH:MM:SS" เขียนลง buf ขนาด 9) ---
+std::string_view currentTime(char (&buf)[9]) {
+    time_t now = time(nullptr);
+    struct tm local;
+    localtime_r(&now, &local);
+    strftime(buf, sizeof(buf), "%H:%M:%S", &local);
+    return std::string_view(buf, 8);
+}
+
+// --- ‼️ FIX 1: แก้ไข broadcast_to_room (ป้องกัน Deadlock) ---
+// sender = NO_ID สำหรับข้อความ SYSTEM (ส่งให้ทุกคนในห้อง)
+// ส่งข้อความเดียวถึงทุก session ในคิวร่วม: "@t1,t2,...|<text>" (ไม่รวม sender)
+// header ยาวจนข้อความไม่พอดีหนึ่ง frame จะแบ่งผู้รับเป็นหลายข้อความ
+void send_mux(const MuxGroup& g, UserId sender, std::string_view text) {
+    const size_t budget = (MQ_MSGSIZE - 1 > text.size() + 2) ? MQ_MSGSIZE - 1 - text.size() - 2 : 0;
+    AString tags(arena());
+    size_t count = 0;
+    auto flush = [&]() {
+        if (count == 0) return;
+        send_reply(g.queue, concat({"@", tags, "|", text}));
+        g_mux_saved += count - 1;
+        tags.clear();
+        count = 0;
+    };
+    for (size_t i = 0; i < g.ids.size(); ++i) {
+        if (g.ids[i] == sender) continue;
+        if (count > 0 && tags.size() + 1 + g.tags[i].size() > budget) flush();
+        if (count > 0) tags.push_back(',');
+        tags.append(g.tags[i]);
+        count++;
+    }
+    flush();
+}
+
+// "CHAT|[HH:MM:SS] <ผู้ส่ง>: <ข้อความ>"
+AString chat_frame(std::string_view sender_name, std::string_view message) {
+    char time_buf[9];
+    return concat({"CHAT|[", currentTime(time_buf), "] ", sender_name, ": ", message});
+}
+
+// ส่ง frame ถึงสมาชิก n คนแรกที่ไม่ได้ใช้คิวร่วม และทุกคิวร่วมของห้อง (ไม่รวม sender)
+void send_to_snapshot(const MemberSnapshot& snap, size_t n, UserId sender, std::string_view frame) {
+    for (size_t i = 0; i < n; ++i) {
+        if (snap.ids[i] != sender && !snap.grouped[i]) {
+            send_reply(snap.queues[i], frame);
+        }
+    }
+    for (const MuxGroup& g : snap.mux) send_mux(g, sender, frame);
+}
+
+void broadcast_to_room(RoomId room, UserId sender, std::string_view sender_name, std::string_view message) {
+    if (room == NO_ID) return; // ถ้าอยู่ใน Lobby ไม่ต้องทำ
+
+    // อ่าน snapshot ของสมาชิก (ไม่ล็อค: JOIN / LEAVE ระหว่างนี้ไม่ทำให้ต้องรอ)
+    SnapshotPtr snap = g_room_members.load(room);
+    if (!snap) return; // ห้องถูกลบไปแล้ว
+
+    AString full_message = chat_frame(sender_name, message);
+
+    size_t n = snap->ids.size();
+    if (g_steal_mode && t_worker >= 0 && n > g_fanout_chunk) {
+        // ห้องใหญ่ + work stealing: ชิ้นแรกส่งเอง ที่เหลือใส่หัว deque ให้ worker ที่ว่างขโมยไปช่วย
+        auto job = std::make_shared<FanoutJob>(FanoutJob{snap, string(full_message), sender});
+        size_t last = ((n - 1) / g_fanout_chunk) * g_fanout_chunk;
+        for (size_t b = last; b >= g_fanout_chunk; b -= g_fanout_chunk) { // (ใส่กลับด้าน หัว deque จะเรียงตามลำดับ)
+            Task chunk;
+            chunk.fanout = job;
+            chunk.begin = (uint32_t)b;
+            chunk.end = (uint32_t)std::min(n, b + g_fanout_chunk);
+            steal_push(t_worker, std::move(chunk), true);
+        }
+        n = g_fanout_chunk;
+    }
+    send_to_snapshot(*snap, n, sender, full_message);
+}
+
+// ส่งชิ้นหนึ่งของ fan-out (จาก work-stealing deque) (สมาชิกแบบ mux ส่งไปแล้วใน broadcast_to_room)
+void run_fanout_chunk(const FanoutJob& job, size_t begin, size_t end) {
+    for (size_t i = begin; i < end && i < job.snap->ids.size(); ++i) {
+        if (job.snap->ids[i] != job.sender && !job.snap->grouped[i]) {
+            send_reply(job.snap->queues[i], job.message);
+        }
+    }
+}
+// --- ‼️ END FIX 1 ---
+
+// --- ต่อสมาชิกหนึ่งคนท้าย snapshot (คิวแบบ "<queue>#<tag>" เข้ากลุ่ม mux ของคิวนั้น) ---
+void add_member(MemberSnapshot& snap, UserId id, const string& name, const string& q) {
+    snap.ids.push_back(id);
+    snap.queues.push_back(q);
+    snap.names.push_back(name);
+    size_t hash = q.find('#');
+    snap.grouped.push_back(hash != string::npos);
+    if (hash == string::npos) return;
+    MuxGroup* g = nullptr;
+    for (MuxGroup& existing : snap.mux) { // (จำนวนคิวร่วมต่อห้องมีน้อย)
+        if (existing.queue.compare(0, string::npos, q, 0, hash) == 0) g = &existing;
+    }
+    if (!g) {
+        snap.mux.emplace_back();
+        g = &snap.mux.back();
+        g->queue = q.substr(0, hash);
+    }
+    g->ids.push_back(id);
+    g->tags.push_back(q.substr(hash + 1));
+}
+
+// --- สร้าง snapshot ใหม่ของสมาชิกห้องแล้ว publish (ต้องถือ clients_mutex และ rooms_mutex อยู่แล้ว) ---
+void publish_members_locked(RoomId room) {
+    const Room& r = rooms[room];
+    auto snap = std::make_shared<MemberSnapshot>();
+    snap->version = r.version;
+    snap->room_name = room_names.name(room);
+    snap->ids.reserve(r.members.size());
+    snap->queues.reserve(r.members.size());
+    snap->names.reserve(r.members.size());
+    snap->grouped.reserve(r.members.size());
+    for (UserId m : r.members) add_member(*snap, m, user_names.name(m), clients[m].reply_queue);
+    g_room_members.store(room, std::move(snap));
+}
+
+// --- เพิ่ม / ลบ สมาชิกของห้อง (ต้องถือ clients_mutex และ rooms_mutex อยู่แล้ว) ---
+void join_room_locked(UserId uid, RoomId room) {
+    vector<UserId>& members = rooms[room].members;
+    clients[uid].current_room = room;
+    publish_route_locked(uid);
+    clients[uid].member_pos = (uint32_t)members.size();
+    members.push_back(uid);
+    rooms[room].version++;
+    g_rooms_version++;
+    publish_members_locked(room);
+    dir_op({"u\t", user_names.name(uid), "\t", room_names.name(room)});
+}
+
+// คืนค่าห้องเดิม (NO_ID ถ้าอยู่ใน Lobby อยู่แล้ว)
+// publish = false: ผู้เรียก publish snapshot เองทีหลัง (ลบหลายคนจากห้องเดียวกันใน batch)
+RoomId leave_room_locked(UserId uid, bool publish = true) {
+    RoomId room = clients[uid].current_room;
+    if (room == NO_ID) return NO_ID;
+
+    // swap-remove: เอาสมาชิกตัวสุดท้ายมาแทนที่ตำแหน่งของเรา
+    vector<UserId>& members = rooms[room].members;
+    uint32_t pos = clients[uid].member_pos;
+    UserId last = members.back();
+    members[pos] = last;
+    clients[last].member_pos = pos;
+    members.pop_back();
+    rooms[room].version++;
+    g_rooms_version++;
+    if (publish) publish_members_locked(room);
+
+    clients[uid].current_room = NO_ID;
+    publish_route_locked(uid);
+    dir_op({"u\t", user_names.name(uid), "\t"});
+    return room;
+}
+
+// --- Directory Paging: แบ่งรายการเป็นหน้า "<KIND>|<next>|<payload>" ---
+// แต่ละหน้าพอดีหนึ่งข้อความของคิว client (MQ_MSGSIZE รวม '\0') และไม่ตัดกลางรายการ
+// ทุกรายการมี key (ID ของห้อง / user) เรียงจากน้อยไปมาก next = key ของรายการถัดไป (ว่าง = หน้าสุดท้าย)
+// client ขอหน้าถัดไปด้วย "<KIND>|<token>|<next>" server ตอบรายการที่ key >= next จาก render ปัจจุบัน
+// -> registry เปลี่ยนระหว่างไล่หน้า รายการที่อยู่ตลอดไม่ซ้ำและไม่หาย (ต่างจาก cursor แบบเลขหน้า)
+struct PageBuilder {
+    Rendered& out;
+
+    PageBuilder(Rendered& r, string kind, string title, string header = "") : out(r) {
+        out.kind = std::move(kind);
+        out.title = std::move(title);
+        out.header = std::move(header);
+        out.limit = MQ_MSGSIZE - 1 - out.kind.size() - 2 - 10 - out.header.size(); // (เผื่อ cursor 10 หลัก)
+    }
+
+    void add(uint64_t key, std::string_view item) {
+        out.items.emplace_back(key, string(item.substr(0, out.limit - std::min(out.limit, out.title.size())))); // (ชื่อยาวเกินหนึ่งหน้าถูกตัด)
+    }
+
+    void finish();
+};
+
+// ประกอบหน้าที่เริ่มที่ items[idx] ลงใน frame (หน้าแรกมี title นำหน้า) คืน index ถัดจากรายการสุดท้ายในหน้า
+template <typename Str>
+size_t render_page(const Rendered& r, size_t idx, bool first, Str& frame) {
+    size_t used = first ? r.title.size() : 0;
+    size_t end = idx;
+    while (end < r.items.size() && (end == idx || used + r.items[end].second.size() <= r.limit)) {
+        used += r.items[end].second.size();
+        end++;
+    }
+    char next[24] = "";
+    if (end < r.items.size()) *std::to_chars(next, next + sizeof(next) - 1, r.items[end].first).ptr = '\0';
+    frame.append(r.kind).append("|").append(next).append("|").append(r.header);
+    if (first) frame.append(r.title);
+    for (size_t i = idx; i < end; ++i) frame.append(r.items[i].second);
+    return end;
+}
+
+void PageBuilder::finish() {
+    std::sort(out.items.begin(), out.items.end(),
+              [](const auto& a, const auto& b) { return a.first < b.first; });
+    out.pages.clear();
+    out.page_start.clear();
+    size_t idx = 0;
+    do {
+        out.page_start.push_back(idx);
+        string frame;
+        idx = render_page(out, idx, out.pages.empty(), frame);
+        out.pages.push_back(std::move(frame));
+    } while (idx < out.items.size());
+}
+
+// หน้าที่ cursor ชี้ ("" = หน้าแรก): รายการแรกที่ key >= cursor ถ้าตรงกับต้นหน้าที่ render ไว้ใช้หน้านั้นเลย
+// ไม่ตรง (รายการเปลี่ยนระหว่างไล่หน้า) render หน้าใหม่ลง scratch ไม่มีรายการเหลือ = ส่งหน้าว่างปิดท้าย
+std::string_view page_at(const Rendered& r, std::string_view cursor, std::string_view end_frame, AString& scratch) {
+    if (cursor.empty()) return r.pages.front();
+    uint64_t key = 0;
+    auto res = std::from_chars(cursor.data(), cursor.data() + cursor.size(), key);
+    if (res.ec != std::errc()) return r.pages.front();
+
+    size_t idx = (size_t)(std::lower_bound(r.items.begin(), r.items.end(), key,
+                                           [](const auto& item, uint64_t k) { return item.first < k; }) - r.items.begin());
+    if (idx >= r.items.size()) return end_frame;
+    auto page = std::lower_bound(r.page_start.begin() + 1, r.page_start.end(), idx); // (หน้าแรกมี title: ไม่ใช้ซ้ำ)
+    if (page != r.page_start.end() && *page == idx) return r.pages[page - r.page_start.begin()];
+    render_page(r, idx, false, scratch);
+    return scratch;
+}
+
+// --- Directory Cache: ดึงข้อความที่ render ไว้ (render ใหม่เฉพาะเมื่อ version เปลี่ยน) ---
+// ‼️ ห้ามถือ lock ใดๆ ตอนเรียก (ฟังก์ชันล็อคเองตามลำดับ 1 -> 2)
+RenderedPtr cached_room_list() {
+    RenderedPtr cur = std::atomic_load(&g_list_cache);
+    if (cur && cur->version == g_rooms_version) return cur; // ไม่ต้องล็อค
+
+    auto fresh = std::make_shared<Rendered>();
+    PageBuilder pages(*fresh, "LIST", "Available Rooms: ");
+    { //! ล็อค (2)
+        lock_guard<mutex> lock(rooms_mutex);
+        fresh->version = g_rooms_version;
+        for (RoomId r = 0; r < rooms.size(); ++r) {
+            if (!rooms[r].active) continue;
+            pages.add(r, room_names.name(r) + "(" + to_string(rooms[r].members.size()) + ") ");
+        }
+    } //! ปลดล็อค
+    pages.finish();
+    cur = std::move(fresh);
+    std::atomic_store(&g_list_cache, cur);
+    return cur;
+}
+
+RenderedPtr cached_member_list() {
+    RenderedPtr cur = std::atomic_load(&g_members_cache);
+    if (cur && cur->version == g_users_version) return cur; // ไม่ต้องล็อค
+
+    auto fresh = std::make_shared<Rendered>();
+    PageBuilder pages(*fresh, "MEMBERS", "Online users: ");
+    { //! ล็อค (1)
+        lock_guard<mutex> lock(clients_mutex);
+        fresh->version = g_users_version;
+        for (UserId id = 0; id < clients.size(); ++id) {
+            if (clients[id].active) pages.add(id, user_names.name(id) + " ");
+        }
+    } //! ปลดล็อค
+    pages.finish();
+    cur = std::move(fresh);
+    std::atomic_store(&g_members_cache, cur);
+    return cur;
+}
+
+const uint64_t USER_KEY = 1ull << 32; // key ของ user ใน SYNC (ต่อจากห้องทั้งหมด: ห้องก่อน user เสมอ)
+
+// snapshot ของ directory สำหรับ SYNC: "SYNC|<next>|<seq>|<op>\n<op>\n..." (render ใหม่เมื่อ seq เปลี่ยน)
+RenderedPtr cached_directory() {
+    RenderedPtr cur = std::atomic_load(&g_dir_cache);
+    if (cur && cur->version == g_dir_seq.load()) return cur; // ไม่ต้องล็อค
+
+    auto fresh = std::make_shared<Rendered>();
+    vector<std::pair<uint64_t, string>> items;
+    { //! ล็อค (1) -> (2)
+        lock_guard<mutex> lock1(clients_mutex);
+        lock_guard<mutex> lock2(rooms_mutex);
+        fresh->version = g_dir_seq.load();
+        for (RoomId r = 0; r < rooms.size(); ++r) {
+            if (rooms[r].active) items.emplace_back(r, "r\t" + room_names.name(r) + "\n");
+        }
+        for (UserId id = 0; id < clients.size(); ++id) {
+            if (!clients[id].active) continue;
+            RoomId r = clients[id].current_room;
+            items.emplace_back(USER_KEY | id, "u\t" + user_names.name(id) + "\t" + (r == NO_ID ? "" : room_names.name(r)) + "\n");
+        }
+    } //! ปลดล็อค
+    PageBuilder pages(*fresh, "SYNC", "", to_string(fresh->version) + "|");
+    for (const auto& [key, item] : items) pages.add(key, item);
+    pages.finish();
+    cur = std::move(fresh);
+    std::atomic_store(&g_dir_cache, cur);
+    return cur;
+}
+
+// WHO ของห้อง: render จาก snapshot ของสมาชิกครั้งเดียวแล้วเก็บไว้ใน snapshot นั้น (ไม่ล็อค registry)
+// คืน nullptr ถ้าไม่มีห้องนี้
+RenderedPtr render_who(const MemberSnapshot& snap) {
+    RenderedPtr cur = std::atomic_load(&snap.who);
+    if (cur) return cur;
+
+    auto fresh = std::make_shared<Rendered>();
+    fresh->version = snap.version;
+    fresh->subject = snap.room_name;
+    PageBuilder pages(*fresh, "WHO", "Users in " + snap.room_name + ": ");
+    for (size_t i = 0; i < snap.ids.size(); ++i) {
+        pages.add(snap.ids[i], snap.names[i] + " ");
+    }
+    pages.finish();
+    cur = std::move(fresh);
+    std::atomic_store(&snap.who, cur);
+    return cur;
+}
+
+RenderedPtr cached_who(RoomId room) {
+    SnapshotPtr snap = g_room_members.load(room);
+    return snap ? render_who(*snap) : nullptr;
+}
+
+// --- Signal Handler (สำหรับ Thread Pool) ---
+// ‼️ ทำได้แค่ตั้งธง + ส่ง STOP แบบ non-blocking (async-signal-safe) ห้าม cout / notify / ล็อคตรงนี้:
+// สัญญาณอาจมาตอนที่ thread นี้ถือ lock อยู่ และถ้า /chat_control เต็ม mq_send แบบ blocking จะค้างตลอดไป
+// (คิวเต็ม = main loop ไม่ได้รออยู่ใน mq_receive: รอบถัดไปเห็นธงเอง) main loop ปลุก worker / log ตอนออกจาก loop
+volatile sig_atomic_t g_stop_signal = 0; // สัญญาณที่ทำให้หยุด (0 = ยังไม่มี)
+mqd_t g_stop_mq = (mqd_t)-1;             // /chat_control แบบ O_NONBLOCK เปิดไว้ตั้งแต่เริ่ม (ใช้ใน handler)
+
+void handle_sigint(int sig) {
+    int saved_errno = errno;
+    g_stop_signal = sig;
+    g_server_running = false;
+    if (g_stop_mq != (mqd_t)-1) mq_send(g_stop_mq, "STOP|", 6, 0);
+    errno = saved_errno;
+}
+
+// --- อัปเดตเวลาล่าสุดของ session (Thread-safe) ---
+// ทุกคำสั่งนับเป็น heartbeat; activity = true ถ้าไม่ใช่ PING
+void touch_session(UserId uid, bool activity) {
+    time_t now = time(nullptr);
+    lock_guard<mutex> lock(hb_mutex);
+    if (uid >= session_times.size()) session_times.resize(uid + 1);
+    SessionTimes& t = session_times[uid];
+    t.last_seen = now;
+    if (activity) t.last_active = now;
+}
+
+// --- อัปเดตเวลากิจกรรมล่าสุดของห้อง (Thread-safe) ---
+void touch_room(RoomId room) {
+    if (room == NO_ID) return;
+    lock_guard<mutex> lock(room_mutex);
+    if (room >= room_last_active.size()) room_last_active.resize(room + 1, 0);
+    room_last_active[room] = time(nullptr);
+}
+
+// --- ปรับ heartbeat interval ตามแรงกดดันของคิว (เรียกจาก monitor ทุกวินาที) ---
+void adapt_heartbeat(time_t now) {
+    static time_t last_change = 0;
+    struct mq_attr qa{};
+    long depth = (sys_mq_getattr(mq, &qa) == 0) ? qa.mq_curmsgs : 0;
+    long capacity = (qa.mq_maxmsg > 0) ? qa.mq_maxmsg : 10;
+
+    bool pressure = depth * 5 >= capacity * 4 || g_backlog >= CREDIT_BACKLOG_LIMIT; // >= 80%
+    bool relaxed = depth * 4 <= capacity && g_backlog < CREDIT_BACKLOG_LIMIT / 4;   // <= 25%
+
+    int cur = g_hb_interval;
+    int next = cur;
+    if (pressure) next = std::min(cur * 2, g_hb_max);
+    else if (relaxed && difftime(now, last_change) >= cur) next = std::max(cur / 2, g_hb_base);
+    if (next == cur) return;
+
+    g_hb_interval = next;
+    last_change = now;
+    if (next > g_hb_timeout_basis) g_hb_timeout_basis = next;
+    cout << "[HB] Heartbeat interval " << cur << "s -> " << next << "s (control queue " << depth
+         << "/" << capacity << ", backlog " << g_backlog << ")" << endl;
+}
+
+// --- ลบ user ออกจากระบบ (EXIT / heartbeat timeout / inactive kick) ---
+// still_stale(times): ตรวจซ้ำภายใต้ lock ว่ายังควรลบอยู่ไหม (เผื่อมีคำสั่งใหม่เข้ามาหลัง scan)
+// คืนค่า false ถ้า user ไม่อยู่แล้วหรือไม่ต้องลบ
+struct Evicted {
+    string name;
+    string reply_queue;
+    RoomId room = NO_ID;
+    string room_name;
+};
+
+// ส่วนที่เปลี่ยน registry (ต้องถือ clients_mutex และ rooms_mutex) ตรวจ / ล้าง session_times ภายใต้ hb_mutex
+template <typename StalePred>
+bool evict_locked(UserId uid, Evicted& out, StalePred still_stale, bool publish) {
+    if (uid >= clients.size() || !clients[uid].active) return false;
+    {
+        lock_guard<mutex> lock3(hb_mutex);  // ล็อค 3
+        SessionTimes none;
+        const SessionTimes& t = (uid < session_times.size()) ? session_times[uid] : none;
+        if (!still_stale(t)) return false;
+        if (uid < session_times.size()) session_times[uid] = SessionTimes{};
+    }
+
+    out.name = user_names.name(uid);
+    out.reply_queue = clients[uid].reply_queue;
+    out.room = leave_room_locked(uid, publish);
+    out.room_name = (out.room == NO_ID) ? "" : room_names.name(out.room);
+
+    uint32_t next_generation = clients[uid].generation + 1; // token เก่าของ slot นี้ใช้ไม่ได้อีก
+    if (clients[uid].subscribed) g_dir_subscribers--;
+    dir_op({"-u\t", out.name});
+    clients[uid] = ClientInfo{};
+    clients[uid].generation = next_generation;
+    publish_route_locked(uid);
+    user_names.release(uid); // ID นี้ว่างให้ user ใหม่ใช้ได้
+    g_users_version++;
+    return true;
+}
+
+template <typename StalePred>
+bool evict_user(UserId uid, Evicted& out, StalePred still_stale) {
+    lock_guard<mutex> lock1(clients_mutex); // ล็อค 1
+    lock_guard<mutex> lock2(rooms_mutex);   // ล็อค 2
+    return evict_locked(uid, out, still_stale, true);
+}
+
+// --- ลบ user ทีละหลายคน (heartbeat timeout / inactive kick ที่เกิดพร้อมกันเป็นร้อย) ---
+// ล็อค 1 -> 2 ครั้งเดียวต่อ EVICT_BATCH คน และ publish snapshot ของแต่ละห้องที่กระทบแค่ครั้งเดียวต่อ batch
+// (เดิมลบทีละคน: ล็อคทีละคน + สร้าง snapshot ของห้องใหม่ทุกคน = O(N^2) เมื่อหลุดกันทั้งห้อง)
+const size_t EVICT_BATCH = 256;   // จำกัดเวลาถือ lock ต่อ batch
+
+template <typename StalePred>
+void evict_users(const vector<UserId>& uids, vector<Evicted>& out, StalePred still_stale) {
+    for (size_t start = 0; start < uids.size(); start += EVICT_BATCH) {
+        size_t end = std::min(uids.size(), start + EVICT_BATCH);
+        vector<RoomId> touched;
+        lock_guard<mutex> lock1(clients_mutex); // ล็อค 1
+        lock_guard<mutex> lock2(rooms_mutex);   // ล็อค 2
+        for (size_t i = start; i < end; ++i) {
+            Evicted ev;
+            if (!evict_locked(uids[i], ev, still_stale, false)) continue;
+            if (ev.room != NO_ID) touched.push_back(ev.room);
+            out.push_back(std::move(ev));
+        }
+        std::sort(touched.begin(), touched.end());
+        touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+        for (RoomId r : touched) publish_members_locked(r);
+    }
+}
+
+// --- Directory Push: ส่ง op ที่สะสมไว้ให้ทุก client ที่ subscribe (เรียกทุก --dir-push-ms) ---
+// frame = "DIR|<a>|<b>|<op>\n..." มี op seq a+1 .. b (แบ่งหลาย frame ถ้ายาวเกินหนึ่งข้อความ)
+// client ใช้ frame ได้ถ้า a <= version <= b (op ทำซ้ำได้) ถ้า a > version แปลว่าตกหล่น (คิวเต็ม) -> SYNC ใหม่
+void dir_push() {
+    vector<string> ops;
+    uint64_t a;
+    {
+        lock_guard<mutex> lock(dir_mutex);
+        if (g_dir_ops.empty()) return;
+        ops.swap(g_dir_ops);
+        a = g_dir_pushed;
+        g_dir_pushed += ops.size();
+    }
+
+    const size_t limit = MQ_MSGSIZE - 1 - 48; // (เผื่อ "DIR|a|b|")
+    vector<string> frames;
+    string text;
+    uint64_t b = a;
+    auto emit = [&]() {
+        frames.push_back("DIR|" + to_string(a) + "|" + to_string(b) + "|" + text);
+        text.clear();
+        a = b;
+    };
+    for (const string& op : ops) {
+        if (!text.empty() && text.size() + op.size() + 1 > limit) emit();
+        text.append(op, 0, limit - 1);
+        text.push_back('\n');
+        b++;
+    }
+    emit();
+
+    vector<string> queues;
+    { //! ล็อค (1)
+        lock_guard<mutex> lock(clients_mutex);
+        for (const ClientInfo& c : clients) {
+            if (c.active && c.subscribed) queues.push_back(c.reply_queue);
+        }
+    } //! ปลดล็อค
+    for (const string& q : queues) {
+        for (const string& f : frames) send_reply(q, f);
+    }
+    g_dir_frames += queues.size() * frames.size();
+}
+
+// --- Presence (ข้อความเข้า / ออกห้องของ SYSTEM) ---
+// --presence-window-ms > 0: สะสม join / leave ของแต่ละห้องไว้ แล้วส่ง delta ห้องละหนึ่งข้อความต่อรอบ
+//   ("joined: a, b | left: c (timeout)") แทนการ broadcast ทุกครั้ง (เข้าแล้วออกภายในรอบเดียวกัน = หักล้างกัน)
+// --presence-max-room > 0: ห้องที่มีสมาชิกมากกว่านี้ไม่ส่ง presence รายคนเลย
+enum PresenceEvent { PE_JOINED, PE_LEFT, PE_DISCONNECTED, PE_TIMEOUT, PE_KICKED };
+const char* const PRESENCE_TEXT[] = {" has joined.", " has left the room.", " has disconnected.",
+                                     " has disconnected (timeout).", " has been kicked (inactive)."};
+const char* const PRESENCE_TEXT_MANY[] = {" have joined.", " have left the room.", " have disconnected.",
+                                          " have disconnected (timeout).", " have been kicked (inactive)."};
+const char* const PRESENCE_TAG[] = {"", "", "", " (timeout)", " (kicked)"}; // (ต่อท้ายชื่อใน delta)
+const size_t NOTICE_LIMIT = MQ_MSGSIZE - 128; // ความยาวสูงสุดของข้อความ SYSTEM ที่รวมหลายชื่อ (เผื่อ header ของ CHAT)
+
+int g_presence_window_ms = 0;
+size_t g_presence_max_room = 0;
+std::atomic<uint64_t> g_presence_events{0};     // เหตุการณ์ทั้งหมด
+std::atomic<uint64_t> g_presence_notices{0};    // ข้อความที่ broadcast จริง
+std::atomic<uint64_t> g_presence_suppressed{0}; // เหตุการณ์ที่ไม่ได้ส่ง (ห้องใหญ่เกิน --presence-max-room)
+
+struct PresenceEntry {
+    string name;
+    PresenceEvent ev;
+};
+struct PendingPresence {
+    vector<PresenceEntry> joined, left;
+
+    void add(std::string_view name, PresenceEvent ev) {
+        vector<PresenceEntry>& same = (ev == PE_JOINED) ? joined : left;
+        vector<PresenceEntry>& opposite = (ev == PE_JOINED) ? left : joined;
+        for (size_t i = 0; i < opposite.size(); ++i) {
+            if (opposite[i].name == name) { // เข้าแล้วออก (หรือออกแล้วกลับเข้า) ภายในรอบเดียว: ไม่ต้องแจ้ง
+                opposite.erase(opposite.begin() + i);
+                return;
+            }
+        }
+        same.push_back(PresenceEntry{string(name), ev});
+    }
+    bool empty() const { return joined.empty() && left.empty(); }
+};
+
+// ประกอบ delta ของห้องหนึ่ง ("joined: a, b | left: c (timeout)") ส่งทีละข้อความผ่าน send(text)
+// (ยาวเกิน NOTICE_LIMIT จะแบ่งเป็นหลายข้อความ)
+template <typename Send>
+void render_presence(const PendingPresence& p, Send send) {
+    AString text(arena());
+    const char* section = nullptr;
+    auto flush = [&]() {
+        send(std::string_view(text));
+        text.clear();
+        section = nullptr;
+    };
+    auto add = [&](const char* label, const PresenceEntry& e) {
+        if (!text.empty() && text.size() + e.name.size() + 24 > NOTICE_LIMIT) flush();
+        if (section != label) {
+            if (!text.empty()) text.append(" | ");
+            text.append(label);
+            section = label;
+        } else {
+            text.append(", ");
+        }
+        text.append(e.name);
+        text.append(PRESENCE_TAG[e.ev]);
+    };
+    for (const PresenceEntry& e : p.joined) add("joined: ", e);
+    for (const PresenceEntry& e : p.left) add("left: ", e);
+    if (!text.empty()) flush();
+}
+
+// คนออกจากห้องเดียวกันพร้อมกันหลายคน [begin, end) (แต่ละตัวมี .name): "Users a, b, c have disconnected ..."
+template <typename It, typename Send>
+void render_departures(It begin, It end, PresenceEvent ev, Send send) {
+    AString names(arena());
+    size_t count = 0;
+    auto flush = [&]() {
+        if (count == 0) return;
+        if (count == 1) send(std::string_view(concat({names, PRESENCE_TEXT[ev]})));
+        else send(std::string_view(concat({"Users ", names, PRESENCE_TEXT_MANY[ev]})));
+        names.clear();
+        count = 0;
+    };
+    for (It it = begin; it != end; ++it) {
+        if (count > 0 && names.size() + it->name.size() + 2 > NOTICE_LIMIT) flush();
+        if (count > 0) names.append(", ");
+        names.append(it->name);
+        count++;
+    }
+    flush();
+}
+mutex presence_mutex; // (ล็อคใบ: ภายในไม่ล็อคอะไรต่อ ถือซ้อนใต้ล็อค 1 / 2 ได้)
+std::unordered_map<RoomId, PendingPresence> g_presence_pending;
+
+bool presence_muted(RoomId room) {
+    if (g_presence_max_room == 0) return false;
+    SnapshotPtr snap = g_room_members.load(room);
+    return snap && snap->ids.size() > g_presence_max_room;
+}
+
+void announce_presence(RoomId room, std::string_view name, PresenceEvent ev) {
+    if (room == NO_ID) return;
+    g_presence_events++;
+    if (g_presence_window_ms <= 0) {
+        if (presence_muted(room)) {
+            g_presence_suppressed++;
+            return;
+        }
+        g_presence_notices++;
+        broadcast_to_room(room, NO_ID, "SYSTEM", concat({name, PRESENCE_TEXT[ev]}));
+        return;
+    }
+
+    lock_guard<mutex> lock(presence_mutex);
+    g_presence_pending[room].add(name, ev);
+}
+
+// ห้องถูกลบ: ทิ้ง delta ที่ค้าง (กัน ID ที่ถูกนำกลับมาใช้กับห้องใหม่ได้รับ delta ของห้องเก่า)
+void presence_drop(RoomId room) {
+    lock_guard<mutex> lock(presence_mutex);
+    g_presence_pending.erase(room);
+}
+
+// ส่ง delta ที่สะสมไว้ ห้องละหนึ่งข้อความ (ยาวเกิน NOTICE_LIMIT จะแบ่งเป็นหลายข้อความ)
+void presence_flush() {
+    std::unordered_map<RoomId, PendingPresence> pending;
+    {
+        lock_guard<mutex> lock(presence_mutex);
+        pending.swap(g_presence_pending);
+    }
+    for (auto& [room, p] : pending) {
+        if (p.empty()) continue;
+        if (presence_muted(room)) {
+            g_presence_suppressed += p.joined.size() + p.left.size();
+            continue;
+        }
+        ArenaScope scope;
+        RoomId r = room;
+        render_presence(p, [&](std::string_view text) {
+            g_presence_notices++;
+            broadcast_to_room(r, NO_ID, "SYSTEM", text);
+        });
+    }
+}
+
+// --- แจ้งห้องที่มีคนออกพร้อมกันหลายคน: ห้องละหนึ่งข้อความ ("Users a, b, c have disconnected ...") ---
+// (ยาวเกินหนึ่งข้อความของคิวจะแบ่งเป็นหลายข้อความ / ถ้าเปิด --presence-window-ms จะรวมไปกับ delta ของรอบนั้น)
+void announce_departures(vector<Evicted>& evs, PresenceEvent ev) {
+    if (g_presence_window_ms > 0) {
+        for (const Evicted& e : evs) announce_presence(e.room, e.name, ev);
+        return;
+    }
+    std::stable_sort(evs.begin(), evs.end(), [](const Evicted& a, const Evicted& b) { return a.room < b.room; });
+    for (size_t i = 0; i < evs.size();) {
+        RoomId room = evs[i].room;
+        size_t j = i;
+        while (j < evs.size() && evs[j].room == room) ++j;
+        if (room != NO_ID) g_presence_events += j - i;
+        if (room != NO_ID && presence_muted(room)) {
+            g_presence_suppressed += j - i;
+        } else if (room != NO_ID) {
+            ArenaScope scope;
+            render_departures(evs.begin() + i, evs.begin() + j, ev, [&](std::string_view text) {
+                g_presence_notices++;
+                broadcast_to_room(room, NO_ID, "SYSTEM", text);
+            });
+        }
+        i = j;
+    }
+}
+
+// --- Queue Reaper: mq_unlink คิวของ user ที่ถูกลบ ทำใน thread แยก (ไม่ถ่วง monitor / kicker) ---
+mutex reaper_mutex;
+condvar reaper_cond;
+vector<string> g_reap_queue;
+
+void reap_queues(const vector<Evicted>& evs) {
+    if (evs.empty()) return;
+    {
+        lock_guard<mutex> lock(reaper_mutex);
+        for (const Evicted& ev : evs) {
+            if (!is_mux_queue(ev.reply_queue)) g_reap_queue.push_back(ev.reply_queue); // (คิวร่วม: process เจ้าของลบเอง)
+        }
+    }
+    reaper_cond.notify_one();
+}
+
+void reaper_thread() {
+    stat_thread_name("reaper");
+    vector<string> batch;
+    while (true) {
+        {
+            unique_lock<mutex> lock(reaper_mutex);
+            reaper_cond.wait(lock, []{ return !g_reap_queue.empty() || !g_server_running; });
+            if (g_reap_queue.empty()) break; // (server กำลังปิด และไม่มีงานค้าง)
+            batch.swap(g_reap_queue);
+        }
+        for (const string& q : batch) sys_mq_unlink(q.c_str());
+        batch.clear();
+    }
+}
+
+// --- Session Token ---
+// REGISTER ตอบกลับ "SESSION|<token>" หลังจากนั้นทุกคำสั่งส่งแค่ token แทนชื่อคิว/ชื่อผู้ใช้
+// token = (generation << 32) | slot เป็นเลขฐาน 16; slot = UserId (index ของ clients โดยตรง)
+// generation เปลี่ยนทุกครั้งที่ slot ถูกนำกลับมาใช้ใหม่ -> token ของ session เก่าใช้ไม่ได้อีก
+// และเริ่มจากค่าสุ่ม จึงเดา token ของคนอื่นได้ยาก (ปลอมเป็นคนอื่นไม่ได้เหมือนตอนส่งชื่อ)
+string make_token(UserId uid, uint32_t generation) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%llx", ((unsigned long long)generation << 32) | uid);
+    return string(buf);
+}
+
+bool parse_token(std::string_view text, UserId& uid, uint32_t& generation) {
+    unsigned long long value = 0;
+    auto res = std::from_chars(text.data(), text.data() + text.size(), value, 16);
+    if (res.ec != std::errc() || res.ptr != text.data() + text.size()) return false;
+    uid = (UserId)(value & 0xffffffffULL);
+    generation = (uint32_t)(value >> 32);
+    return true;
+}
+
+// ข้อมูลของผู้ส่งที่ได้จาก token (คัดลอกออกมาใช้นอก lock)
+struct Session {
+    UserId uid = NO_ID;
+    uint32_t generation = 0;
+    AString name{arena()};
+    AString reply_queue{arena()};
+    RoomId room = NO_ID;   // ห้องปัจจุบัน ณ ตอนแปลง token
+};
+
+// แปลง token เป็น session ด้วย array index + ตรวจ generation (ไม่มีการค้นหาด้วย string)
+bool resolve_session(std::string_view token, Session& out) {
+    UserId uid;
+    uint32_t generation;
+    if (!parse_token(token, uid, generation)) return false;
+
+    lock_guard<mutex> lock(clients_mutex);
+    trace_mark(t_trace, TS_LOCKED);
+    if (uid >= clients.size()) return false;
+    const ClientInfo& info = clients[uid];
+    if (!info.active || info.generation != generation) return false;
+    out.uid = uid;
+    out.generation = generation;
+    out.name = user_names.name(uid);
+    out.reply_queue = info.reply_queue;
+    out.room = info.current_room;
+    return true;
+}
+
+// ตัด field ถัดไป (คั่นด้วย '|') ออกจากหัวของ rest
+std::string_view next_field(std::string_view& rest) {
+    size_t sep = rest.find('|');
+    std::string_view field = rest.substr(0, sep);
+    rest = (sep == std::string_view::npos) ? std::string_view() : rest.substr(sep + 1);
+    return field;
+}
+
+// --- Admission Control (--shed-high / --shed-low) ---
+// main loop ตรวจก่อนส่งงานเข้าคิว: งานค้างถึง high watermark = เริ่ม shed จนกว่าจะลดลงถึง low watermark
+// ระหว่าง shed ทิ้ง CHAT / DM และคำสั่ง directory (LIST / WHO / MEMBERS): main loop แค่ติด MsgRef::shed
+// แล้ว worker (หรือ shard เจ้าของ user) ตอบ BUSY โดยไม่ประมวลผล -> receive thread ไม่แตะ registry / ไม่ mq_send
+// คำสั่งควบคุม session (REGISTER / PING / EXIT) และคำสั่งเปลี่ยนสถานะ (CREATE / JOIN / LEAVE) รับเสมอ
+// high ต่ำกว่าจำนวนช่องของ msg_pool เสมอ -> คำสั่งที่รับเสมอยังมีช่องว่างให้รับ
+// ผู้ส่งได้ "BUSY|<cmd>|<จำนวนที่ session นี้โดนทิ้งทั้งหมด>" และได้ credit คืนเหมือนประมวลผลแล้ว
+size_t g_shed_high = 0;
+size_t g_shed_low = 0;
+bool g_shedding = false;                        // (main loop เท่านั้น)
+std::atomic<uint64_t> g_shed_count[SC_COUNT];   // จำนวนที่ทิ้งแยกตามคำสั่ง
+
+bool sheddable(StatCmd c) {
+    return c == SC_CHAT || c == SC_DM || c == SC_LIST || c == SC_WHO || c == SC_MEMBERS || c == SC_SYNC;
+}
+
+// คืนค่า true = ควรทิ้งข้อความนี้ (นับแล้ว ยังไม่ได้ตอบผู้ส่ง)
+bool should_shed(std::string_view msg) {
+    size_t backlog = g_backlog.load();
+    if (!g_shedding && backlog >= g_shed_high) {
+        g_shedding = true;
+        cout << "[ADMIT] Shedding CHAT/DM/directory (backlog " << backlog << " >= " << g_shed_high << ")" << endl;
+    } else if (g_shedding && backlog <= g_shed_low) {
+        g_shedding = false;
+        cout << "[ADMIT] Accepting all commands (backlog " << backlog << " <= " << g_shed_low << ")" << endl;
+    }
+    if (!g_shedding) return false;
+
+    std::string_view rest(msg);
+    StatCmd kind = stat_cmd_of(next_field(rest));
+    if (!sheddable(kind)) return false;
+    g_shed_count[kind]++;
+    return true;
+}
+
+// --- ข้อความตอบกลับของ STATS (ตัดให้พอดีหนึ่งข้อความของคิว) ---
+AString stats_summary() {
+#ifdef CHAT_INSTRUMENT
+    StatTotals totals;
+    stats_collect(totals);
+
+    AString out("SYSTEM|Stats [cmd calls new open/send/close]: ", arena());
+    for (int c = SC_REGISTER; c < SC_COUNT; ++c) {
+        const uint64_t* v = totals.per_cmd[c];
+        if (v[SK_CALLS] == 0) continue;
+        out.append(STAT_CMD_NAMES[c]).append(" ").append(num(v[SK_CALLS]));
+        out.append(" ").append(num(v[SK_NEW])).append(" ").append(num(v[SK_MQ_OPEN]));
+        out.append("/").append(num(v[SK_MQ_SEND])).append("/").append(num(v[SK_MQ_CLOSE])).append("; ");
+    }
+    out.append("| threads [new recv]: ");
+    for (int t = 0; t < totals.threads; ++t) {
+        const char* name = g_thread_stats[t].name.load();
+        out.append(name ? name : "thread").append("#").append(num(t)).append(" ");
+        out.append(num(totals.per_thread[t][SK_NEW])).append(" ").append(num(totals.per_thread[t][SK_MQ_RECV])).append("; ");
+    }
+    if (out.size() >= (size_t)MQ_MSGSIZE) out.resize(MQ_MSGSIZE - 1);
+    return out;
+#else
+    return AString("SYSTEM|Stats unavailable (server built without -DCHAT_INSTRUMENT).", arena());
+#endif
+}
+
+// --- ตรวจ argument ของ REGISTER (ตอบ error ให้ผู้ส่งเองถ้าไม่ผ่าน) ---
+bool register_args_ok(std::string_view reply_q, std::string_view username) {
+    if (!valid_mux_queue(reply_q)) {
+        // (ตอบที่คิวโดยไม่มี header: tag นี้ใช้แยกข้อความไม่ได้)
+        AString base(reply_q.substr(0, reply_q.find('#')), arena());
+        send_reply(base, "SYSTEM|Error: Invalid queue tag.");
+        cout << "[LOG] BAD_TAG: rejected REGISTER (Q: " << reply_q << ")\n";
+        return false;
+    }
+    AString q(reply_q, arena());
+    if (username.empty()) {
+        send_reply(q, "SYSTEM|Unknown command or invalid format.");
+        return false;
+    }
+    if (!valid_name(username)) {
+        send_reply(q, "SYSTEM|Error: Invalid username.");
+        return false;
+    }
+    return true;
+}
+
+//! --- ฟังก์ชันประมวลผลข้อความ (หัวใจหลัก) ---
+// รูปแบบ: "REGISTER|<reply_q>|<name>" หรือ "<CMD>|<token>[|args...]"
+void process_message(std::string_view msg, bool shed) {
+    std::string_view rest(msg);
+    std::string_view cmd = next_field(rest);
+    std::string_view field = next_field(rest);
+    if (cmd.empty() || field.empty()) return;
+    StatScope stat_scope(stat_cmd_of(cmd)); // (instrumentation: นับ allocation / mq_* ให้คำสั่งนี้)
+
+    // --- 1. REGISTER ---
+    if (cmd == "REGISTER") {
+        AString reply_q(field, arena());
+        std::string_view username = next_field(rest);
+        if (!register_args_ok(reply_q, username)) return;
+
+        lock_guard<mutex> lock(clients_mutex); //! ล็อค (1)
+        trace_mark(t_trace, TS_LOCKED);
+        if (user_names.find(username) != NO_ID) {
+            send_reply(reply_q, "SYSTEM|Error: Username already taken.");
+            return;
+        }
+        UserId id = user_names.intern(username);
+        if (id >= clients.size()) {
+            clients.resize(id + 1);
+            clients[id].generation = (uint32_t)g_token_rng(); // slot ใหม่: เริ่ม generation แบบสุ่ม
+        }
+        clients[id].active = true;
+        publish_route_locked(id);
+        clients[id].reply_queue.assign(reply_q.data(), reply_q.size());
+        g_users_version++;
+        dir_op({"u\t", username, "\t"});
+        touch_session(id, true);
+        {
+            lock_guard<mutex> lock_hb(hb_mutex);
+            session_times[id].hb_advertised = g_hb_interval;
+        }
+        // ส่ง token ก่อน (priority 2) ให้ client รู้ token ก่อนได้ Welcome / CREDIT
+        send_reply(reply_q, concat({"SESSION|", make_token(id, clients[id].generation)}), 2);
+        send_reply(reply_q, concat({"SYSTEM|Welcome ", username, "! You are in the Lobby."}));
+        send_credit(reply_q, CREDIT_WINDOW); // credit ชุดแรกของ session (พร้อม heartbeat interval)
+        cout << "[LOG] USER_REG: " << username << " registered (Q: " << reply_q << ")\n";
+        return;
+    }
+
+    // --- คำสั่งอื่นทั้งหมด: แปลง token เป็น session (ถ้า token ผิด/หมดอายุ ไม่รู้จะตอบกลับไปที่ไหน ทิ้งเลย) ---
+    Session s;
+    if (!resolve_session(field, s)) {
+        cout << "[LOG] BAD_TOKEN: dropped " << cmd << " (token " << field << ")\n";
+        return;
+    }
+    UserId uid = s.uid;
+    std::string_view username = s.name;
+    const AString& reply_q = s.reply_queue;
+
+    // --- คำสั่งที่ใช้ credit: คืน credit ให้ผู้ส่งเมื่อประมวลผลเสร็จ (ทุกทางออกของฟังก์ชัน) ---
+    // (REGISTER / PING / EXIT เป็นคำสั่งควบคุม session ไม่ใช้ credit)
+    bool uses_credit = (cmd != "PING" && cmd != "EXIT");
+    struct CreditReturn {
+        UserId uid;
+        uint32_t generation;
+        ~CreditReturn() { if (uid != NO_ID) return_credit(uid, generation); }
+    } credit_return{uses_credit ? uid : NO_ID, s.generation};
+
+    // --- ทุกคำสั่งนับเป็น heartbeat (EXIT ไม่ต้องนับ) ---
+    if (cmd != "EXIT") touch_session(uid, cmd != "PING");
+
+    // --- main loop ตัดสินให้ทิ้งแล้ว (ดู should_shed()): ตอบ BUSY แทนการประมวลผล ---
+    if (shed) {
+        uint32_t n;
+        {
+            lock_guard<mutex> lock(clients_mutex);
+            if (!same_session(uid, s.generation)) return;
+            n = ++clients[uid].shed;
+        }
+        send_reply(reply_q, concat({"BUSY|", cmd, "|", num(n)}));
+        return;
+    }
+
+    // --- 2. CREATE ---
+    if (cmd == "CREATE") {
+        std::string_view room_name = next_field(rest);
+        RoomId room;
+
+        { //! ล็อค 2 ชั้น (ตามกฎ 1 -> 2)
+            lock_guard<mutex> lock1(clients_mutex); // ล็อค 1
+            lock_guard<mutex> lock2(rooms_mutex);   // ล็อค 2
+
+            if (!clients[uid].active) {
+                send_reply(reply_q, "SYSTEM|Error: User not registered.");
+                return;
+            }
+            if (!room_name.empty() && !valid_name(room_name)) {
+                send_reply(reply_q, "SYSTEM|Error: Invalid room name.");
+                return;
+            }
+            if (room_name.empty() || room_names.find(room_name) != NO_ID) {
+                send_reply(reply_q, concat({"SYSTEM|Error: Room already exists: ", room_name}));
+                return;
+            }
+            if (clients[uid].current_room != NO_ID) {
+                send_reply(reply_q, "SYSTEM|Error: You must be in the Lobby to create a room.");
+                return;
+            }
+            // ถ้าผ่านหมด
+            room = room_names.intern(room_name);
+            if (room >= SnapshotTable::MAX_ROOMS) { // (เกินตาราง snapshot)
+                room_names.release(room);
+                send_reply(reply_q, "SYSTEM|Error: Too many rooms.");
+                return;
+            }
+            if (room >= rooms.size()) rooms.resize(room + 1);
+            rooms[room].active = true;
+            auto w = g_room_weight_config.find(room_name);
+            if (w != g_room_weight_config.end()) rooms[room].weight = w->second;
+            g_room_weight.store(room, rooms[room].weight);
+            rooms[room].members.clear();
+            dir_op({"r\t", room_name});
+            join_room_locked(uid, room);
+        } //! ปลดล็อค
+
+        touch_room(room);
+        send_reply(reply_q, concat({"JOIN_SUCCESS|", room_name}));
+        cout << "[LOG] ROOM_CREATE: " << username << " created and joined room '" << room_name << "'.\n";
+    }
+
+    // --- ‼️ FIX 2: แก้ไขคำสั่ง JOIN ---
+    // --- 3. JOIN ---
+    else if (cmd == "JOIN") {
+        std::string_view room_name = next_field(rest);
+        RoomId room, old_room;
+
+        { //! ล็อค 2 ชั้น (แก้ไขลำดับตามกฎ 1 -> 2)
+            lock_guard<mutex> lock1(clients_mutex); // 1. ล็อค clients ก่อน
+            lock_guard<mutex> lock2(rooms_mutex);   // 2. ล็อค rooms ทีหลัง
+
+            // ตรวจสอบ User ก่อน (เพราะถือ lock1)
+            if (!clients[uid].active) {
+                send_reply(reply_q, "SYSTEM|Error: User not found.");
+                return;
+            }
+            // ตรวจสอบ Room (เพราะถือ lock2)
+            room = room_names.find(room_name);
+            if (room == NO_ID) {
+                send_reply(reply_q, "SYSTEM|Error: Room not found.");
+                return;
+            }
+            old_room = clients[uid].current_room;
+            if (old_room != room) {
+                leave_room_locked(uid);
+                join_room_locked(uid, room);
+            }
+        } //! ปลดล็อค
+
+        touch_room(room);
+        send_reply(reply_q, concat({"JOIN_SUCCESS|", room_name}));
+        if (old_room != room) {
+            announce_presence(old_room, username, PE_LEFT);
+            announce_presence(room, username, PE_JOINED);
+        }
+        cout << "[LOG] ROOM_JOIN: " << username << " joined room '" << room_name << "'.\n";
+    }
+    // --- ‼️ END FIX 2 ---
+
+    // --- 4. LIST ---
+    // (render ไว้แล้ว จำนวนสมาชิก = members.size() ซึ่งอัปเดตทีละคนตอน join / leave)
+    else if (cmd == "LIST") {
+        AString scratch(arena());
+        send_reply(reply_q, page_at(*cached_room_list(), next_field(rest), "LIST||", scratch));
+        cout << "[LOG] USER_LIST: " << username << " requested room list.\n";
+    }
+
+    // --- 5. CHAT ---
+    // (ห้อง = ห้องปัจจุบันของ session ไม่ต้องส่งชื่อห้องมา; ข้อความ = ส่วนที่เหลือทั้งหมด รวม '|')
+    else if (cmd == "CHAT") {
+        std::string_view message = rest;
+
+        RoomId room = NO_ID;
+        AString room_name(arena());
+        const char* limited = nullptr;
+        { //! ล็อค (1) -> (2)
+            lock_guard<mutex> lock1(clients_mutex);
+            lock_guard<mutex> lock2(rooms_mutex);
+            if (clients[uid].active) room = clients[uid].current_room;
+            if (room != NO_ID) {
+                room_name = room_names.name(room);
+                limited = rate_check(clients[uid], &rooms[room]); // (ก่อน fan-out)
+            }
+        } //! ปลดล็อค
+
+        if (limited) {
+            send_reply(reply_q, concat({"SYSTEM|Error: Rate limit exceeded (", limited, "). Message dropped."}));
+        } else if (room != NO_ID) {
+            broadcast_to_room(room, uid, username, message); // (ใช้เวอร์ชันที่แก้แล้ว)
+            touch_room(room);
+            cout << "[LOG] CHAT_MSG: (" << room_name << ") " << username << ": " << message << "\n";
+            if (!g_latency_room_name.empty() && std::string_view(room_name) == g_latency_room_name) t_latency_room = true;
+        } else {
+            send_reply(reply_q, "SYSTEM|Error: You must be in a room to chat.");
+        }
+    }
+
+    // --- 6. WHO ---
+    else if (cmd == "WHO") {
+        RenderedPtr who = (s.room == NO_ID) ? nullptr : cached_who(s.room);
+        if (!who) {
+            send_reply(reply_q, "SYSTEM|Error: You are in the Lobby.");
+            return;
+        }
+        AString scratch(arena());
+        send_reply(reply_q, page_at(*who, next_field(rest), "WHO||", scratch));
+        cout << "[LOG] USER_WHO: " << username << " listed members in " << who->subject << ".\n";
+    }
+
+    // --- 7. LEAVE ---
+    else if (cmd == "LEAVE") {
+        RoomId old_room = NO_ID;
+        AString old_room_name(arena());
+        { //! ล็อค (1) -> (2)
+            lock_guard<mutex> lock1(clients_mutex);
+            lock_guard<mutex> lock2(rooms_mutex);
+            if (clients[uid].active) {
+                old_room = leave_room_locked(uid);
+            }
+            if (old_room == NO_ID) {
+                send_reply(reply_q, "SYSTEM|Error: You are already in the Lobby.");
+                return;
+            }
+            old_room_name = room_names.name(old_room);
+        } //! ปลดล็อค
+
+        // --- ‼️ FIX: ย้าย room_mutex มาไว้หลังสุด ‼️ ---
+
+        send_reply(reply_q, "JOIN_SUCCESS|");
+        announce_presence(old_room, username, PE_LEFT);
+        cout << "[LOG] ROOM_LEAVE: " << username << " left room '" << old_room_name << "'.\n";
+
+        // ย้ายมาไว้ตรงนี้ (ล็อค 3)
+        touch_room(old_room);
+        // --- ‼️ END FIX ‼️ ---
+    }
+
+    // --- 8. DM ---
+    else if (cmd == "DM") {
+        std::string_view target = next_field(rest);
+        std::string_view message = rest;
+
+        AString target_q(arena());
+        bool found = false;
+        const char* limited = nullptr;
+        { //! ล็อค (1)
+            lock_guard<mutex> lock(clients_mutex);
+            UserId target_id = user_names.find(target);
+            if (target_id != NO_ID && clients[target_id].active) {
+                target_q = clients[target_id].reply_queue;
+                found = true;
+                limited = rate_check(clients[uid], nullptr);
+            }
+        } //! ปลดล็อค
+
+        if (limited) {
+            send_reply(reply_q, concat({"SYSTEM|Error: Rate limit exceeded (", limited, "). Message dropped."}));
+        } else if (found) {
+            send_reply(target_q, concat({"DM|", username, " (DM): ", message}));
+            send_reply(reply_q, concat({"SYSTEM|DM sent to ", target, "."}));
+            cout << "[LOG] USER_DM: " << username << " sent DM to " << target << ".\n";
+        } else {
+            send_reply(reply_q, concat({"SYSTEM|Error: User ", target, " not found."}));
+        }
+    }
+
+    // --- 9. EXIT ---
+    else if (cmd == "EXIT") {
+        Evicted ev;
+        if (evict_user(uid, ev, [](const SessionTimes&) { return true; })) {
+            if (!is_mux_queue(ev.reply_queue)) sys_mq_unlink(ev.reply_queue.c_str()); // ลบคิวของ client (ย้ายมานอก lock)
+            announce_presence(ev.room, ev.name, PE_DISCONNECTED);
+            send_reply(ev.reply_queue, "SYSTEM|Goodbye!");
+            touch_room(ev.room);
+            cout << "[LOG] USER_EXIT: " << ev.name << " disconnected (Room: " << ev.room_name << ").\n";
+        }
+    }
+
+    // --- 10. PING ---
+    // (เวลาถูกอัปเดตแล้วด้านบน) ตอบกลับเฉพาะเมื่อ heartbeat interval เปลี่ยนจากที่เคยแจ้งไว้
+    else if (cmd == "PING") {
+        int hb = g_hb_interval;
+        bool changed = false;
+        {
+            lock_guard<mutex> lock(hb_mutex);
+            if (uid < session_times.size() && session_times[uid].hb_advertised != hb) {
+                session_times[uid].hb_advertised = hb;
+                changed = true;
+            }
+        }
+        if (changed) send_credit(reply_q, 0);
+    }
+
+    // --- 11. MEMBERS ---
+    else if (cmd == "MEMBERS") {
+        AString scratch(arena());
+        send_reply(reply_q, page_at(*cached_member_list(), next_field(rest), "MEMBERS||", scratch));
+    }
+
+    // --- 12. SYNC ---
+    // สมัครรับ delta ของ directory (DIR|...) และส่ง snapshot ทีละหน้า: "SYNC|<next>|<seq>|<op>\n..."
+    // (ต้องตั้ง subscribed ก่อน render snapshot: op หลัง seq ของ snapshot จะถูกเก็บไว้ push เสมอ)
+    else if (cmd == "SYNC") {
+        std::string_view cursor = next_field(rest);
+        {
+            lock_guard<mutex> lock(clients_mutex); //! ล็อค (1)
+            if (clients[uid].active && !clients[uid].subscribed) {
+                clients[uid].subscribed = true;
+                g_dir_subscribers++;
+            }
+        }
+        if (cursor.empty()) g_dir_syncs++;
+        AString scratch(arena());
+        send_reply(reply_q, page_at(*cached_directory(), cursor, "SYNC||0|", scratch));
+    }
+
+    // --- 13. STATS ---
+    // ตัวนับ allocation / mq_* แยกตามคำสั่งและ thread (มีเฉพาะเมื่อ build ด้วย -DCHAT_INSTRUMENT)
+    else if (cmd == "STATS") {
+        send_reply(reply_q, stats_summary());
+    }
+
+    else {
+        send_reply(reply_q, "SYSTEM|Unknown command or invalid format.");
+    }
+}
+
+// --- key สำหรับแบ่งงานตาม user (work-stealing deque) ดูแค่ header ไม่ต้อง resolve session ---
+// REGISTER ตาม hash ของชื่อ คำสั่งอื่นตาม UserId ใน token (token เสีย = 0: ไปที่ไหนก็ถูกทิ้งเหมือนกัน)
+size_t route_key(std::string_view msg) {
+    std::string_view rest(msg);
+    std::string_view cmd = next_field(rest);
+    std::string_view field = next_field(rest);
+    if (cmd == "REGISTER") return std::hash<std::string_view>{}(next_field(rest));
+    UserId uid;
+    uint32_t generation;
+    if (!parse_token(field, uid, generation)) return 0;
+    return uid;
+}
+
+// --- flow ของข้อความใน DRR scheduler (ดู DrrQueue) ---
+// CHAT = ห้องปัจจุบันของผู้ส่ง (ใช้ weight ของห้อง), คำสั่งอื่น = session ของผู้ส่ง, REGISTER = hash ของชื่อ
+const uint64_t FLOW_ROOM = 1ULL << 32;
+const uint64_t FLOW_USER = 2ULL << 32;
+const uint64_t FLOW_REGISTER = 3ULL << 32;
+
+void drr_classify(std::string_view msg, UserId& uid, uint64_t& key, int& weight) {
+    std::string_view rest(msg);
+    std::string_view cmd = next_field(rest);
+    std::string_view field = next_field(rest);
+    uid = NO_ID;
+    weight = 1;
+    if (cmd == "REGISTER") {
+        key = FLOW_REGISTER | (uint32_t)std::hash<std::string_view>{}(next_field(rest));
+        return;
+    }
+    uint32_t generation;
+    if (!parse_token(field, uid, generation)) {
+        uid = NO_ID;
+        key = FLOW_USER | NO_ID; // (token เสีย: ถูกทิ้งตอนประมวลผลอยู่แล้ว)
+        return;
+    }
+    key = FLOW_USER | uid;
+    if (cmd != "CHAT") return;
+
+    // (ไม่ล็อค: อ่านจากสำเนา route / weight ถ้า user เพิ่งย้ายห้อง งานนี้อาจเข้าคิวของห้องเดิม
+    //  ซึ่งมีผลแค่ความยุติธรรมของ scheduler ห้องที่ใช้ส่งจริงตัดสินตอนประมวลผลเหมือนเดิม)
+    uint64_t route = g_user_route.load(uid);
+    if ((uint32_t)(route >> 32) != generation) return;
+    RoomId room = (RoomId)route;
+    if (room == NO_ID) return;
+    key = FLOW_ROOM | room;
+    weight = g_room_weight.load(room);
+}
+
+// --- ประมวลผลงานหนึ่งชิ้นจาก msg_pool (worker pool: fifo / drr / steal ส่วน shard ใช้ shard_run()) ---
+void run_task(const MsgRef& task) {
+    // อ่านข้อความตรงจากช่องใน pool (ไม่ copy) แล้วคืนช่องเมื่อเสร็จ
+    // (ทุกอย่างที่จองระหว่างประมวลผลอยู่ใน arena และถูกล้างทิ้งเมื่อจบ scope)
+    std::string_view msg(msg_pool.data(task.slot), task.len);
+    trace_begin(task);
+    if (task.len > 0) {
+        ArenaScope scope;
+        process_message(msg, task.shed);
+    }
+    trace_end(msg);
+    msg_pool.release(task.slot);
+    uint64_t latency_us = (mono_ns() - task.recv_ns) / 1000;
+    g_latency.record(latency_us);
+    if (t_latency_room) {
+        g_latency_room.record(latency_us);
+        t_latency_room = false;
+    }
+
+    // งานค้างลดลงแล้ว: คืน credit ที่กั๊กไว้
+    if (g_credit_pending && g_backlog < CREDIT_BACKLOG_LIMIT) {
+        ArenaScope scope;
+        flush_credits();
+    }
+}
+
+// --- Adaptive Worker Pool (--min-threads / --max-threads, เฉพาะ scheduler fifo) ---
+// monitor เรียก adapt_pool() ทุกวินาที ดู 3 อย่างของช่วงที่ผ่านมา:
+//   - งานค้างใน task_queue, utilization (เวลาที่ worker ทำงานจริง / เวลาทั้งหมด), p99 latency
+// งานค้าง หรือ latency เกินเป้าทั้งที่ worker ยุ่ง -> เพิ่ม worker (ทีละ 1/4 ของที่มี อย่างน้อย 1)
+// ว่างติดกัน POOL_SHRINK_TICKS วินาที -> ลดทีละ 1 (ลดช้ากว่าเพิ่ม กันแกว่ง)
+// worker ที่เกินเป้าจะออกเองตอนไม่มีงานในมือ (ไม่มีการฆ่า thread กลางงาน)
+// ทุกการตัดสินใจพิมพ์ [POOL] พร้อมตัวเลขที่ใช้ตัดสิน
+const int POOL_SHRINK_TICKS = 5;
+int g_pool_min = 1;                        // --min-threads
+int g_pool_max = 1;                        // --max-threads (เท่ากับ min = ขนาดคงที่)
+uint64_t g_pool_latency_us = 5000;         // --pool-latency-us: เป้า p99
+std::atomic<int> g_pool_target(1);         // จำนวน worker ที่ต้องการ
+std::atomic<int> g_pool_live(1);           // จำนวน worker ที่ยังรันอยู่
+std::atomic<uint64_t> g_pool_busy_ns(0);   // เวลาที่ worker ทั้งหมดใช้ประมวลผล (สะสม)
+
+struct PoolWorker {
+    thread t;
+    std::atomic<bool> done{false};
+};
+mutex pool_mutex;                          // ป้องกัน g_pool_workers (ลำดับล็อค: pool_mutex -> queue_mutex)
+vector<std::unique_ptr<PoolWorker>> g_pool_workers;
+
+// ออกจาก pool ถ้ามี worker เกินเป้า (เรียกภายใต้ queue_mutex)
+bool pool_retire() {
+    int live = g_pool_live.load();
+    while (live > g_pool_target.load()) {
+        if (g_pool_live.compare_exchange_weak(live, live - 1)) return true;
+    }
+    return false;
+}
+
+// --- ฟังก์ชันที่ Worker Thread แต่ละตัวจะรัน ---
+void worker_thread(PoolWorker* self) {
+    stat_thread_name("worker");
+    while (g_server_running) {
+        MsgRef task;
+        {
+            unique_lock<mutex> lock(queue_mutex);
+            queue_cond.wait(lock, [&]{
+                return !tasks_empty() || !g_server_running || g_pool_live > g_pool_target;
+            });
+
+            if (!g_server_running && tasks_empty()) {
+                break;
+            }
+            if (g_server_running && pool_retire()) {
+                break;
+            }
+            if (tasks_empty()) continue;
+
+            task = tasks_pop();
+            g_backlog = tasks_size();
+        }
+
+        uint64_t start = mono_ns();
+        run_task(task);
+        g_pool_busy_ns += mono_ns() - start;
+    }
+    self->done = true;
+}
+
+// ต้องถือ pool_mutex
+void pool_spawn_locked() {
+    g_pool_workers.push_back(std::make_unique<PoolWorker>());
+    PoolWorker* w = g_pool_workers.back().get();
+    w->t = thread(worker_thread, w);
+}
+
+// --- ปรับขนาด pool (เรียกจาก monitor ทุกวินาที) ---
+void adapt_pool() {
+    static uint64_t last_ns = 0;
+    static uint64_t last_busy = 0;
+    static uint64_t last_counts[LatencyHistogram::BUCKETS] = {};
+    static int idle_ticks = 0;
+
+    uint64_t now_ns = mono_ns();
+    if (last_ns == 0) { // รอบแรก: แค่เก็บจุดเริ่มต้น
+        last_ns = now_ns;
+        last_busy = g_pool_busy_ns.load();
+        g_latency.snapshot(last_counts);
+        return;
+    }
+    uint64_t busy = g_pool_busy_ns.load();
+    uint64_t counts[LatencyHistogram::BUCKETS];
+    g_latency.snapshot(counts);
+
+    uint64_t window[LatencyHistogram::BUCKETS];
+    uint64_t handled = 0;
+    for (int b = 0; b < LatencyHistogram::BUCKETS; ++b) {
+        window[b] = counts[b] - last_counts[b];
+        last_counts[b] = counts[b];
+        handled += window[b];
+    }
+    int live = g_pool_live.load();
+    double util = (double)(busy - last_busy) / (double)((now_ns - last_ns) * (uint64_t)std::max(1, live));
+    last_busy = busy;
+    last_ns = now_ns;
+
+    lock_guard<mutex> lock(pool_mutex);
+
+    // เก็บ thread ที่ออกไปแล้ว
+    for (size_t i = 0; i < g_pool_workers.size();) {
+        if (g_pool_workers[i]->done) {
+            g_pool_workers[i]->t.join();
+            g_pool_workers[i] = std::move(g_pool_workers.back());
+            g_pool_workers.pop_back();
+        } else {
+            ++i;
+        }
+    }
+    if (g_pool_min == g_pool_max || !g_server_running) return;
+
+    size_t backlog = g_backlog.load();
+    uint64_t p99 = LatencyHistogram::percentile_of(window, 0.99);
+    int target = g_pool_target.load();
+    int next = target;
+    const char* reason = nullptr;
+
+    bool idle = backlog == 0 && util < 0.3 && p99 <= g_pool_latency_us / 2;
+    if (!idle) idle_ticks = 0;
+
+    if (backlog >= (size_t)target && util >= 0.5) {
+        next = std::min(g_pool_max, target + std::max(1, target / 4));
+        reason = "queued work";
+    } else if (handled > 0 && p99 > g_pool_latency_us && util >= 0.75) {
+        next = std::min(g_pool_max, target + std::max(1, target / 4));
+        reason = "p99 over target";
+    } else if (idle && ++idle_ticks >= POOL_SHRINK_TICKS) {
+        next = std::max(g_pool_min, target - 1);
+        reason = "idle";
+    }
+    if (next == target) return;
+
+    idle_ticks = 0;
+    g_pool_target = next;
+    if (next > target) {
+        for (int i = target; i < next; ++i) {
+            g_pool_live++;
+            pool_spawn_locked();
+        }
+    } else {
+        lock_guard<mutex> qlock(queue_mutex);
+        queue_cond.notify_all();
+    }
+    cout << "[POOL] Workers " << target << " -> " << next << " (" << reason << ": backlog " << backlog
+         << ", util " << (int)(util * 100) << "%, p99<=" << p99 << "us, " << handled << " msgs/s)" << endl;
+}
+
+// --- Work-Stealing Worker ---
+// หยิบงานจาก deque ตัวเองก่อน ไม่มีค่อยขโมยจากคนอื่น (เริ่มจากตัวถัดไป กระจายการแย่ง)
+bool steal_take(int self, Task& out) {
+    int n = (int)g_deques.size();
+    for (int k = 0; k < n; ++k) {
+        WorkerDeque& dq = *g_deques[(self + k) % n];
+        lock_guard<mutex> lock(dq.m);
+        if (dq.tasks.empty()) continue;
+        out = std::move(dq.tasks.front());
+        dq.tasks.pop_front();
+        g_steal_pending--;
+        return true;
+    }
+    return false;
+}
+
+void steal_park() {
+    unique_lock<mutex> lock(steal_mutex);
+    g_steal_sleepers++;
+    steal_cond.wait(lock, []{ return g_steal_pending.load() > 0 || !g_server_running; });
+    g_steal_sleepers--;
+}
+
+void steal_worker_thread(int self) {
+    stat_thread_name("worker");
+    t_worker = self;
+    Task task;
+    while (true) {
+        if (steal_take(self, task)) {
+            if (task.fanout) {
+                run_fanout_chunk(*task.fanout, task.begin, task.end);
+                task.fanout.reset();
+            } else {
+                g_backlog = g_steal_pending.load();
+                run_task(task.msg);
+            }
+            continue;
+        }
+        if (!g_server_running) break; // ทุก deque ว่างแล้วและ server กำลังปิด
+        steal_park();
+    }
+}
+
+// --- Sharded Mode (--shards=N): thread-per-core แบบ shared-nothing ---
+// แต่ละ shard มี worker ตัวเดียว (pin ไว้กับ CPU) และเป็นเจ้าของ user / ห้องส่วนหนึ่งแต่เพียงผู้เดียว
+//   - user อยู่ shard ตาม hash ของชื่อ ห้องอยู่ shard ตาม hash ของชื่อห้อง
+//     ID = (shard << SHARD_BITS) | ID ใน shard -> main loop อ่าน shard ของผู้ส่งจาก token ได้เลย
+//     คำสั่งของ user คนเดียวกันจึงทำบน core เดียวกันตามลำดับเสมอ
+//   - registry, สมาชิกห้อง, credit, heartbeat / idle timer, การลบห้อง, presence, latency และ log เป็นของ shard
+//     (ไม่แตะ clients / rooms / session_times และไม่ล็อค clients_mutex / rooms_mutex / hb_mutex เลย)
+// งานที่ข้าม shard ส่งเป็น ShardMsg ผ่าน ring SPSC ของแต่ละคู่ (from -> to) ลำดับในคู่เดียวกันคงที่
+//   JOIN / CREATE  shard ของ user -> shard ของห้อง (เพิ่มสมาชิก) -> ตอบ JOINED กลับ
+//                  ระหว่างรอ คำสั่งถัดไปของ user ถูกพักไว้ (parked) แล้วทำต่อตามลำดับเมื่อได้ผล
+//   CHAT / WHO     ส่งต่อไป shard ของห้อง (CHAT ส่งแค่ช่องใน msg_pool ไม่ copy ข้อความ) fan-out / render ที่นั่น
+//   DM             ส่งต่อไป shard ของผู้รับ
+//   LEAVE          แจ้ง shard ของห้อง (LEAVE / EXIT / timeout / kick / ย้ายห้อง)
+//   DONE           งานที่ส่งต่อเสร็จแล้ว: shard ของ user คืน credit (พร้อมหนี้ rate limit ของห้อง)
+// LIST / MEMBERS: แต่ละ shard publish รายการของตัวเอง (DirPart) shard ที่ถูกถามรวมเป็นหน้า (cache ต่อ shard)
+// ไม่รองรับ SYNC (delta ของ directory ต้องมีลำดับ op เดียวทั้ง server) client --cache จะถามทีละคำสั่งแทน
+const int SHARD_BITS = 24;
+const uint32_t SHARD_LOCAL_LIMIT = 1u << SHARD_BITS; // user / ห้องต่อ shard ได้ไม่เกินนี้
+const int MAX_SHARDS = 64;                           // (ring ระหว่าง shard มี N x N วง)
+const size_t SHARD_RING = 256;                       // ขนาด ring ระหว่าง shard (เต็ม = พักไว้ใน outbox)
+const int SHARD_BATCH = 64;                          // งานต่อ ring ต่อรอบ (ไม่ให้ ring ใดกินเวลาทั้งรอบ)
+const int SHARD_PUBLISH_MS = 20;                     // publish DirPart ถี่สุดเท่านี้ (REGISTER / JOIN รัวๆ)
+
+// ring แบบ single-producer / single-consumer (ไม่มี lock: head / tail อยู่คนละ cache line)
+template <typename T>
+struct SpscRing {
+    vector<T> buf;
+    size_t mask = 0;
+    alignas(64) std::atomic<size_t> head{0};   // consumer เขียน
+    alignas(64) std::atomic<size_t> tail{0};   // producer เขียน
+
+    void init(size_t capacity) {
+        size_t cap = 1;
+        while (cap < capacity) cap <<= 1;
+        buf.resize(cap);
+        mask = cap - 1;
+    }
+
+    // producer เท่านั้น: false = เต็ม (item ไม่ถูกย้าย)
+    bool push(T& item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) > mask) return false;
+        buf[t & mask] = std::move(item);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer เท่านั้น
+    bool pop(T& out) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
+        out = std::move(buf[h & mask]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t size() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+    bool empty() const { return size() == 0; }
+};
+
+// ที่หลับของ consumer (shard / main loop) producer เรียก wake() หลัง push
+// (fence ทั้งสองฝั่ง: producer เห็นว่าหลับอยู่ หรือ consumer เห็นงานใหม่ก่อนหลับ อย่างใดอย่างหนึ่งเสมอ)
+struct Parker {
+    alignas(64) std::atomic<bool> sleeping{false};
+    mutex park_mutex;
+    condvar park_cond;
+
+    template <typename Ready>
+    void wait(Ready ready, int timeout_ms) {
+        unique_lock<mutex> lock(park_mutex);
+        sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        park_cond.wait_for(lock, std::chrono::milliseconds(timeout_ms), [&]{ return ready() || !g_server_running; });
+        sleeping.store(false, std::memory_order_relaxed);
+    }
+
+    void wake() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!sleeping.load(std::memory_order_relaxed)) return;
+        lock_guard<mutex> lock(park_mutex);
+        park_cond.notify_one();
+    }
+};
+
+enum ShardOp { SO_JOIN, SO_JOINED, SO_LEAVE, SO_CHAT, SO_DM, SO_WHO, SO_DONE };
+enum JoinStatus { JS_OK, JS_NOT_FOUND, JS_EXISTS, JS_FULL };
+
+struct ShardMsg {
+    ShardOp op = SO_DONE;
+    UserId uid = NO_ID;           // ผู้สั่ง
+    uint32_t generation = 0;      // generation ของ session ผู้สั่ง (ตอนได้ผลกลับ ตรวจว่ายังเป็น session เดิม)
+    RoomId room = NO_ID;
+    bool create = false;          // JOIN: มาจาก CREATE
+    JoinStatus status = JS_OK;    // JOINED
+    PresenceEvent ev = PE_LEFT;   // LEAVE
+    MsgRef ref{};                 // CHAT / DM: ช่องใน msg_pool (ปลายทางคืนเอง) / อื่นๆ ใช้แค่ recv_ns
+    uint64_t hold_until = 0;      // DONE: (โหมด delay) กั๊ก credit ถึงเวลานี้
+    string name;                  // ชื่อผู้สั่ง
+    string queue;                 // คิวตอบกลับของผู้สั่ง
+    string text;                  // ชื่อห้อง / ผู้รับ DM / cursor ของ WHO
+};
+
+struct ShardMember {
+    UserId uid;
+    string name;
+    string queue;
+};
+
+struct ShardRoom {
+    bool active = false;
+    string name;
+    vector<ShardMember> members;
+    std::unordered_map<UserId, uint32_t> pos;   // uid -> index ใน members (ลบแบบ swap-remove)
+    TokenBucket bucket;
+    uint64_t version = 0;
+    time_t last_active = 0;
+    MemberSnapshot snap;                        // สำหรับ fan-out / WHO (สร้างใหม่เมื่อสมาชิกเปลี่ยน)
+    bool snap_valid = false;
+    PendingPresence presence;                   // presence ที่รอส่งตอนจบรอบ / ตาม --presence-window-ms
+    bool presence_queued = false;               // อยู่ใน Shard::presence_rooms แล้ว
+};
+
+struct ShardUser {
+    ClientInfo info;                 // (current_room อาจเป็นห้องของ shard อื่น)
+    SessionTimes times;
+    string room_name;
+    bool joining = false;            // รอ JOINED จาก shard ของห้อง
+    std::deque<MsgRef> parked;       // คำสั่งที่มาระหว่างรอ
+};
+
+// รายการ directory ส่วนของ shard หนึ่ง (ไม่เปลี่ยนหลัง publish: shard อื่นอ่านด้วย atomic_load)
+struct DirPart {
+    vector<std::pair<uint64_t, string>> items;
+};
+using DirPartPtr = std::shared_ptr<const DirPart>;
+
+// LIST / MEMBERS ที่รวมจากทุก shard แล้ว (ใช้ซ้ำได้ถ้า part ของทุก shard ยังเป็นตัวเดิม)
+struct DirView {
+    vector<DirPartPtr> parts;
+    RenderedPtr rendered;
+};
+
+struct Shard {
+    int index = 0;
+    int cpu = -1;      // -1 = ไม่ pin
+    thread worker;
+    Parker park;
+    SpscRing<MsgRef> ring;                                // main loop -> shard
+    vector<std::unique_ptr<SpscRing<ShardMsg>>> inbox;    // [from] shard อื่น -> shard นี้ (ของตัวเอง = nullptr)
+    SpscRing<uint32_t> freed;                             // ช่องของ msg_pool ที่ใช้เสร็จ (shard -> main loop)
+    DirPartPtr room_part, user_part;                      // (atomic_load / atomic_store)
+
+    // --- ด้านล่างนี้ thread ของ shard ใช้คนเดียว ---
+    vector<std::deque<ShardMsg>> outbox;                  // [to] ring ปลายทางเต็ม: ส่งรอบถัดไป
+    std::deque<ShardMsg> local;                           // งานที่ส่งถึงตัวเอง
+    uint64_t wake_mask = 0;                               // shard ที่ต้องปลุกตอนจบรอบ
+    bool wake_main = false;
+    SymbolTable user_names;
+    vector<ShardUser> users;
+    SymbolTable room_names;
+    vector<ShardRoom> rooms;
+    vector<uint32_t> presence_rooms;                      // ห้องที่มี presence รอส่ง
+    bool users_dirty = true, rooms_dirty = true;
+    uint64_t next_publish_ns = 0;
+    DirView list_view, members_view;
+    std::mt19937 rng{std::random_device{}()};             // generation เริ่มต้นของ slot
+    bool credit_pending = false;
+    uint64_t next_credit_ns = 0, next_presence_ns = 0;
+    time_t next_hb = 0, next_kick = 0, next_clean = 0;
+    string log;                                           // log ของรอบนี้ (เขียนครั้งเดียวตอนจบรอบ)
+    LatencyHistogram latency, latency_room;
+    uint64_t presence_events = 0, presence_notices = 0, presence_suppressed = 0;
+};
+vector<std::unique_ptr<Shard>> g_shards; // ว่าง = ใช้ worker pool ปกติ
+vector<uint32_t> g_main_free;            // (main loop เท่านั้น) ช่องว่างของ msg_pool ในโหมด shard
+Parker g_main_park;                      // main loop รอช่องที่ shard คืน
+
+inline uint32_t shard_id(int shard, uint32_t local) { return ((uint32_t)shard << SHARD_BITS) | local; }
+inline int shard_of_id(uint32_t id) { return (int)(id >> SHARD_BITS); }
+inline uint32_t local_of_id(uint32_t id) { return id & (SHARD_LOCAL_LIMIT - 1); }
+inline int shard_of_name(std::string_view name) {
+    return (int)(std::hash<std::string_view>{}(name) % g_shards.size());
+}
+
+// shard ที่รับข้อความนี้: REGISTER = shard ของชื่อ, คำสั่งอื่น = shard ใน token (token เสีย = 0: ถูกทิ้งที่นั่น)
+int shard_route(std::string_view msg) {
+    std::string_view rest(msg);
+    std::string_view cmd = next_field(rest);
+    std::string_view field = next_field(rest);
+    if (cmd == "REGISTER") return shard_of_name(next_field(rest));
+    UserId uid;
+    uint32_t generation;
+    if (!parse_token(field, uid, generation)) return 0;
+    return shard_of_id(uid) % (int)g_shards.size();
+}
+
+size_t shards_backlog() {
+    size_t total = 0;
+    for (const auto& sh : g_shards) total += sh->ring.size();
+    return total;
+}
+
+void pin_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc != 0) cerr << "[SHARD] Cannot pin to CPU " << cpu << ": " << strerror(rc) << endl;
+    else cout << "[SHARD] Worker pinned to CPU " << cpu << endl;
+}
+
+void shard_log(Shard& sh, std::initializer_list<std::string_view> parts) {
+    for (std::string_view p : parts) sh.log.append(p);
+}
+
+// --- ส่งงานไป shard อื่น (ring เต็ม = ต่อท้าย outbox ไว้ส่งรอบหน้า ลำดับไม่เปลี่ยน) ---
+void shard_send(Shard& sh, int to, ShardMsg&& m) {
+    if (to == sh.index) {
+        sh.local.push_back(std::move(m));
+        return;
+    }
+    std::deque<ShardMsg>& out = sh.outbox[to];
+    if (out.empty() && g_shards[to]->inbox[sh.index]->push(m)) {
+        sh.wake_mask |= 1ULL << to;
+        return;
+    }
+    out.push_back(std::move(m));
+}
+
+// คืนค่า true = ยังมีงานค้างใน outbox (ring ปลายทางเต็ม)
+bool shard_flush_outbox(Shard& sh) {
+    bool pending = false;
+    for (size_t to = 0; to < sh.outbox.size(); ++to) {
+        std::deque<ShardMsg>& out = sh.outbox[to];
+        if (out.empty()) continue;
+        SpscRing<ShardMsg>& ring = *g_shards[to]->inbox[sh.index];
+        while (!out.empty() && ring.push(out.front())) {
+            out.pop_front();
+            sh.wake_mask |= 1ULL << to;
+        }
+        if (!out.empty()) pending = true;
+    }
+    return pending;
+}
+
+// คืนช่องของ msg_pool ให้ main loop (ring ขนาดเท่าจำนวนช่อง: ไม่มีวันเต็ม)
+void shard_release(Shard& sh, uint32_t slot) {
+    sh.freed.push(slot);
+    sh.wake_main = true;
+}
+
+void shard_record(Shard& sh, uint64_t recv_ns, bool in_latency_room) {
+    uint64_t latency_us = (mono_ns() - recv_ns) / 1000;
+    sh.latency.record(latency_us);
+    if (in_latency_room) sh.latency_room.record(latency_us);
+}
+
+// session ของ shard นี้ที่ยังตรงกับ token (nullptr = ออกไปแล้ว / token เก่า)
+ShardUser* shard_user(Shard& sh, UserId uid, uint32_t generation) {
+    if (shard_of_id(uid) != sh.index || local_of_id(uid) >= sh.users.size()) return nullptr;
+    ShardUser& u = sh.users[local_of_id(uid)];
+    return (u.info.active && u.info.generation == generation) ? &u : nullptr;
+}
+
+ShardRoom* shard_room(Shard& sh, RoomId room) {
+    if (room == NO_ID || shard_of_id(room) != sh.index || local_of_id(room) >= sh.rooms.size()) return nullptr;
+    ShardRoom& r = sh.rooms[local_of_id(room)];
+    return r.active ? &r : nullptr;
+}
+
+// --- credit ของ user ใน shard (เหมือน return_credit() แต่ไม่ล็อค) ---
+void shard_return_credit(Shard& sh, ShardUser& u) {
+    ClientInfo& info = u.info;
+    if (!info.active || ++info.credits_owed < CREDIT_BATCH) return;
+    if (sh.ring.size() >= CREDIT_BACKLOG_LIMIT || info.credit_hold_until > mono_ns()) {
+        sh.credit_pending = true; // (คืนใน shard_flush_credits())
+        return;
+    }
+    int grant = info.credits_owed;
+    info.credits_owed = 0;
+    if (!send_credit(info.reply_queue, grant)) {
+        info.credits_owed += grant;
+        sh.credit_pending = true;
+    }
+}
+
+void shard_flush_credits(Shard& sh) {
+    sh.credit_pending = false;
+    uint64_t now = mono_ns();
+    for (ShardUser& u : sh.users) {
+        ClientInfo& info = u.info;
+        if (!info.active || info.credits_owed < CREDIT_BATCH) continue;
+        if (info.credit_hold_until > now) {
+            sh.credit_pending = true;
+            continue;
+        }
+        int grant = info.credits_owed;
+        info.credits_owed = 0;
+        if (!send_credit(info.reply_queue, grant)) {
+            info.credits_owed += grant;
+            sh.credit_pending = true;
+        }
+    }
+}
+
+// rate limit ของผู้ส่ง (CHAT / DM) false = เต็ม (ตอบ error แล้ว)
+bool shard_rate_user(ShardUser& u) {
+    if (g_user_limit.rate <= 0) return true;
+    uint64_t now = mono_ns();
+    if (!rate_ok(u.info.bucket, RS_USER, now)) {
+        send_reply(u.info.reply_queue, concat({"SYSTEM|Error: Rate limit exceeded (", RATE_SCOPE_NAMES[RS_USER], "). Message dropped."}));
+        return false;
+    }
+    uint64_t wait = 0;
+    rate_use(u.info.bucket, RS_USER, wait);
+    if (wait > 0) u.info.credit_hold_until = std::max(u.info.credit_hold_until, now + wait);
+    return true;
+}
+
+// --- สมาชิกห้องใน shard ---
+const MemberSnapshot& shard_snapshot(ShardRoom& r) {
+    if (r.snap_valid) return r.snap;
+    r.snap = MemberSnapshot{};
+    r.snap.version = r.version;
+    r.snap.room_name = r.name;
+    for (const ShardMember& m : r.members) add_member(r.snap, m.uid, m.name, m.queue);
+    r.snap_valid = true;
+    return r.snap;
+}
+
+void shard_broadcast(ShardRoom& r, UserId sender, std::string_view sender_name, std::string_view message) {
+    const MemberSnapshot& snap = shard_snapshot(r);
+    send_to_snapshot(snap, snap.ids.size(), sender, chat_frame(sender_name, message));
+}
+
+void shard_add_member(Shard& sh, ShardRoom& r, const ShardMsg& m) {
+    if (r.pos.count(m.uid)) return;
+    r.pos[m.uid] = (uint32_t)r.members.size();
+    r.members.push_back(ShardMember{m.uid, m.name, m.queue});
+    r.version++;
+    r.snap_valid = false;
+    sh.rooms_dirty = true;
+}
+
+bool shard_remove_member(Shard& sh, ShardRoom& r, UserId uid) {
+    auto it = r.pos.find(uid);
+    if (it == r.pos.end()) return false;
+    uint32_t pos = it->second;
+    r.pos.erase(it);
+    if (pos + 1 != r.members.size()) {
+        r.members[pos] = std::move(r.members.back());
+        r.pos[r.members[pos].uid] = pos;
+    }
+    r.members.pop_back();
+    r.version++;
+    r.snap_valid = false;
+    sh.rooms_dirty = true;
+    return true;
+}
+
+// --- presence ของห้องใน shard ---
+// ไม่มี --presence-window-ms: join / leave ส่งทันที ส่วน timeout / kick รวมเป็นห้องละข้อความตอนจบรอบ
+bool shard_presence_muted(const ShardRoom& r) {
+    return g_presence_max_room > 0 && r.members.size() > g_presence_max_room;
+}
+
+void shard_announce(Shard& sh, uint32_t local, std::string_view name, PresenceEvent ev) {
+    ShardRoom& r = sh.rooms[local];
+    sh.presence_events++;
+    if (g_presence_window_ms > 0 || ev == PE_TIMEOUT || ev == PE_KICKED) {
+        r.presence.add(name, ev);
+        if (!r.presence_queued) {
+            r.presence_queued = true;
+            sh.presence_rooms.push_back(local);
+        }
+        return;
+    }
+    if (shard_presence_muted(r)) {
+        sh.presence_suppressed++;
+        return;
+    }
+    sh.presence_notices++;
+    shard_broadcast(r, NO_ID, "SYSTEM", concat({name, PRESENCE_TEXT[ev]}));
+}
+
+void shard_flush_presence(Shard& sh) {
+    for (uint32_t local : sh.presence_rooms) {
+        ShardRoom& r = sh.rooms[local];
+        if (!r.presence_queued) continue; // (ห้องถูกลบไปแล้ว)
+        r.presence_queued = false;
+        PendingPresence p;
+        std::swap(p, r.presence);
+        if (p.empty()) continue;
+        if (shard_presence_muted(r)) {
+            sh.presence_suppressed += p.joined.size() + p.left.size();
+            continue;
+        }
+        ArenaScope scope;
+        auto send = [&](std::string_view text) {
+            sh.presence_notices++;
+            shard_broadcast(r, NO_ID, "SYSTEM", text);
+        };
+        if (g_presence_window_ms > 0) {
+            render_presence(p, send);
+            continue;
+        }
+        std::stable_sort(p.left.begin(), p.left.end(),
+                         [](const PresenceEntry& a, const PresenceEntry& b) { return a.ev < b.ev; });
+        for (size_t i = 0; i < p.left.size();) {
+            size_t j = i;
+            while (j < p.left.size() && p.left[j].ev == p.left[i].ev) ++j;
+            render_departures(p.left.begin() + i, p.left.begin() + j, p.left[i].ev, send);
+            i = j;
+        }
+    }
+    sh.presence_rooms.clear();
+}
+
+// --- ลบ user ของ shard นี้ (EXIT / timeout / kick) แจ้ง shard ของห้องด้วย LEAVE ---
+bool shard_evict(Shard& sh, uint32_t local, Evicted& out, PresenceEvent ev) {
+    ShardUser& u = sh.users[local];
+    if (!u.info.active) return false;
+    out.name = sh.user_names.name(local);
+    out.reply_queue = u.info.reply_queue;
+    out.room = u.info.current_room;
+    out.room_name = u.room_name;
+    if (out.room != NO_ID) {
+        ShardMsg m;
+        m.op = SO_LEAVE;
+        m.uid = shard_id(sh.index, local);
+        m.room = out.room;
+        m.ev = ev;
+        m.name = out.name;
+        shard_send(sh, shard_of_id(out.room), std::move(m));
+    }
+    for (const MsgRef& ref : u.parked) shard_release(sh, ref.slot); // (token ของ session นี้ใช้ไม่ได้แล้ว)
+    uint32_t next_generation = u.info.generation + 1;
+    u = ShardUser{};
+    u.info.generation = next_generation;
+    sh.user_names.release(local);
+    sh.users_dirty = true;
+    return true;
+}
+
+void shard_register(Shard& sh, std::string_view field, std::string_view username) {
+    if (!register_args_ok(field, username)) return;
+    AString reply_q(field, arena());
+    if (sh.user_names.find(username) != NO_ID) {
+        send_reply(reply_q, "SYSTEM|Error: Username already taken.");
+        return;
+    }
+    uint32_t local = sh.user_names.intern(username);
+    if (local >= SHARD_LOCAL_LIMIT) {
+        sh.user_names.release(local);
+        send_reply(reply_q, "SYSTEM|Error: Too many users.");
+        return;
+    }
+    if (local >= sh.users.size()) {
+        sh.users.resize(local + 1);
+        sh.users[local].info.generation = (uint32_t)sh.rng(); // slot ใหม่: เริ่ม generation แบบสุ่ม
+    }
+    ShardUser& u = sh.users[local];
+    u.info.active = true;
+    u.info.reply_queue.assign(reply_q.data(), reply_q.size());
+    u.times.last_seen = u.times.last_active = time(nullptr);
+    u.times.hb_advertised = g_hb_interval;
+    sh.users_dirty = true;
+    send_reply(reply_q, concat({"SESSION|", make_token(shard_id(sh.index, local), u.info.generation)}), 2);
+    send_reply(reply_q, concat({"SYSTEM|Welcome ", username, "! You are in the Lobby."}));
+    send_credit(reply_q, CREDIT_WINDOW);
+    shard_log(sh, {"[LOG] USER_REG: ", username, " registered (Q: ", reply_q, ")\n"});
+}
+
+// LIST / MEMBERS: รวม DirPart ของทุก shard เป็นหน้า (render ใหม่เมื่อ part ของ shard ใดเปลี่ยน)
+RenderedPtr shard_directory(DirPartPtr Shard::*part, DirView& view, const char* kind, const char* title) {
+    bool stale = !view.rendered;
+    view.parts.resize(g_shards.size());
+    for (size_t i = 0; i < g_shards.size(); ++i) {
+        DirPartPtr cur = std::atomic_load(&((*g_shards[i]).*part));
+        if (cur != view.parts[i]) {
+            view.parts[i] = std::move(cur);
+            stale = true;
+        }
+    }
+    if (!stale) return view.rendered;
+
+    auto fresh = std::make_shared<Rendered>();
+    PageBuilder pages(*fresh, kind, title);
+    for (const DirPartPtr& p : view.parts) {
+        if (!p) continue;
+        for (const auto& [key, item] : p->items) pages.add(key, item);
+    }
+    pages.finish();
+    view.rendered = std::move(fresh);
+    return view.rendered;
+}
+
+void shard_publish_directory(Shard& sh) {
+    if (sh.rooms_dirty) {
+        auto part = std::make_shared<DirPart>();
+        for (uint32_t local = 0; local < sh.rooms.size(); ++local) {
+            const ShardRoom& r = sh.rooms[local];
+            if (r.active) part->items.emplace_back(shard_id(sh.index, local), r.name + "(" + to_string(r.members.size()) + ") ");
+        }
+        std::atomic_store(&sh.room_part, DirPartPtr(std::move(part)));
+        sh.rooms_dirty = false;
+    }
+    if (sh.users_dirty) {
+        auto part = std::make_shared<DirPart>();
+        for (uint32_t local = 0; local < sh.users.size(); ++local) {
+            if (sh.users[local].info.active) part->items.emplace_back(shard_id(sh.index, local), sh.user_names.name(local) + " ");
+        }
+        std::atomic_store(&sh.user_part, DirPartPtr(std::move(part)));
+        sh.users_dirty = false;
+    }
+}
+
+// ผลของงานหนึ่งชิ้นจาก ring ขาเข้า
+enum TaskResult {
+    TR_DONE,      // เสร็จที่นี่: คืนช่อง + บันทึก latency
+    TR_RELEASE,   // คืนช่องได้ แต่งานยังไม่จบ (shard ปลายทางบันทึก latency)
+    TR_KEEP,      // ช่องยังใช้อยู่ (ส่งต่อพร้อมข้อความ / พักไว้)
+};
+
+TaskResult shard_process(Shard& sh, const MsgRef& task, std::string_view msg) {
+    std::string_view rest(msg);
+    std::string_view cmd = next_field(rest);
+    std::string_view field = next_field(rest);
+    if (cmd.empty() || field.empty()) return TR_DONE;
+    StatScope stat_scope(stat_cmd_of(cmd));
+
+    if (cmd == "REGISTER") {
+        shard_register(sh, field, next_field(rest));
+        return TR_DONE;
+    }
+
+    UserId uid;
+    uint32_t generation;
+    ShardUser* u = parse_token(field, uid, generation) ? shard_user(sh, uid, generation) : nullptr;
+    if (!u) {
+        shard_log(sh, {"[LOG] BAD_TOKEN: dropped ", cmd, " (token ", field, ")\n"});
+        return TR_DONE;
+    }
+    if (u->joining) { // (ทำต่อตามลำดับเมื่อได้ JOINED)
+        u->parked.push_back(task);
+        return TR_KEEP;
+    }
+    uint32_t local = local_of_id(uid);
+    AString username(sh.user_names.name(local), arena());
+    AString reply_q(u->info.reply_queue, arena());
+
+    // คืน credit เมื่อจบคำสั่ง (คำสั่งที่ส่งต่อ: คืนตอนได้ DONE / JOINED กลับมา)
+    bool uses_credit = (cmd != "PING" && cmd != "EXIT");
+    struct CreditReturn {
+        Shard& sh;
+        ShardUser* u;
+        ~CreditReturn() { if (u) shard_return_credit(sh, *u); }
+    } credit_return{sh, uses_credit ? u : nullptr};
+
+    if (cmd != "EXIT") {
+        time_t now = time(nullptr);
+        u->times.last_seen = now;
+        if (cmd != "PING") u->times.last_active = now;
+    }
+
+    if (task.shed) { // (main loop ตัดสินให้ทิ้งแล้ว ดู should_shed())
+        send_reply(reply_q, concat({"BUSY|", cmd, "|", num(++u->info.shed)}));
+        return TR_DONE;
+    }
+
+    if (cmd == "CREATE" || cmd == "JOIN") {
+        bool create = (cmd == "CREATE");
+        std::string_view room_name = next_field(rest);
+        if (create) {
+            if (!room_name.empty() && !valid_name(room_name)) {
+                send_reply(reply_q, "SYSTEM|Error: Invalid room name.");
+                return TR_DONE;
+            }
+            if (room_name.empty()) {
+                send_reply(reply_q, "SYSTEM|Error: Room already exists: ");
+                return TR_DONE;
+            }
+            if (u->info.current_room != NO_ID) {
+                send_reply(reply_q, "SYSTEM|Error: You must be in the Lobby to create a room.");
+                return TR_DONE;
             }
-            // ถ้าผ่านหมด
-            rooms[room_name] = Room{room_name};
-            clients[username].current_room = room_name;
-        } //! ปลดล็อค
+        } else if (u->info.current_room != NO_ID && room_name == u->room_name) { // (อยู่ห้องนี้แล้ว)
+            send_reply(reply_q, concat({"JOIN_SUCCESS|", room_name}));
+            shard_log(sh, {"[LOG] ROOM_JOIN: ", username, " joined room '", room_name, "'.\n"});
+            return TR_DONE;
+        }
+        ShardMsg m;
+        m.op = SO_JOIN;
+        m.uid = uid;
+        m.generation = generation;
+        m.create = create;
+        m.ref = task;
+        m.name = string(username);
+        m.queue = string(reply_q);
+        m.text = string(room_name);
+        shard_send(sh, shard_of_name(room_name), std::move(m));
+        u->joining = true;
+        credit_return.u = nullptr;
+        return TR_RELEASE;
+    }
 
-        {
-            lock_guard<mutex> lock(room_mutex);
-            room_last_active[room_name] = time(nullptr);
+    else if (cmd == "LIST") {
+        AString scratch(arena());
+        RenderedPtr list = shard_directory(&Shard::room_part, sh.list_view, "LIST", "Available Rooms: ");
+        send_reply(reply_q, page_at(*list, next_field(rest), "LIST||", scratch));
+        shard_log(sh, {"[LOG] USER_LIST: ", username, " requested room list.\n"});
+    }
+
+    // CHAT: ส่งช่องของข้อความไป shard ของห้อง (fan-out / rate limit ของห้อง / log ทำที่นั่น)
+    else if (cmd == "CHAT") {
+        if (u->info.current_room == NO_ID) {
+            send_reply(reply_q, "SYSTEM|Error: You must be in a room to chat.");
+            return TR_DONE;
         }
-        send_reply(reply_q, "JOIN_SUCCESS|" + room_name);
-        cout << "[LOG] ROOM_CREATE: " << username << " created and joined room '" << room_name << "'.\n";
+        if (!shard_rate_user(*u)) return TR_DONE;
+        ShardMsg m;
+        m.op = SO_CHAT;
+        m.uid = uid;
+        m.generation = generation;
+        m.room = u->info.current_room;
+        m.ref = task;
+        m.name = string(username);
+        m.queue = string(reply_q);
+        shard_send(sh, shard_of_id(m.room), std::move(m));
+        credit_return.u = nullptr;
+        return TR_KEEP;
     }
 
-    // --- ‼️ FIX 2: แก้ไขคำสั่ง JOIN ---
-    // --- 3. JOIN ---
-    else if (cmd == "JOIN" && parts.size() >= 4) {
-        string room_name = parts[2];
-        username = parts[3];
-        update_activity(username);
+    else if (cmd == "WHO") {
+        if (u->info.current_room == NO_ID) {
+            send_reply(reply_q, "SYSTEM|Error: You are in the Lobby.");
+            return TR_DONE;
+        }
+        ShardMsg m;
+        m.op = SO_WHO;
+        m.uid = uid;
+        m.generation = generation;
+        m.room = u->info.current_room;
+        m.ref = task;
+        m.name = string(username);
+        m.queue = string(reply_q);
+        m.text = string(next_field(rest));
+        shard_send(sh, shard_of_id(m.room), std::move(m));
+        credit_return.u = nullptr;
+        return TR_RELEASE;
+    }
 
-        { //! ล็อค 2 ชั้น (แก้ไขลำดับตามกฎ 1 -> 2)
-            lock_guard<mutex> lock1(clients_mutex); // 1. ล็อค clients ก่อน
-            lock_guard<mutex> lock2(rooms_mutex);   // 2. ล็อค rooms ทีหลัง
+    else if (cmd == "LEAVE") {
+        if (u->info.current_room == NO_ID) {
+            send_reply(reply_q, "SYSTEM|Error: You are already in the Lobby.");
+            return TR_DONE;
+        }
+        ShardMsg m;
+        m.op = SO_LEAVE;
+        m.uid = uid;
+        m.room = u->info.current_room;
+        m.ev = PE_LEFT;
+        m.name = string(username);
+        shard_send(sh, shard_of_id(m.room), std::move(m));
+        shard_log(sh, {"[LOG] ROOM_LEAVE: ", username, " left room '", u->room_name, "'.\n"});
+        u->info.current_room = NO_ID;
+        u->room_name.clear();
+        send_reply(reply_q, "JOIN_SUCCESS|");
+    }
 
-            // ตรวจสอบ User ก่อน (เพราะถือ lock1)
-            if (clients.count(username) == 0) {
-                send_reply(reply_q, "SYSTEM|Error: User not found.");
-                return;
-            }
-            // ตรวจสอบ Room (เพราะถือ lock2)
-            if (rooms.count(room_name) == 0) {
-                send_reply(reply_q, "SYSTEM|Error: Room not found.");
-                return;
-            }
-            clients[username].current_room = room_name;
-        } //! ปลดล็อค
+    // DM: ส่งช่องของข้อความไป shard ของผู้รับ (หาผู้รับและตอบทั้งสองฝั่งที่นั่น)
+    else if (cmd == "DM") {
+        std::string_view target = next_field(rest);
+        if (!shard_rate_user(*u)) return TR_DONE;
+        ShardMsg m;
+        m.op = SO_DM;
+        m.uid = uid;
+        m.generation = generation;
+        m.ref = task;
+        m.name = string(username);
+        m.queue = string(reply_q);
+        m.text = string(target);
+        shard_send(sh, shard_of_name(target), std::move(m));
+        credit_return.u = nullptr;
+        return TR_KEEP;
+    }
 
-        {
-            lock_guard<mutex> lock(room_mutex);
-            room_last_active[room_name] = time(nullptr);
+    else if (cmd == "EXIT") {
+        Evicted ev;
+        if (shard_evict(sh, local, ev, PE_DISCONNECTED)) {
+            if (!is_mux_queue(ev.reply_queue)) sys_mq_unlink(ev.reply_queue.c_str());
+            send_reply(ev.reply_queue, "SYSTEM|Goodbye!");
+            shard_log(sh, {"[LOG] USER_EXIT: ", ev.name, " disconnected (Room: ", ev.room_name, ").\n"});
         }
-        send_reply(reply_q, "JOIN_SUCCESS|" + room_name);
-        broadcast_to_room(room_name, "SYSTEM", username + " has joined.");
-        cout << "[LOG] ROOM_JOIN: " << username << " joined room '" << room_name << "'.\n";
     }
-    // --- ‼️ END FIX 2 ---
 
-    // --- 4. LIST ---
-    else if (cmd == "LIST" && parts.size() >= 3) {
-        username = parts[2];
-        update_activity(username);
-        string result = "LIST|Available Rooms: ";
+    else if (cmd == "PING") {
+        int hb = g_hb_interval;
+        if (u->times.hb_advertised != hb) {
+            u->times.hb_advertised = hb;
+            send_credit(reply_q, 0);
+        }
+    }
 
-        // --- (โค้ดส่วนนี้ OK: ล็อค 1, ปลดล็อค 1, ล็อค 2, ปลดล็อค 2) ---
-        map<string, int> counts;
-        {
-            lock_guard<mutex> lock(clients_mutex);
-            for (auto const& [name, info] : clients) {
-                if (!info.current_room.empty()) {
-                    counts[info.current_room]++;
-                }
-            }
-        } // ปลดล็อค clients_mutex
+    else if (cmd == "MEMBERS") {
+        AString scratch(arena());
+        RenderedPtr members = shard_directory(&Shard::user_part, sh.members_view, "MEMBERS", "Online users: ");
+        send_reply(reply_q, page_at(*members, next_field(rest), "MEMBERS||", scratch));
+    }
 
-        {
-            lock_guard<mutex> lock(rooms_mutex);
-            for (auto &r : rooms) {
-                result += r.first + "(" + to_string(counts[r.first]) + ") ";
-            }
-        } // ปลดล็อค rooms_mutex
-        // --- (END OK) ---
+    else if (cmd == "SYNC") {
+        send_reply(reply_q, "SYSTEM|Error: SYNC is not available in shard mode.");
+    }
 
-        send_reply(reply_q, result);
-        cout << "[LOG] USER_LIST: " << username << " requested room list.\n";
+    else if (cmd == "STATS") {
+        send_reply(reply_q, stats_summary());
     }
 
-    // --- 5. CHAT ---
-    else if (cmd == "CHAT" && parts.size() >= 5) {
-        string room_name = parts[2];
-        username = parts[3];
-        string message = parts[4];
-        update_activity(username);
+    else {
+        send_reply(reply_q, "SYSTEM|Unknown command or invalid format.");
+    }
+    return TR_DONE;
+}
 
-        bool can_chat = false;
-        { //! ล็อค (1)
-            lock_guard<mutex> lock(clients_mutex);
-            if (clients.count(username) && clients[username].current_room == room_name && !room_name.empty()) {
-                can_chat = true;
-            }
-        } //! ปลดล็อค
+// --- ประมวลผลงานหนึ่งชิ้นจาก ring ขาเข้า (หรือที่ถูกพักไว้) ---
+void shard_run(Shard& sh, const MsgRef& task) {
+    std::string_view msg(msg_pool.data(task.slot), task.len);
+    trace_begin(task);
+    TaskResult result = TR_DONE;
+    if (task.len > 0) {
+        ArenaScope scope;
+        result = shard_process(sh, task, msg);
+    }
+    if (result == TR_KEEP) { // (trace ต่อที่ปลายทาง / ตอนทำต่อ)
+        t_trace = 0;
+        return;
+    }
+    trace_end(msg);
+    shard_release(sh, task.slot);
+    if (result == TR_DONE) shard_record(sh, task.recv_ns, false);
+}
 
-        if (can_chat) {
-            broadcast_to_room(room_name, username, message); // (ใช้เวอร์ชันที่แก้แล้ว)
-            {
-                lock_guard<mutex> lock(room_mutex);
-                room_last_active[room_name] = time(nullptr);
-            }
-            cout << "[LOG] CHAT_MSG: (" << room_name << ") " << username << ": " << message << "\n";
+// --- ShardMsg: ฝั่ง shard ของห้อง ---
+void shard_on_join(Shard& sh, ShardMsg& m) {
+    uint32_t local = sh.room_names.find(m.text);
+    m.status = JS_OK;
+    if (m.create && local != NO_ID) {
+        m.status = JS_EXISTS;
+    } else if (!m.create && local == NO_ID) {
+        m.status = JS_NOT_FOUND;
+    } else if (m.create) {
+        local = sh.room_names.intern(m.text);
+        if (local >= SHARD_LOCAL_LIMIT) {
+            sh.room_names.release(local);
+            m.status = JS_FULL;
         } else {
-            send_reply(reply_q, "SYSTEM|Error: You must be in a room to chat.");
+            if (local >= sh.rooms.size()) sh.rooms.resize(local + 1);
+            ShardRoom& r = sh.rooms[local];
+            r.active = true;
+            r.name = m.text;
+            sh.rooms_dirty = true;
         }
     }
+    if (m.status == JS_OK) {
+        ShardRoom& r = sh.rooms[local];
+        shard_add_member(sh, r, m);
+        r.last_active = time(nullptr);
+        m.room = shard_id(sh.index, local);
+        send_reply(m.queue, concat({"JOIN_SUCCESS|", m.text})); // (ก่อน presence: ผู้เข้าเห็นตามลำดับเดิม)
+        if (!m.create) shard_announce(sh, local, m.name, PE_JOINED);
+    }
+    m.op = SO_JOINED;
+    shard_send(sh, shard_of_id(m.uid), std::move(m));
+}
 
-    // --- 6. WHO ---
-    else if (cmd == "WHO" && parts.size() >= 3) {
-        username = parts[2];
-        update_activity(username);
-        string room_name;
-        { //! ล็อค (1)
-            lock_guard<mutex> lock(clients_mutex);
-            if (clients.count(username) == 0) return;
-            room_name = clients[username].current_room;
-        } //! ปลดล็อค
+void shard_on_leave(Shard& sh, ShardMsg& m) {
+    ShardRoom* r = shard_room(sh, m.room);
+    if (!r || !shard_remove_member(sh, *r, m.uid)) return;
+    r->last_active = time(nullptr);
+    shard_announce(sh, local_of_id(m.room), m.name, m.ev);
+}
 
-        if (room_name.empty()) {
-            send_reply(reply_q, "SYSTEM|Error: You are in the Lobby.");
-            return;
-        }
+void shard_done(Shard& sh, const ShardMsg& m, uint64_t hold_until) {
+    ShardMsg done;
+    done.op = SO_DONE;
+    done.uid = m.uid;
+    done.generation = m.generation;
+    done.hold_until = hold_until;
+    shard_send(sh, shard_of_id(m.uid), std::move(done));
+}
 
-        string result = "SYSTEM|Users in " + room_name + ": ";
-        { //! ล็อค (1)
-            lock_guard<mutex> lock(clients_mutex);
-            for (auto const& [name, info] : clients) {
-                if (info.current_room == room_name) {
-                    result += name + " ";
-                }
-            }
-        } //! ปลดล็อค
-        send_reply(reply_q, result);
-        cout << "[LOG] USER_WHO: " << username << " listed members in " << room_name << ".\n";
+void shard_on_chat(Shard& sh, ShardMsg& m) {
+    StatScope stat_scope(SC_CHAT, false);
+    std::string_view msg(msg_pool.data(m.ref.slot), m.ref.len);
+    trace_begin(m.ref);
+    std::string_view message(msg);
+    next_field(message); // (ข้าม "CHAT|<token>|")
+    next_field(message);
+
+    ShardRoom* r = shard_room(sh, m.room);
+    bool in_latency_room = false;
+    uint64_t hold_until = 0;
+    if (!r || !r->pos.count(m.uid)) {
+        send_reply(m.queue, "SYSTEM|Error: You must be in a room to chat.");
+    } else {
+        uint64_t now = (g_room_limit.rate > 0) ? mono_ns() : 0;
+        if (!rate_ok(r->bucket, RS_ROOM, now)) {
+            send_reply(m.queue, concat({"SYSTEM|Error: Rate limit exceeded (", RATE_SCOPE_NAMES[RS_ROOM], "). Message dropped."}));
+        } else {
+            uint64_t wait = 0;
+            rate_use(r->bucket, RS_ROOM, wait);
+            if (wait > 0) hold_until = now + wait;
+            shard_broadcast(*r, m.uid, m.name, message);
+            r->last_active = time(nullptr);
+            shard_log(sh, {"[LOG] CHAT_MSG: (", r->name, ") ", m.name, ": ", message, "\n"});
+            in_latency_room = !g_latency_room_name.empty() && r->name == g_latency_room_name;
+        }
     }
+    trace_end(msg);
+    shard_release(sh, m.ref.slot);
+    shard_record(sh, m.ref.recv_ns, in_latency_room);
+    shard_done(sh, m, hold_until);
+}
 
-    // --- 7. LEAVE ---
-    else if (cmd == "LEAVE" && parts.size() >= 3) {
-        username = parts[2];
-        update_activity(username);
-        string old_room;
-        { //! ล็อค (1)
-            lock_guard<mutex> lock(clients_mutex);
-            if (clients.count(username) == 0 || clients[username].current_room.empty()) {
-                send_reply(reply_q, "SYSTEM|Error: You are already in the Lobby.");
-                return;
-            }
-            old_room = clients[username].current_room;
-            clients[username].current_room = "";
-        } //! ปลดล็อค
+void shard_on_who(Shard& sh, ShardMsg& m) {
+    StatScope stat_scope(SC_WHO, false);
+    ShardRoom* r = shard_room(sh, m.room);
+    if (!r) {
+        send_reply(m.queue, "SYSTEM|Error: You are in the Lobby.");
+    } else {
+        RenderedPtr who = render_who(shard_snapshot(*r));
+        AString scratch(arena());
+        send_reply(m.queue, page_at(*who, m.text, "WHO||", scratch));
+        shard_log(sh, {"[LOG] USER_WHO: ", m.name, " listed members in ", r->name, ".\n"});
+    }
+    shard_record(sh, m.ref.recv_ns, false);
+    shard_done(sh, m, 0);
+}
 
-        // --- ‼️ FIX: ย้าย room_mutex มาไว้หลังสุด ‼️ ---
+// --- ShardMsg: ฝั่ง shard ของผู้รับ DM ---
+void shard_on_dm(Shard& sh, ShardMsg& m) {
+    StatScope stat_scope(SC_DM, false);
+    std::string_view msg(msg_pool.data(m.ref.slot), m.ref.len);
+    trace_begin(m.ref);
+    std::string_view message(msg);
+    next_field(message); // (ข้าม "DM|<token>|<ผู้รับ>|")
+    next_field(message);
+    next_field(message);
 
-        send_reply(reply_q, "JOIN_SUCCESS|");
-        broadcast_to_room(old_room, "SYSTEM", username + " has left the room."); // (ล็อค 1 -> 2)
-        cout << "[LOG] ROOM_LEAVE: " << username << " left room '" << old_room << "'.\n";
+    uint32_t local = sh.user_names.find(m.text);
+    if (local != NO_ID && sh.users[local].info.active) {
+        send_reply(sh.users[local].info.reply_queue, concat({"DM|", m.name, " (DM): ", message}));
+        send_reply(m.queue, concat({"SYSTEM|DM sent to ", m.text, "."}));
+        shard_log(sh, {"[LOG] USER_DM: ", m.name, " sent DM to ", m.text, ".\n"});
+    } else {
+        send_reply(m.queue, concat({"SYSTEM|Error: User ", m.text, " not found."}));
+    }
+    trace_end(msg);
+    shard_release(sh, m.ref.slot);
+    shard_record(sh, m.ref.recv_ns, false);
+    shard_done(sh, m, 0);
+}
 
-        // ย้ายมาไว้ตรงนี้ (ล็อค 3)
-        // (ต้องเช็คด้วยว่า old_room ไม่ใช่ค่าว่าง)
-        if (!old_room.empty()) {
-            {
-                lock_guard<mutex> lock(room_mutex);
-                room_last_active[old_room] = time(nullptr);
-            }
+// --- ShardMsg: ฝั่ง shard ของ user ---
+void shard_on_joined(Shard& sh, ShardMsg& m) {
+    ShardUser* u = shard_user(sh, m.uid, m.generation);
+    if (!u) { // user ออกไประหว่างรอ: เอาออกจากห้องที่เพิ่งเข้า
+        if (m.status != JS_OK) return;
+        ShardMsg leave;
+        leave.op = SO_LEAVE;
+        leave.uid = m.uid;
+        leave.room = m.room;
+        leave.ev = PE_DISCONNECTED;
+        leave.name = m.name;
+        shard_send(sh, shard_of_id(m.room), std::move(leave));
+        return;
+    }
+    u->joining = false;
+    switch (m.status) {
+    case JS_OK:
+        if (u->info.current_room != NO_ID) {
+            ShardMsg leave;
+            leave.op = SO_LEAVE;
+            leave.uid = m.uid;
+            leave.room = u->info.current_room;
+            leave.ev = PE_LEFT;
+            leave.name = m.name;
+            shard_send(sh, shard_of_id(leave.room), std::move(leave));
         }
-        // --- ‼️ END FIX ‼️ ---
+        u->info.current_room = m.room;
+        u->room_name = m.text;
+        if (m.create) shard_log(sh, {"[LOG] ROOM_CREATE: ", m.name, " created and joined room '", m.text, "'.\n"});
+        else shard_log(sh, {"[LOG] ROOM_JOIN: ", m.name, " joined room '", m.text, "'.\n"});
+        break;
+    case JS_NOT_FOUND:
+        send_reply(m.queue, "SYSTEM|Error: Room not found.");
+        break;
+    case JS_EXISTS:
+        send_reply(m.queue, concat({"SYSTEM|Error: Room already exists: ", m.text}));
+        break;
+    case JS_FULL:
+        send_reply(m.queue, "SYSTEM|Error: Too many rooms.");
+        break;
     }
+    shard_return_credit(sh, *u);
+    shard_record(sh, m.ref.recv_ns, false);
 
-    // --- 8. DM ---
-    else if (cmd == "DM" && parts.size() >= 5) {
-        string target = parts[2];
-        string sender = parts[3];
-        string message = parts[4];
-        update_activity(sender);
+    // คำสั่งที่พักไว้ระหว่างรอ: ทำต่อตามลำดับ (หยุดถ้าเจอ JOIN อีก / user ออกไปแล้ว)
+    while (!u->joining && !u->parked.empty()) {
+        MsgRef next = u->parked.front();
+        u->parked.pop_front();
+        shard_run(sh, next);
+    }
+}
 
-        string target_q;
-        bool found = false;
-        { //! ล็อค (1)
-            lock_guard<mutex> lock(clients_mutex);
-            if (clients.count(target)) {
-                target_q = clients[target].reply_queue;
-                found = true;
-            }
-        } //! ปลดล็อค
+void shard_on_done(Shard& sh, ShardMsg& m) {
+    ShardUser* u = shard_user(sh, m.uid, m.generation);
+    if (!u) return;
+    u->info.credit_hold_until = std::max(u->info.credit_hold_until, m.hold_until);
+    shard_return_credit(sh, *u);
+}
 
-        if (found) {
-            send_reply(target_q, "DM|" + sender + " (DM): " + message);
-            send_reply(reply_q, "SYSTEM|DM sent to " + target + ".");
-            cout << "[LOG] USER_DM: " << sender << " sent DM to " << target << ".\n";
-        } else {
-            send_reply(reply_q, "SYSTEM|Error: User " + target + " not found.");
-        }
+void shard_handle(Shard& sh, ShardMsg& m) {
+    ArenaScope scope;
+    switch (m.op) {
+    case SO_JOIN:   shard_on_join(sh, m); break;
+    case SO_JOINED: shard_on_joined(sh, m); break;
+    case SO_LEAVE:  shard_on_leave(sh, m); break;
+    case SO_CHAT:   shard_on_chat(sh, m); break;
+    case SO_DM:     shard_on_dm(sh, m); break;
+    case SO_WHO:    shard_on_who(sh, m); break;
+    case SO_DONE:   shard_on_done(sh, m); break;
     }
+}
 
-    // --- 9. EXIT ---
-    else if (cmd == "EXIT" && parts.size() >= 3) {
-        username = parts[2];
-        string old_room, user_reply_q;
-        bool found = false;
-        { //! ล็อค (1)
-            lock_guard<mutex> lock(clients_mutex);
-            if (clients.count(username) == 0) return;
-            old_room = clients[username].current_room;
-            user_reply_q = clients[username].reply_queue;
-            clients.erase(username); // ลบ client ออกจากระบบ
-            found = true;
-        } //! ปลดล็อค
-
-        if (found) {
-            mq_unlink(user_reply_q.c_str()); // ลบคิวของ client (ย้ายมานอก lock)
-            broadcast_to_room(old_room, "SYSTEM", username + " has disconnected.");
-            send_reply(user_reply_q, "SYSTEM|Goodbye!");
-            if (!old_room.empty()) {
-                lock_guard<mutex> lock(room_mutex);
-                room_last_active[old_room] = time(nullptr);
-            }
-            cout << "[LOG] USER_EXIT: " << username << " disconnected (Room: " << old_room << ").\n";
+// --- timer ของ shard: heartbeat timeout (PE_TIMEOUT) / เตะคนที่ไม่ทำอะไรเกิน 60 วินาที (PE_KICKED) ---
+void shard_expire(Shard& sh, time_t now, PresenceEvent ev) {
+    double timeout = (ev == PE_TIMEOUT) ? HB_TIMEOUT_FACTOR * g_hb_timeout_basis : 60;
+    vector<Evicted> gone;
+    for (uint32_t local = 0; local < sh.users.size(); ++local) {
+        const ShardUser& u = sh.users[local];
+        if (!u.info.active) continue;
+        time_t last = (ev == PE_TIMEOUT) ? u.times.last_seen : u.times.last_active;
+        if (difftime(now, last) <= timeout) continue;
+        Evicted e;
+        if (!shard_evict(sh, local, e, ev)) continue;
+        if (ev == PE_TIMEOUT) {
+            shard_log(sh, {"[HB] ", e.name, " timed out (no heartbeat).\n"});
+        } else {
+            send_reply(e.reply_queue, "SYSTEM|You were disconnected due to inactivity.");
+            shard_log(sh, {"[INACTIVE KICK] ", e.name, " disconnected (idle > 60s)\n"});
         }
+        gone.push_back(std::move(e));
     }
+    reap_queues(gone);
+}
 
-    // --- 10. PING ---
-    else if (cmd == "PING" && parts.size() >= 3) {
-        username = parts[2];
-        lock_guard<mutex> lock(hb_mutex);
-        last_heartbeat[username] = time(nullptr);
+void shard_clean_rooms(Shard& sh, time_t now) {
+    for (uint32_t local = 0; local < sh.rooms.size(); ++local) {
+        ShardRoom& r = sh.rooms[local];
+        if (!r.active || !r.members.empty() || difftime(now, r.last_active) <= 60) continue;
+        shard_log(sh, {"[ROOM CLEANUP] Room '", r.name, "' deleted (idle > 60s)\n"});
+        r = ShardRoom{};
+        sh.room_names.release(local);
+        sh.rooms_dirty = true;
     }
+}
 
-    // --- 11. MEMBERS ---
-    else if (cmd == "MEMBERS") {
-        string result = "SYSTEM|Online users: ";
-        { //! ล็อค (1)
-            lock_guard<mutex> lock(clients_mutex);
-            for (auto &[name, _] : clients) result += name + " ";
-        } //! ปลดล็อค
-        send_reply(reply_q, result);
+void shard_tick(Shard& sh) {
+    uint64_t now_ns = mono_ns();
+    if (sh.credit_pending && now_ns >= sh.next_credit_ns && sh.ring.size() < CREDIT_BACKLOG_LIMIT) {
+        sh.next_credit_ns = now_ns + 100000000ULL; // (ไม่ scan ถี่กว่า 10 ครั้ง/วินาที เหมือน flush_credits())
+        shard_flush_credits(sh);
+    }
+    if (g_presence_window_ms > 0 && now_ns >= sh.next_presence_ns) {
+        sh.next_presence_ns = now_ns + (uint64_t)g_presence_window_ms * 1000000ULL;
+        shard_flush_presence(sh);
+    }
+    time_t now = time(nullptr);
+    if (now >= sh.next_hb) {
+        sh.next_hb = now + 5;
+        shard_expire(sh, now, PE_TIMEOUT);
+    }
+    if (now >= sh.next_kick) {
+        sh.next_kick = now + 15;
+        shard_expire(sh, now, PE_KICKED);
     }
+    if (now >= sh.next_clean) {
+        sh.next_clean = now + 30;
+        shard_clean_rooms(sh, now);
+    }
+}
 
-    else {
-        send_reply(reply_q, "SYSTEM|Unknown command or invalid format.");
+bool shard_has_work(const Shard& sh) {
+    if (!sh.ring.empty() || !sh.local.empty()) return true;
+    for (const auto& in : sh.inbox) {
+        if (in && !in->empty()) return true;
     }
+    return false;
 }
 
-// --- ฟังก์ชันที่ Worker Thread แต่ละตัวจะรัน ---
-void worker_thread() {
-    while (g_server_running) {
-        string task;
-        {
-            unique_lock<mutex> lock(queue_mutex);
-            queue_cond.wait(lock, [&]{ return !task_queue.empty() || !g_server_running; });
+void shard_thread(Shard* shard) {
+    Shard& sh = *shard;
+    stat_thread_name("shard");
+    if (sh.cpu >= 0) pin_to_cpu(sh.cpu);
+    time_t start = time(nullptr);
+    sh.next_hb = start + 5;
+    sh.next_kick = start + 15;
+    sh.next_clean = start + 30;
 
-            if (!g_server_running && task_queue.empty()) {
-                break;
+    while (true) {
+        bool busy = false;
+        MsgRef task;
+        for (int i = 0; i < SHARD_BATCH && sh.ring.pop(task); ++i) {
+            shard_run(sh, task);
+            busy = true;
+        }
+        for (auto& in : sh.inbox) {
+            if (!in) continue;
+            ShardMsg m;
+            for (int i = 0; i < SHARD_BATCH && in->pop(m); ++i) {
+                shard_handle(sh, m);
+                busy = true;
+            }
+        }
+        while (!sh.local.empty()) {
+            ShardMsg m = std::move(sh.local.front());
+            sh.local.pop_front();
+            shard_handle(sh, m);
+            busy = true;
+        }
+
+        // จบรอบ: timer, presence ที่รวมไว้, directory, แล้วค่อยปลุก shard อื่น / main loop ครั้งเดียว
+        shard_tick(sh);
+        if (g_presence_window_ms <= 0 && !sh.presence_rooms.empty()) shard_flush_presence(sh);
+        bool dirty = sh.rooms_dirty || sh.users_dirty;
+        if (dirty && mono_ns() >= sh.next_publish_ns) {
+            shard_publish_directory(sh);
+            sh.next_publish_ns = mono_ns() + SHARD_PUBLISH_MS * 1000000ULL;
+            dirty = false;
+        }
+        bool backlog = shard_flush_outbox(sh);
+        for (uint64_t mask = sh.wake_mask; mask != 0; mask &= mask - 1) {
+            g_shards[__builtin_ctzll(mask)]->park.wake();
+        }
+        sh.wake_mask = 0;
+        if (sh.wake_main) {
+            sh.wake_main = false;
+            g_main_park.wake();
+        }
+        if (!sh.log.empty()) {
+            fwrite(sh.log.data(), 1, sh.log.size(), stdout);
+            sh.log.clear();
+        }
+
+        if (busy) continue;
+        if (!g_server_running && sh.ring.empty()) break; // ring ว่างแล้วและ server กำลังปิด
+        sh.park.wait([&]{ return shard_has_work(sh); }, backlog ? 1 : (dirty ? SHARD_PUBLISH_MS : 100));
+    }
+}
+
+// main loop: ช่องว่างของ msg_pool (shard คืนผ่าน ring freed ของตัวเอง ไม่ใช้ pool_mutex)
+// คืนค่า false = server กำลังปิด
+bool shard_acquire(uint32_t& slot) {
+    while (g_main_free.empty()) {
+        for (auto& sh : g_shards) {
+            uint32_t s;
+            while (sh->freed.pop(s)) g_main_free.push_back(s);
+        }
+        if (!g_main_free.empty()) break;
+        if (!g_server_running) return false;
+        g_main_park.wait([]{
+            for (const auto& sh : g_shards) {
+                if (!sh->freed.empty()) return true;
             }
+            return false;
+        }, 100);
+    }
+    slot = g_main_free.back();
+    g_main_free.pop_back();
+    return true;
+}
 
-            task = task_queue.front();
-            task_queue.pop();
+// CPU ของแต่ละ shard: --cpus=0,2,4 (วนซ้ำถ้าน้อยกว่าจำนวน shard), --cpus=none = ไม่ pin
+// ค่าเริ่มต้น shard i -> CPU (i % จำนวน CPU)
+vector<int> shard_cpus(int shards) {
+    vector<int> cpus;
+    auto it = g_options.find("cpus");
+    if (it != g_options.end() && it->second == "none") return vector<int>(shards, -1);
+    if (it != g_options.end()) {
+        std::string_view rest(it->second);
+        while (!rest.empty()) {
+            size_t comma = rest.find(',');
+            std::string_view item = rest.substr(0, comma);
+            rest = (comma == std::string_view::npos) ? std::string_view() : rest.substr(comma + 1);
+            int cpu = 0;
+            auto res = std::from_chars(item.data(), item.data() + item.size(), cpu);
+            if (res.ec == std::errc() && cpu >= 0) cpus.push_back(cpu);
+            else cerr << "[ERROR] Ignoring invalid CPU in --cpus: " << item << endl;
         }
+    }
+    if (cpus.empty()) {
+        int ncpu = (int)std::max(1u, std::thread::hardware_concurrency());
+        for (int i = 0; i < ncpu; ++i) cpus.push_back(i);
+    }
+    vector<int> out(shards);
+    for (int i = 0; i < shards; ++i) out[i] = cpus[i % cpus.size()];
+    return out;
+}
 
-        if (!task.empty()) {
-            process_message(task);
+// --- พิมพ์สรุป latency ตอนปิด server (room ว่าง = ทุกข้อความ) ---
+void print_latency(const char* scheduler, const char* room, const LatencyHistogram& h) {
+    if (h.total() == 0) return;
+    printf("[LATENCY] scheduler=%s%s%s n=%llu p50<=%lluus p90<=%lluus p99<=%lluus p99.9<=%lluus max=%lluus\n",
+           scheduler, room[0] ? " room=" : "", room, (unsigned long long)h.total(),
+           (unsigned long long)h.percentile(0.50), (unsigned long long)h.percentile(0.90),
+           (unsigned long long)h.percentile(0.99), (unsigned long long)h.percentile(0.999),
+           (unsigned long long)h.max_us.load());
+    fflush(stdout);
+}
+
+// --- อ่าน --room-weights=<ห้อง>:<w>,<ห้อง>:<w> ---
+void parse_room_weights(const string& spec) {
+    size_t start = 0;
+    while (start < spec.size()) {
+        size_t end = spec.find(',', start);
+        if (end == string::npos) end = spec.size();
+        string item = spec.substr(start, end - start);
+        size_t colon = item.rfind(':');
+        int weight = (colon == string::npos) ? 0 : atoi(item.c_str() + colon + 1);
+        if (colon == string::npos || colon == 0 || weight < 1) {
+            cerr << "[ERROR] Ignoring invalid room weight: " << item << endl;
+        } else {
+            g_room_weight_config[item.substr(0, colon)] = weight;
         }
+        start = end + 1;
     }
 }
 
@@ -481,11 +4139,88 @@ int main(int argc, char* argv[]) {
         }
     } else {
         cout << "[Warning] No thread count specified. Defaulting to 1." << endl;
-        cout << "Usage: ./server <NumThreads>" << endl;
+        cout << "Usage: ./server <NumThreads> [--key=value ...] (see README)" << endl;
+    }
+
+    // --- Options เพิ่มเติม (--key=value) ---
+    for (int i = 2; i < argc; ++i) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (arg.rfind("--", 0) != 0 || eq == string::npos) {
+            cerr << "[ERROR] Ignoring invalid option: " << arg << endl;
+            continue;
+        }
+        g_options[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+    }
+    g_hb_base = std::max(1, opt_int("hb-interval", 5));
+    g_hb_max = std::max(g_hb_base, opt_int("hb-max", 60));
+    g_hb_interval = g_hb_base;
+    g_hb_timeout_basis = g_hb_base;
+    if (g_options.count("latency-room")) g_latency_room_name = g_options["latency-room"];
+
+    // --- tracing (จองบัฟเฟอร์เฉพาะตอนเปิด) ---
+    g_trace_sample = (uint32_t)std::max(0, opt_int("trace-sample", 0));
+    if (g_trace_sample > 0) {
+        g_trace_cap = (size_t)std::max(1024, opt_int("trace-buffer", 65536));
+        g_trace_buf.reset(new TraceEvent[g_trace_cap]);
+        if (g_options.count("trace-file")) g_trace_file = g_options["trace-file"];
+        cout << "[TRACE] Tracing 1 in " << g_trace_sample << " messages (" << g_trace_cap
+             << " events, kill -USR2 " << getpid() << " to write " << g_trace_file << ")" << endl;
+    }
+
+    // --- จองช่องรับข้อความล่วงหน้า (ค่าเริ่มต้น 4096 ช่อง x 1 KiB = 4 MiB) ---
+    size_t pool_slots = (size_t)std::max(16, opt_int("pool-slots", 4096));
+    msg_pool.init(pool_slots);
+    task_queue.init(pool_slots);
+    g_drr.init(pool_slots);
+
+    // --- rate limit (burst ค่าเริ่มต้น = 1 วินาทีของ rate อย่างน้อย 1) ---
+    g_user_limit.rate = std::max(0, opt_int("user-rate", 0));
+    g_user_limit.burst = std::max(1, opt_int("user-burst", std::max(1, (int)g_user_limit.rate)));
+    g_room_limit.rate = std::max(0, opt_int("room-rate", 0));
+    g_room_limit.burst = std::max(1, opt_int("room-burst", std::max(1, (int)g_room_limit.rate)));
+    g_presence_window_ms = std::max(0, opt_int("presence-window-ms", 0));
+    g_dir_push_ms = std::max(10, opt_int("dir-push-ms", 250));
+    g_presence_max_room = (size_t)std::max(0, opt_int("presence-max-room", 0));
+    string rate_mode = g_options.count("rate-mode") ? g_options["rate-mode"] : "reject";
+    g_rate_delay = (rate_mode == "delay");
+    if (!g_rate_delay && rate_mode != "reject") {
+        cerr << "[ERROR] Unknown rate mode '" << rate_mode << "'. Using reject." << endl;
     }
+    if (g_user_limit.rate > 0 || g_room_limit.rate > 0) {
+        cout << "[RATE] user " << g_user_limit.rate << "/s (burst " << g_user_limit.burst << "), room "
+             << g_room_limit.rate << "/s (burst " << g_room_limit.burst << "), mode " << rate_mode
+             << " (0 = off)" << endl;
+    }
+
+    // --- watermark ของ admission control (high ต้องเหลือช่องใน pool ให้คำสั่งที่รับเสมอ) ---
+    g_shed_high = (size_t)std::max(2, opt_int("shed-high", (int)(pool_slots / 2)));
+    g_shed_high = std::min(g_shed_high, pool_slots - pool_slots / 8);
+    g_shed_low = (size_t)std::max(0, opt_int("shed-low", (int)(g_shed_high / 2)));
+    g_shed_low = std::min(g_shed_low, g_shed_high - 1);
 
-    signal(SIGINT, handle_sigint);
-    signal(SIGTERM, handle_sigint);
+    // ไม่ใส่ SA_RESTART: mq_receive ของ main loop หลุดด้วย EINTR ถ้าสัญญาณมาที่ main thread
+    struct sigaction sa{};
+    sa.sa_handler = handle_sigint;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    signal(SIGUSR2, handle_sigusr2);
+#ifdef CHAT_LOCK_PROFILE
+    signal(SIGUSR1, handle_sigusr1);
+#endif
+    lock_name(clients_mutex, "clients_mutex");
+    lock_name(rooms_mutex, "rooms_mutex");
+    lock_name(room_mutex, "room_mutex");
+    lock_name(hb_mutex, "hb_mutex");
+    lock_name(queue_mutex, "queue_mutex");
+    lock_name(steal_mutex, "steal_mutex");
+    lock_name(pool_mutex, "pool_mutex");
+    lock_name(msg_pool.pool_mutex, "msg_pool.pool_mutex");
+    lock_name(reaper_mutex, "reaper_mutex");
+    lock_name(presence_mutex, "presence_mutex");
+    lock_name(dir_mutex, "dir_mutex");
+    lock_name(g_main_park.park_mutex, "park_mutex"); // (ทุก Parker ใช้ชื่อเดียวกัน: ที่หลับของ shard / main loop)
 
     // --- ตั้งค่า Message Queue ---
     struct mq_attr attr{};
@@ -500,102 +4235,209 @@ int main(int argc, char* argv[]) {
         perror("mq_open server");
         return 1;
     }
+    g_stop_mq = mq_open(CONTROL_QUEUE, O_WRONLY | O_NONBLOCK);
 
-    // --- 1. สร้าง Worker Threads ---
-    cout << "[Server] Starting " << num_threads << " worker threads..." << endl;
+    stat_thread_name("main");
+
+    // --- 1. สร้าง Worker Threads (หรือ shard ถ้าใช้ --shards=N) ---
     vector<thread> workers;
-    for (int i = 0; i < num_threads; ++i) {
-        workers.push_back(thread(worker_thread));
+    int num_shards = std::max(0, opt_int("shards", 0));
+    if (num_shards > MAX_SHARDS) {
+        cerr << "[ERROR] --shards is limited to " << MAX_SHARDS << ". Using " << MAX_SHARDS << "." << endl;
+        num_shards = MAX_SHARDS;
+    }
+    if (num_shards > 0) {
+        vector<int> cpus = shard_cpus(num_shards);
+        cout << "[Server] Starting " << num_shards << " shards (thread-per-core, NumThreads ignored)..." << endl;
+        for (int i = 0; i < num_shards; ++i) {
+            g_shards.push_back(std::make_unique<Shard>());
+            Shard& sh = *g_shards[i];
+            sh.index = i;
+            sh.cpu = cpus[i];
+            sh.ring.init(pool_slots);
+            sh.freed.init(pool_slots);
+            sh.room_part = sh.user_part = std::make_shared<DirPart>();
+            sh.outbox.resize(num_shards);
+            sh.inbox.resize(num_shards);
+            for (int from = 0; from < num_shards; ++from) {
+                if (from == i) continue;
+                sh.inbox[from] = std::make_unique<SpscRing<ShardMsg>>();
+                sh.inbox[from]->init(SHARD_RING);
+            }
+        }
+        g_main_free.swap(msg_pool.free_slots); // (ช่องของ pool หมุนระหว่าง main loop กับ shard ผ่าน ring freed)
+        for (auto& sh : g_shards) {
+            sh->worker = thread(shard_thread, sh.get());
+        }
+    } else {
+        string scheduler = g_options.count("scheduler") ? g_options["scheduler"] : "fifo";
+        g_steal_mode = (scheduler == "steal");
+        g_drr_mode = (scheduler == "drr");
+        if (!g_steal_mode && !g_drr_mode && scheduler != "fifo") {
+            cerr << "[ERROR] Unknown scheduler '" << scheduler << "'. Using fifo." << endl;
+            scheduler = "fifo";
+        }
+        if (g_options.count("room-weights")) parse_room_weights(g_options["room-weights"]);
+        g_fanout_chunk = (size_t)std::max(1, opt_int("fanout-chunk", 64));
+        if (g_steal_mode && (g_options.count("min-threads") || g_options.count("max-threads"))) {
+            cerr << "[ERROR] --min-threads / --max-threads only apply to --scheduler=fifo / drr. Ignoring." << endl;
+        } else if (!g_steal_mode) {
+            // NumThreads = ขนาดเริ่มต้น และเป็นค่าเริ่มต้นของทั้งสองขอบ (ไม่ระบุ = ขนาดคงที่แบบเดิม)
+            g_pool_min = std::max(1, opt_int("min-threads", num_threads));
+            g_pool_max = std::max(g_pool_min, opt_int("max-threads", std::max(num_threads, g_pool_min)));
+            g_pool_latency_us = (uint64_t)std::max(1, opt_int("pool-latency-us", 5000));
+            num_threads = std::min(std::max(num_threads, g_pool_min), g_pool_max);
+        }
+        cout << "[Server] Starting " << num_threads << " worker threads (scheduler: " << scheduler << ")..." << endl;
+        if (g_steal_mode) {
+            for (int i = 0; i < num_threads; ++i) {
+                g_deques.push_back(std::make_unique<WorkerDeque>());
+            }
+            for (int i = 0; i < num_threads; ++i) {
+                workers.push_back(thread(steal_worker_thread, i));
+            }
+        } else {
+            if (g_pool_min < g_pool_max) {
+                cout << "[POOL] Adaptive pool: " << g_pool_min << ".." << g_pool_max << " workers, p99 target "
+                     << g_pool_latency_us << "us" << endl;
+            }
+            g_pool_target = num_threads;
+            g_pool_live = num_threads;
+            lock_guard<mutex> lock(pool_mutex);
+            for (int i = 0; i < num_threads; ++i) pool_spawn_locked();
+        }
     }
 
     cout << "[Server] Started. Waiting for clients...\n";
 
     // --- 2. สร้าง Maintenance Threads ---
 
+    thread reaper(reaper_thread); // (join ตอนปิด server ให้ลบคิวที่ค้างให้หมดก่อน)
+
+    thread dir_pusher([](){
+        stat_thread_name("dir-push");
+        while (g_server_running) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(g_dir_push_ms));
+            dir_push();
+        }
+    });
+    dir_pusher.detach();
+
+    if (g_presence_window_ms > 0 && g_shards.empty()) { // (shard ส่ง presence ของห้องตัวเอง)
+        thread presence_flusher([](){
+            stat_thread_name("presence");
+            while (g_server_running) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(g_presence_window_ms));
+                presence_flush();
+            }
+        });
+        presence_flusher.detach();
+    }
+
     // --- ‼️ FIX 3: แก้ไข Heartbeat Monitor (ลดขอบเขตการล็อค) ---
     thread monitor([](){
+        stat_thread_name("monitor");
+        int tick = 0;
+        time_t basis_since = time(nullptr);
         while (g_server_running) {
-            std::this_thread::sleep_for(std::chrono::seconds(10));
+            std::this_thread::sleep_for(std::chrono::seconds(1));
             if (!g_server_running) break;
 
             time_t now = time(nullptr);
-            vector<string> to_remove;
+            adapt_heartbeat(now);
+            if (g_shards.empty() && !g_steal_mode) adapt_pool(); // (steal / shard ใช้จำนวนคงที่)
+            if (g_trace_dump_requested) { // (kill -USR2: เขียนไฟล์นอก signal handler)
+                g_trace_dump_requested = 0;
+                trace_export();
+            }
+#ifdef CHAT_LOCK_PROFILE
+            if (g_lock_report_requested) { // (kill -USR1)
+                g_lock_report_requested = 0;
+                lock_report();
+            }
+#endif
+
+            // credit ที่ส่งไม่ออก (คิว client เต็ม) ถ้าทุกคนหยุดรอ credit ก็จะไม่มี task มาเรียก flush ให้
+            // ‼️ monitor ต้องเป็นคน flush แทน ไม่งั้น client ค้างจน timeout
+            if (g_credit_pending && g_backlog < CREDIT_BACKLOG_LIMIT) {
+                ArenaScope scope;
+                flush_credits();
+            }
+
+            // timeout หดตาม interval ได้ก็ต่อเมื่อผ่านไป 1 รอบ timeout เต็ม
+            // (client ที่ยังใช้ interval ยาวแบบเดิมจะได้ไม่โดนตัดผิด)
+            if (g_hb_timeout_basis <= g_hb_interval) {
+                basis_since = now;
+            } else if (difftime(now, basis_since) > HB_TIMEOUT_FACTOR * g_hb_timeout_basis) {
+                g_hb_timeout_basis = g_hb_interval.load();
+                basis_since = now;
+            }
+
+            if (!g_shards.empty()) continue; // (shard ตรวจ timeout ของ user ตัวเองใน shard_tick())
+            if (++tick % 5 != 0) continue; // ตรวจ timeout ทุก 5 วินาที
+            double timeout = HB_TIMEOUT_FACTOR * g_hb_timeout_basis;
+
+            vector<UserId> to_remove;
             {
                 // 1. ล็อค hb_mutex เพื่อ "อ่าน"
                 lock_guard<mutex> lock(hb_mutex);
-                for (auto &[user, last] : last_heartbeat) {
-                    if (difftime(now, last) > 15) {
-                        to_remove.push_back(user);
+                for (UserId id = 0; id < session_times.size(); ++id) {
+                    const SessionTimes& t = session_times[id];
+                    if (t.last_seen != 0 && difftime(now, t.last_seen) > timeout) {
+                        to_remove.push_back(id);
                     }
                 }
             } // ปลดล็อค hb_mutex
 
-            for (auto &user : to_remove) {
-                string q, room;
-                bool client_found = false;
-                {
-                    // 2. ล็อค clients_mutex เพื่อ "ลบ"
-                    lock_guard<mutex> lock(clients_mutex);
-                    if (clients.count(user)) {
-                        q = clients[user].reply_queue;
-                        room = clients[user].current_room;
-                        clients.erase(user);
-                        client_found = true;
-                    }
-                } // ปลดล็อค clients_mutex
-
-                if (client_found) {
-                    cout << "[HB] " << user << " timed out (no heartbeat)." << endl;
-                    broadcast_to_room(room, "SYSTEM", user + " has disconnected (timeout).");
-                    mq_unlink(q.c_str());
-                }
-
-                {
-                    // 3. ล็อค hb_mutex เพื่อ "ลบ"
-                    lock_guard<mutex> lock(hb_mutex);
-                    last_heartbeat.erase(user);
-                }
+            // 2. ลบทั้งชุด (ล็อค 1 -> 2 -> 3) โดยตรวจซ้ำว่ายังเงียบอยู่จริง
+            vector<Evicted> evicted;
+            evict_users(to_remove, evicted, [&](const SessionTimes& t) {
+                return difftime(now, t.last_seen) > timeout;
+            });
+            for (const Evicted& ev : evicted) {
+                cout << "[HB] " << ev.name << " timed out (no heartbeat)." << endl;
             }
+            // 3. แจ้งห้องละครั้ง แล้วให้ reaper ลบคิว
+            announce_departures(evicted, PE_TIMEOUT);
+            reap_queues(evicted);
         }
     });
     monitor.detach();
     // --- ‼️ END FIX 3 ---
 
     // --- Room Cleanup Thread (Thread-safe) ---
-    // (โค้ดส่วนนี้ OK: ล็อค 1, ปลดล็อค 1, ล็อค 2+room_mutex, ปลดล็อค 2+room_mutex)
+    // (ล็อค 2+room_mutex เท่านั้น)
     thread room_cleaner([](){
+        stat_thread_name("cleaner");
         while (g_server_running) {
             std::this_thread::sleep_for(std::chrono::seconds(30));
             if (!g_server_running) break;
+            if (!g_shards.empty()) continue; // (shard ลบห้องของตัวเองใน shard_tick())
 
             time_t now = time(nullptr);
 
-            map<string, int> counts;
-            {
-                lock_guard<mutex> lock(clients_mutex);
-                for (auto const& [name, info] : clients) {
-                    if (!info.current_room.empty()) {
-                        counts[info.current_room]++;
-                    }
-                }
-            } // ปลดล็อค clients_mutex
-
             {
-                // ล็อค rooms (2) และ room_mutex
+                // ล็อค rooms (2) และ room_mutex (3)
+                // (จำนวนสมาชิก = rooms[r].members.size() ไม่ต้องนับจาก clients)
                 lock_guard<mutex> lock1(rooms_mutex);
                 lock_guard<mutex> lock2(room_mutex);
 
-                vector<string> to_remove;
-                for (auto &[room, t] : room_last_active) {
-                    if (counts[room] == 0 && difftime(now, t) > 60) {
-                        to_remove.push_back(room);
+                vector<RoomId> to_remove;
+                for (RoomId r = 0; r < rooms.size() && r < room_last_active.size(); ++r) {
+                    if (rooms[r].active && rooms[r].members.empty() && difftime(now, room_last_active[r]) > 60) {
+                        to_remove.push_back(r);
                     }
                 }
 
-                for (auto &r : to_remove) {
-                    rooms.erase(r);
-                    room_last_active.erase(r);
-                    cout << "[ROOM CLEANUP] Room '" << r << "' deleted (idle > 60s)\n";
+                for (RoomId r : to_remove) {
+                    cout << "[ROOM CLEANUP] Room '" << room_names.name(r) << "' deleted (idle > 60s)\n";
+                    rooms[r] = Room{};
+                    g_rooms_version++;
+                    g_room_members.store(r, nullptr);
+                    room_last_active[r] = 0;
+                    presence_drop(r);
+                    dir_op({"-r\t", room_names.name(r)});
+                    room_names.release(r); // ID นี้ว่างให้ห้องใหม่ใช้ได้
                 }
             }
         }
@@ -604,97 +4446,214 @@ int main(int argc, char* argv[]) {
 
     // --- ‼️ FIX 4: แก้ไข Inactive Kick Thread (เหมือน Monitor) ---
     thread idle_kicker([](){
+        stat_thread_name("kicker");
         while (g_server_running) {
             std::this_thread::sleep_for(std::chrono::seconds(15));
             if (!g_server_running) break;
+            if (!g_shards.empty()) continue; // (shard เตะ user ของตัวเองใน shard_tick())
 
             time_t now = time(nullptr);
-            vector<string> to_kick;
+            vector<UserId> to_kick;
             {
-                // 1. ล็อค active_mutex เพื่อ "อ่าน"
-                lock_guard<mutex> lock(active_mutex);
-                for (auto &[user, t] : last_active) {
-                    if (difftime(now, t) > 60) {
-                        to_kick.push_back(user);
-                    }
-                }
-            } // ปลดล็อค active_mutex
-
-            for (auto &user : to_kick) {
-                string q, room;
-                bool client_found = false;
-                {
-                    // 2. ล็อค clients_mutex เพื่อ "ลบ"
-                    lock_guard<mutex> lock(clients_mutex);
-                    if (clients.count(user)) {
-                        q = clients[user].reply_queue;
-                        room = clients[user].current_room;
-                        clients.erase(user);
-                        client_found = true;
+                // 1. ล็อค hb_mutex เพื่อ "อ่าน"
+                lock_guard<mutex> lock(hb_mutex);
+                for (UserId id = 0; id < session_times.size(); ++id) {
+                    const SessionTimes& t = session_times[id];
+                    if (t.last_seen != 0 && difftime(now, t.last_active) > 60) {
+                        to_kick.push_back(id);
                     }
-                } // ปลดล็อค clients_mutex
-
-                if (client_found) {
-                    cout << "[INACTIVE KICK] " << user << " disconnected (idle > 60s)\n";
-                    send_reply(q, "SYSTEM|You were disconnected due to inactivity.");
-                    broadcast_to_room(room, "SYSTEM", user + " has been kicked (inactive).");
-                    mq_unlink(q.c_str());
                 }
+            } // ปลดล็อค hb_mutex
 
-                {
-                    // 3. ล็อค active_mutex เพื่อ "ลบ"
-                    lock_guard<mutex> lock(active_mutex);
-                    last_active.erase(user);
-                }
+            // 2. ลบทั้งชุด (ล็อค 1 -> 2 -> 3) โดยตรวจซ้ำว่ายังไม่มีกิจกรรมจริง
+            vector<Evicted> kicked;
+            evict_users(to_kick, kicked, [&](const SessionTimes& t) {
+                return difftime(now, t.last_active) > 60;
+            });
+            for (const Evicted& ev : kicked) {
+                cout << "[INACTIVE KICK] " << ev.name << " disconnected (idle > 60s)\n";
+                send_reply(ev.reply_queue, "SYSTEM|You were disconnected due to inactivity.");
             }
+            // 3. แจ้งห้องละครั้ง แล้วให้ reaper ลบคิว
+            announce_departures(kicked, PE_KICKED);
+            reap_queues(kicked);
         }
     });
     idle_kicker.detach();
     // --- ‼️ END FIX 4 ---
 
     // --- 3. Main Loop (Producer) ---
-    char buf[MQ_MSGSIZE];
+    // รับตรงลงช่องของ msg_pool แล้วส่งแค่ MsgRef เข้า task_queue (หรือ deque / shard ring)
+    // (โหมด shard: ช่องว่างอยู่ใน g_main_free ของ main loop เอง ไม่ใช้ pool_mutex)
+    bool sharded = !g_shards.empty();
+    auto release_slot = [&](uint32_t slot) {
+        if (sharded) g_main_free.push_back(slot);
+        else msg_pool.release(slot);
+    };
     while (g_server_running) {
-        ssize_t bytes = mq_receive(mq, buf, MQ_MSGSIZE, nullptr);
+        uint32_t slot;
+        if (!(sharded ? shard_acquire(slot) : msg_pool.acquire(slot))) break; // Server กำลังปิด
+        char* buf = msg_pool.data(slot);
+
+        ssize_t bytes = sys_mq_receive(mq, buf, MQ_MSGSIZE, nullptr);
 
         if (bytes < 0) {
+            release_slot(slot);
             if (g_server_running && errno != EINTR) perror("[Server ERROR] mq_receive");
             if (!g_server_running) break; // ออกถ้าถูกสั่งปิด
             continue;
         }
 
-        string msg(buf);
-        if (msg == "STOP|") {
+        // ความยาวจริง (ไม่รวม '\0' ที่ client ส่งมาด้วย)
+        uint32_t len = (uint32_t)strnlen(buf, (size_t)bytes);
+        if (std::string_view(buf, len) == "STOP|") {
+            release_slot(slot);
             break;
         }
 
+        // (ตัดสินที่นี่ แต่ worker / shard เจ้าของ user เป็นคนตอบ BUSY: receive thread ไม่ต้องแตะ registry)
+        MsgRef ref{slot, len, mono_ns()};
+        ref.shed = should_shed(std::string_view(buf, len));
+        if (g_trace_sample > 0 && ++g_trace_counter % g_trace_sample == 0) {
+            ref.trace = ++g_trace_ids;
+            trace_mark(ref.trace, TS_RECV, ref.recv_ns);
+        }
+        if (sharded) {
+            Shard& sh = *g_shards[shard_route(std::string_view(buf, len))];
+            trace_mark(ref.trace, TS_ENQUEUE);
+            sh.ring.push(ref); // (ขนาด ring = จำนวนช่องของ pool: ไม่มีวันเต็ม)
+            sh.park.wake();
+            g_backlog = shards_backlog();
+            continue;
+        }
+        if (g_drr_mode) {
+            UserId uid;
+            uint64_t key;
+            int weight;
+            drr_classify(std::string_view(buf, len), uid, key, weight);
+            trace_mark(ref.trace, TS_ENQUEUE);
+            {
+                lock_guard<mutex> lock(queue_mutex);
+                g_drr.push(ref, uid, key, weight);
+                g_backlog = g_drr.size();
+            }
+            queue_cond.notify_one();
+            continue;
+        }
+        if (g_steal_mode) {
+            Task task;
+            task.msg = ref;
+            trace_mark(ref.trace, TS_ENQUEUE);
+            steal_push((int)(route_key(std::string_view(buf, len)) % g_deques.size()), std::move(task), false);
+            g_backlog = g_steal_pending.load();
+            continue;
+        }
+
+        trace_mark(ref.trace, TS_ENQUEUE);
         {
             lock_guard<mutex> lock(queue_mutex);
-            task_queue.push(msg);
+            task_queue.push(ref);
+            g_backlog = task_queue.size();
         }
         queue_cond.notify_one();
     }
 
     // --- 4. Shutdown ---
+    // (งานที่ signal handler ทำไม่ได้: log + ปลุกทุกคนที่รอ cond อยู่ notify ภายใต้ lock กันปลุกหล่น)
+    if (g_stop_signal != 0) {
+        cout << "\n[Server] Caught " << (g_stop_signal == SIGTERM ? "SIGTERM" : "SIGINT") << ", shutting down..." << endl;
+    }
+    g_server_running = false; // (ออกด้วย "STOP|" ตรงๆ ก็ต้องหยุด worker ด้วย)
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        queue_cond.notify_all();
+    }
+    {
+        lock_guard<mutex> lock(msg_pool.pool_mutex);
+        msg_pool.pool_cond.notify_all();
+    }
     cout << "[Server] Stopping... Waiting for workers to finish..." << endl;
+    {
+        lock_guard<mutex> lock(steal_mutex);
+        steal_cond.notify_all();
+    }
 
     for (thread& t : workers) {
         if (t.joinable()) {
             t.join();
         }
     }
+    {
+        lock_guard<mutex> lock(pool_mutex);
+        for (auto& w : g_pool_workers) {
+            if (w->t.joinable()) w->t.join();
+        }
+    }
+    for (auto& sh : g_shards) {
+        sh->park.wake();
+        if (sh->worker.joinable()) sh->worker.join();
+    }
+    {
+        lock_guard<mutex> lock(reaper_mutex);
+        reaper_cond.notify_all();
+    }
+    reaper.join();
 
     // --- 5. Cleanup ---
     cout << "[Server] Cleaning up queues..." << endl;
     {
         lock_guard<mutex> lock(clients_mutex);
-        for (auto const& [name, info] : clients) {
-            mq_unlink(info.reply_queue.c_str());
+        for (const ClientInfo& info : clients) {
+            if (info.active && !is_mux_queue(info.reply_queue)) mq_unlink(info.reply_queue.c_str());
+        }
+    }
+    for (auto& sh : g_shards) { // (thread ของ shard จบแล้ว: อ่านได้ตรงๆ)
+        for (const ShardUser& u : sh->users) {
+            if (u.info.active && !is_mux_queue(u.info.reply_queue)) mq_unlink(u.info.reply_queue.c_str());
         }
+        g_latency.merge(sh->latency);
+        g_latency_room.merge(sh->latency_room);
+        g_presence_events += sh->presence_events;
+        g_presence_notices += sh->presence_notices;
+        g_presence_suppressed += sh->presence_suppressed;
     }
+    if (g_stop_mq != (mqd_t)-1) mq_close(g_stop_mq);
     mq_close(mq);
     mq_unlink(CONTROL_QUEUE);
 
+    uint64_t shed_total = 0;
+    for (const auto& c : g_shed_count) shed_total += c.load();
+    if (shed_total > 0) {
+        cout << "[ADMIT] Shed " << shed_total << " commands:";
+        for (int c = 0; c < SC_COUNT; ++c) {
+            if (g_shed_count[c].load() > 0) cout << " " << STAT_CMD_NAMES[c] << "=" << g_shed_count[c].load();
+        }
+        cout << endl;
+    }
+    if (g_mux_saved.load() > 0) {
+        cout << "[MUX] Fan-out sends saved by shared reply queues: " << g_mux_saved.load() << endl;
+    }
+    if (g_dir_syncs.load() > 0) {
+        cout << "[DIR] syncs=" << g_dir_syncs.load() << " delta frames=" << g_dir_frames.load() << endl;
+    }
+    if (g_presence_window_ms > 0 || g_presence_max_room > 0) {
+        cout << "[PRESENCE] events=" << g_presence_events.load() << " notices=" << g_presence_notices.load()
+             << " suppressed=" << g_presence_suppressed.load() << endl;
+    }
+    if (g_user_limit.rate > 0 || g_room_limit.rate > 0) {
+        cout << "[RATE]";
+        for (int r = 0; r < RS_COUNT; ++r) {
+            cout << " " << RATE_SCOPE_NAMES[r] << ": rejected=" << g_rate_rejected[r].load()
+                 << " delayed=" << g_rate_delayed[r].load() << ";";
+        }
+        cout << endl;
+    }
+    trace_export();
+    lock_report();
+    const char* scheduler = !g_shards.empty() ? "shards" : (g_steal_mode ? "steal" : (g_drr_mode ? "drr" : "fifo"));
+    print_latency(scheduler, "", g_latency);
+    if (!g_latency_room_name.empty()) print_latency(scheduler, g_latency_room_name.c_str(), g_latency_room);
+    stats_report(); // (เฉพาะ -DCHAT_INSTRUMENT)
     cout << "[Server] Server stopped." << endl;
     return 0;
 }